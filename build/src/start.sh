@@ -14,12 +14,18 @@ killgroup() {
 	trap - SIGINT
 }
 
-./proxy -port 9000 -servername 8000 & 
-./proxy -port 9001 -servername 8000 & 
-./proxy -port 9002 -servername 8000 & 
-./proxy -port 9003 -servername 8000 & 
-./proxy -port 9004 -servername 8000 & 
-./proxy -port 9005 -servername 8000 & 
+# worker threads per proxy, e.g. THREADS=8 ./start.sh
+THREADS=${THREADS:-1}
+# keep each proxy's cache on disk, so a restart comes back warm, e.g.
+# STORE=/var/tmp/tlscache ./start.sh
+[ -n "$STORE" ] && mkdir -p "$STORE"
+
+./proxy -port 9000 -servername 8000 -threads $THREADS ${STORE:+-store $STORE/9000} & 
+./proxy -port 9001 -servername 8000 -threads $THREADS ${STORE:+-store $STORE/9001} & 
+./proxy -port 9002 -servername 8000 -threads $THREADS ${STORE:+-store $STORE/9002} & 
+./proxy -port 9003 -servername 8000 -threads $THREADS ${STORE:+-store $STORE/9003} & 
+./proxy -port 9004 -servername 8000 -threads $THREADS ${STORE:+-store $STORE/9004} & 
+./proxy -port 9005 -servername 8000 -threads $THREADS ${STORE:+-store $STORE/9005} & 
 ./server 8000
 
 
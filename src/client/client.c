@@ -7,194 +7,904 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <tls.h>
-#include <openssl/sha.h>
+#include <zlib.h>
+
+#include "addr.h"
+#include "hrw.h"
+#include "proto.h"
+
+/* the proxies, one "[address:]port [weight]" per line */
+#define MEMBERSHIP	"proxies.conf"
+
+/* how many proxies a single fetch tries, best first */
+#define NCANDIDATES	3
+
+/* batch mode: connections per proxy, and requests in flight on each */
+#define DEFAULT_CONNS	4
+#define DEFAULT_WINDOW	16
+#define MAXWINDOW	64	/* the proxy reads no further ahead than this */
+
+/* a file to fetch in batch mode */
+struct item {
+	char *name;
+	size_t namelen;
+	int status;		/* -1 until it is answered */
+	uint64_t size;
+	void *owner;		/* the connection it was asked on */
+};
+
+/* the files that hash to one proxy, shared by its connections */
+struct group {
+	const char *proxy;
+	struct item **items;
+	size_t nitems;
+	size_t next;		/* the next one to ask for */
+	int connected;		/* connections that got through */
+};
+
+/* a connection to one proxy, from connect to close */
+struct conn {
+	struct tls_config *cfg;
+	struct tls *tls;
+	int sd, sfd;
+};
+
+/* the root CA, read once and shared by every connection */
+static uint8_t *ca;
+static size_t calen;
+
+static int window = DEFAULT_WINDOW;
+static int accept_deflate = PROTO_ACCEPT_DEFLATE;	/* 0 with -raw */
+static uint64_t range[2];	/* offset and length, with -range */
+static int ranged;
+
+static struct hrw *members;
+
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s filename\n", __progname);
+	fprintf(stderr, "usage: %s [-range offset:length] filename\n"
+	    "       %s -batch manifest|- [-conns n] [-window n]\n"
+	    "       (either may start with -members file and -raw)\n",
+	    __progname, __progname);
 	exit(1);
 }
 
+static int getcount(const char *arg, int min, int max)
+{
+	char *ep;
+	long n;
+
+	errno = 0;
+	n = strtol(arg, &ep, 10);
+	if (*arg == '\0' || *ep != '\0' || errno == ERANGE || n < min || n > max) {
+		fprintf(stderr, "%s - must be a number from %d to %d\n", arg, min, max);
+		usage();
+	}
+	return n;
+}
 
-static u_short hash(char *filename)
+/* an offset:length pair for -range */
+static void getrange(const char *arg)
 {
-	size_t size = strlen(filename);
-	char temp[size + 5];
-	char proxyName[5];
-	char hash[20];
-	proxyName[4] = 0;
-	strlcpy(temp, filename, size + 1);
-	u_short proxies[6] = {9000, 9001, 9002, 9003, 9004, 9005};
-	int sumHash;
-	int highestHash = 0;
-	u_short highestProxy = proxies[0];
-	for (unsigned int i = 0; i < 6; ++i)
-	{
-		sumHash = 0;
-		temp[size] = 0;
-		snprintf(proxyName, 5, "%i", proxies[i]);
-		strlcat(temp, proxyName, size + 5);
-		SHA1(temp, strlen(temp) + 1, hash);
-		for (unsigned int j = 0; j < 20; ++j)
-		{
-			sumHash += hash[j];
-		}
-		
-		if (sumHash > highestHash)
-		{
-			highestHash = sumHash;
-			highestProxy = proxies[i];
+	const char *len;
+	char *ep;
+
+	errno = 0;
+	range[0] = strtoull(arg, &ep, 10);
+	if (ep != arg && *ep == ':' && *arg != '-' && errno != ERANGE) {
+		len = ep + 1;
+		range[1] = strtoull(len, &ep, 10);
+		if (ep != len && *ep == '\0' && *len != '-' && errno != ERANGE) {
+			ranged = 1;
+			return;
 		}
+	}
+	fprintf(stderr, "%s - must be offset:length\n", arg);
+	usage();
+}
 
+/*
+ * TLS session resumption. libtls reads the session to resume from a
+ * file and writes the new one back after the handshake. Other clients
+ * may be doing the same at the same time, so libtls gets a private
+ * copy, and the shared file is only ever replaced whole, by rename.
+ */
+static int session_load(const char *path)
+{
+	FILE *tmp;
+	char buf[4096];
+	ssize_t n;
+	int fd, sfd;
+
+	if ((tmp = tmpfile()) == NULL)
+		return -1;
+	if ((fd = open(path, O_RDONLY)) != -1) {
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			if (write(fileno(tmp), buf, n) != n) {
+				/* an empty file just means a full handshake */
+				ftruncate(fileno(tmp), 0);
+				break;
+			}
+		close(fd);
 	}
-	printf("Highest hash value: %i\n", highestHash);
-	printf("Proxy to use: %i\n", highestProxy);
-	return highestProxy;
+	/* the copy has no name, so it is gone once sfd is closed */
+	sfd = dup(fileno(tmp));
+	fclose(tmp);
+	return sfd;
 }
 
-int main(int argc, char *argv[])
+static void session_save(int sfd, const char *path)
 {
-	struct sockaddr_in server_sa;
-	char buffer[80], *ep;
-	size_t maxread;
-	ssize_t r, rc;
-	u_short port;
-	u_long p;
-	int sd, i;
-	struct tls_config *tls_cfg = NULL;
-	struct tls *tls_ctx = NULL;
-	
-	if (argc != 2)
-		usage();
+	char buf[4096], tmppath[PATH_MAX];
+	ssize_t n;
+	off_t off = 0;
+	int fd;
 
-	strcpy(buffer, argv[1]);
-	port = hash(buffer);
+	snprintf(tmppath, sizeof(tmppath), "%s.%ld.%lx", path, (long)getpid(),
+	    (unsigned long)pthread_self());
+	if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+		return;
+	while ((n = pread(sfd, buf, sizeof(buf), off)) > 0) {
+		if (write(fd, buf, n) != n)
+			break;
+		off += n;
+	}
+	if (close(fd) == -1 || n != 0 || rename(tmppath, path) == -1)
+		unlink(tmppath);
+}
 
-	/* set up TLS */
-	if (tls_init() == -1)
-		errx(1, "unable to initialize TLS");
-	if ((tls_cfg = tls_config_new()) == NULL)
-		errx(1, "unable to allocate TLS config");
-	if (tls_config_set_ca_file(tls_cfg, "../../certificates/root.pem") == -1)
-		errx(1, "unable to set root CA file");
+/* done with c; a connection that failed gets no close_notify */
+static void conn_close(struct conn *c, int ok)
+{
+	int i;
+
+	if (c->tls != NULL && ok) {
+		do {
+			i = tls_close(c->tls);
+		} while(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	}
+	tls_free(c->tls);
+	tls_config_free(c->cfg);
+	if (c->sd != -1)
+		close(c->sd);
+	if (c->sfd != -1)
+		close(c->sfd);
+}
+
+/*
+ * connect to proxy and do the TLS handshake, resuming the session from
+ * our last connection to it if we have one; LibreSSL only resumes TLS
+ * 1.2 sessions
+ */
+static int conn_open(struct conn *c, const char *proxy)
+{
+	struct sockaddr_in server_sa;
+	char sessionPath[PATH_MAX];
+	int i;
+
+	c->tls = NULL;
+	c->sd = c->sfd = -1;
+	if ((c->cfg = tls_config_new()) == NULL) {
+		warnx("unable to allocate TLS config");
+		return -1;
+	}
+	if (tls_config_set_ca_mem(c->cfg, ca, calen) == -1) {
+		warnx("unable to set root CA file");
+		goto fail;
+	}
+	snprintf(sessionPath, sizeof(sessionPath), ".session-%s", proxy);
+	if ((c->sfd = session_load(sessionPath)) == -1 ||
+	    tls_config_set_session_fd(c->cfg, c->sfd) == -1 ||
+	    tls_config_set_protocols(c->cfg, TLS_PROTOCOL_TLSv1_2) == -1) {
+		warnx("not resuming TLS sessions");
+		if (c->sfd != -1)
+			close(c->sfd);
+		c->sfd = -1;
+	}
 
 	/*
 	 * first set up "server_sa" to be the location of the server
 	 */
-	char localhost[] = "127.0.0.1";
-	memset(&server_sa, 0, sizeof(server_sa));
-	server_sa.sin_family = AF_INET;
-	server_sa.sin_port = htons(port);
-	server_sa.sin_addr.s_addr = inet_addr(localhost);
-	if (server_sa.sin_addr.s_addr == INADDR_NONE) {
-		fprintf(stderr, "Invalid IP address %s\n", localhost);
-		usage();
+	if (addr_parse(proxy, &server_sa) == -1) {
+		warnx("%s - not a proxy address", proxy);
+		goto fail;
 	}
 
 	/* ok now get a socket. */
-	if ((sd=socket(AF_INET,SOCK_STREAM,0)) == -1)
-		err(1, "socket failed");
+	if ((c->sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		warn("socket failed");
+		goto fail;
+	}
 
 	/* connect the socket to the server described in "server_sa" */
-	if (connect(sd, (struct sockaddr *)&server_sa, sizeof(server_sa)) == -1)
-		err(1, "connect failed");
-
-	if ((tls_ctx = tls_client()) == NULL)
-		errx(1, "tls client creation failed");
-	if (tls_configure(tls_ctx, tls_cfg) == -1)
-		errx(1, "tls configuration failed (%s)", tls_error(tls_ctx));
-	if (tls_connect_socket(tls_ctx, sd, "localhost") == -1)
-		errx(1, "tls connection failed (%s)", tls_error(tls_ctx));
-
+	if (connect(c->sd, (struct sockaddr *)&server_sa, sizeof(server_sa)) == -1) {
+		warn("connect to %s failed", proxy);
+		goto fail;
+	}
 
+	if ((c->tls = tls_client()) == NULL) {
+		warnx("tls client creation failed");
+		goto fail;
+	}
+	if (tls_configure(c->tls, c->cfg) == -1 ||
+	    tls_connect_socket(c->tls, c->sd, "localhost") == -1) {
+		warnx("tls connection failed (%s)", tls_error(c->tls));
+		goto fail;
+	}
 	do {
-		if ((i = tls_handshake(tls_ctx)) == -1)
-			errx(1, "tls handshake failed (%s)", tls_error(tls_ctx));
+		if ((i = tls_handshake(c->tls)) == -1) {
+			warnx("tls handshake failed (%s)", tls_error(c->tls));
+			goto fail;
+		}
 	} while(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	if (c->sfd != -1)
+		session_save(c->sfd, sessionPath);
+	return 0;
+fail:
+	conn_close(c, 0);
+	return -1;
+}
 
-	/*
-	 * finally, we are connected. find out what magnificent wisdom
-	 * our server is going to send to us - since we really don't know
-	 * how much data the server could send to us, we have decided
-	 * we'll stop reading when either our buffer is full, or when
-	 * we get an end of file condition from the read when we read
-	 * 0 bytes - which means that we pretty much assume the server
-	 * is going to send us an entire message, then close the connection
-	 * to us, so that we see an end-of-file condition on the read.
-	 *
-	 * we also make sure we handle EINTR in case we got interrupted
-	 * by a signal.
-	 */
-	
-	ssize_t written, w;
-	w = 0;
-	written = 0;
-	while (written < strlen(buffer)) {
-		w = tls_write(tls_ctx, buffer + written,
-		    strlen(buffer) - written);
+static int send_all(struct tls *tls_ctx, const void *buf, size_t len)
+{
+	ssize_t w;
+	size_t written = 0;
+
+	while (written < len) {
+		w = tls_write(tls_ctx, (const char *)buf + written,
+		    len - written);
 
 		if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
 			continue;
 
 		if (w < 0) {
-			errx(1, "TLS write failed (%s)", tls_error(tls_ctx));
+			warnx("TLS write failed (%s)", tls_error(tls_ctx));
+			return -1;
+		}
+		written += w;
+	}
+	return 0;
+}
+
+static int recv_all(struct tls *tls_ctx, void *buf, size_t len)
+{
+	ssize_t r;
+	size_t rc = 0;
+
+	while (rc < len) {
+		r = tls_read(tls_ctx, (char *)buf + rc, len - rc);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+			continue;
+		if (r < 0) {
+			warnx("tls_read failed (%s)", tls_error(tls_ctx));
+			return -1;
+		}
+		if (r == 0) {
+			warnx("connection closed before the response");
+			return -1;
 		}
-		else
-			written += w;
+		rc += r;
+	}
+	return 0;
+}
+
+/* one request: the frame and the name, and the range if any, in one write */
+static int send_request(struct tls *tls_ctx, uint32_t id, const char *name,
+    size_t namelen)
+{
+	unsigned char request[PROTO_REQLEN + PROTO_MAXNAME + PROTO_RANGELEN];
+	struct proto_req rq = { .version = PROTO_VERSION,
+	    .type = PROTO_GET | accept_deflate, .namelen = namelen, .id = id };
+	size_t len = PROTO_REQLEN + namelen;
+
+	if (ranged)
+		rq.type = PROTO_RANGE;
+	proto_put_req(request, &rq);
+	memcpy(request + PROTO_REQLEN, name, namelen);
+	if (ranged) {
+		proto_put64(request + len, range[0]);
+		proto_put64(request + len + 8, range[1]);
+		len += PROTO_RANGELEN;
 	}
-	i = 0;
+	return send_all(tls_ctx, request, len);
+}
+
+static int read_response(struct tls *tls_ctx, struct proto_resp *rs)
+{
+	unsigned char hdr[PROTO_RESPLEN];
+
+	if (recv_all(tls_ctx, hdr, sizeof(hdr)) == -1)
+		return -1;
+	proto_get_resp(hdr, rs);
+	if (rs->version != PROTO_VERSION) {
+		warnx("proxy speaks protocol version %u", rs->version);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * A deflated body on its way to the file: the header with the file's
+ * size first, then the zlib stream, inflated as it comes.
+ */
+struct inflater {
+	z_stream zs;
+	unsigned char hdr[PROTO_ZHDRLEN];
+	size_t hdroff;
+	uint64_t size;
+	int done;
+};
+
+/*
+ * write n bytes of the body at p to file, inflating them first if z is
+ * not NULL. 0 if that fails, or the body is no good.
+ */
+static int body_write(FILE *file, struct inflater *z, char *p, size_t n)
+{
+	static __thread char out[CHUNKSIZE];
+	size_t k;
+	int ret;
+
+	if (z == NULL)
+		return fwrite(p, 1, n, file) == n;
+	while (z->hdroff < sizeof(z->hdr) && n > 0) {
+		z->hdr[z->hdroff++] = *p++;
+		--n;
+	}
+	z->zs.next_in = (Bytef *)p;
+	z->zs.avail_in = n;
+	while (z->zs.avail_in > 0 && !z->done) {
+		z->zs.next_out = (Bytef *)out;
+		z->zs.avail_out = sizeof(out);
+		if ((ret = inflate(&z->zs, Z_NO_FLUSH)) != Z_OK &&
+		    ret != Z_STREAM_END)
+			return 0;
+		z->done = ret == Z_STREAM_END;
+		k = sizeof(out) - z->zs.avail_out;
+		if (fwrite(out, 1, k, file) != k)
+			return 0;
+	}
+	return z->zs.avail_in == 0;
+}
+
+/*
+ * the body of a PROTO_OK response, written to clientfiles/ as it comes
+ * and inflated on the way if it is deflated. 1 if the file is there, 0
+ * if we could not write it, -1 if the connection failed. A file we
+ * cannot write is still read to the end, so the connection stays good
+ * for the next one. The file only takes its name once it is all there,
+ * so a batch that asks for it twice never has two writers on it.
+ */
+static int receive_file(struct tls *tls_ctx, const char *name, uint64_t size,
+    int encoding)
+{
+	static __thread char fileBuffer[CHUNKSIZE];
+	char filePath[sizeof("clientfiles/") + PROTO_MAXNAME];
+	char tmpPath[sizeof(filePath) + 32];
+	struct inflater inf, *z = NULL;
+	uint64_t got = 0;
+	size_t maxread;
+	ssize_t r;
+	FILE *file;
+	int ok = 1;
+
+	snprintf(filePath, sizeof(filePath), "clientfiles/%s", name);
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%ld.%lx", filePath,
+	    (long)getpid(), (unsigned long)pthread_self());
+	if ((file = fopen(tmpPath, "w")) == NULL) {
+		warn("unable to open %s", tmpPath);
+		ok = 0;
+	}
+	if (encoding == PROTO_DEFLATE) {
+		memset(&inf, 0, sizeof(inf));
+		if (inflateInit(&inf.zs) != Z_OK) {
+			warnx("inflateInit failed");
+			ok = 0;
+		} else
+			z = &inf;
+	} else if (encoding != PROTO_RAW) {
+		warnx("%s: unknown encoding %d", name, encoding);
+		ok = 0;
+	}
+
+	//get file from proxy, writing it out as it comes
+	while (got < size) {
+		maxread = size - got < CHUNKSIZE ? size - got : CHUNKSIZE;
+		r = tls_read(tls_ctx, fileBuffer, maxread);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+			continue;
+		if (r <= 0) {
+			if (r < 0)
+				warnx("tls_read failed (%s)", tls_error(tls_ctx));
+			else
+				warnx("connection closed after %llu of %llu bytes",
+				    (unsigned long long)got, (unsigned long long)size);
+			if (z != NULL)
+				inflateEnd(&z->zs);
+			if (file != NULL) {
+				fclose(file);
+				unlink(tmpPath);
+			}
+			return -1;
+		}
+		if (ok && !body_write(file, z, fileBuffer, r)) {
+			warnx("write to %s failed", filePath);
+			ok = 0;
+		}
+		got += r;
+	}
+	if (z != NULL) {
+		if (ok && (!z->done ||
+		    z->zs.total_out != proto_get64(z->hdr))) {
+			warnx("%s: bad deflated body", name);
+			ok = 0;
+		}
+		inflateEnd(&z->zs);
+	}
+	if (file != NULL && (fclose(file) == EOF || !ok ||
+	    rename(tmpPath, filePath) == -1)) {
+		if (ok)
+			warn("write to %s failed", filePath);
+		unlink(tmpPath);
+		ok = 0;
+	}
+	if (ok)
+		printf("File %s received, written to %s\n", name, filePath);
+	return ok;
+}
+
+/*
+ * the body of the answer to a RANGE request: the size of the file, then
+ * the bytes, written into clientfiles/ where they belong in the file.
+ * The file is created if it is not there, and otherwise only those
+ * bytes change. 1 if they are there, 0 if we could not write them, -1
+ * if the connection failed.
+ */
+static int receive_range(struct tls *tls_ctx, const char *name, uint64_t size)
+{
+	static char fileBuffer[CHUNKSIZE];
+	char filePath[sizeof("clientfiles/") + PROTO_MAXNAME];
+	unsigned char hdr[PROTO_RANGEHDRLEN];
+	uint64_t got = 0;
+	size_t n;
+	int fd, ok = 1;
+
+	if (size < sizeof(hdr)) {
+		warnx("%s: bad range", name);
+		return -1;
+	}
+	if (recv_all(tls_ctx, hdr, sizeof(hdr)) == -1)
+		return -1;
+	size -= sizeof(hdr);
+	printf("Client: File size is %llu bytes, getting %llu from %llu on\n",
+	    (unsigned long long)proto_get64(hdr), (unsigned long long)size,
+	    (unsigned long long)range[0]);
+	snprintf(filePath, sizeof(filePath), "clientfiles/%s", name);
+	if ((fd = open(filePath, O_WRONLY | O_CREAT, 0644)) == -1) {
+		warn("unable to open %s", filePath);
+		ok = 0;
+	}
+	while (got < size) {
+		n = size - got < sizeof(fileBuffer) ? size - got : sizeof(fileBuffer);
+		if (recv_all(tls_ctx, fileBuffer, n) == -1) {
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+		if (ok && pwrite(fd, fileBuffer, n, range[0] + got) != (ssize_t)n) {
+			warn("write to %s failed", filePath);
+			ok = 0;
+		}
+		got += n;
+	}
+	if (fd != -1 && close(fd) == -1 && ok) {
+		warn("write to %s failed", filePath);
+		ok = 0;
+	}
+	if (ok)
+		printf("File %s received, bytes %llu to %llu written to %s\n",
+		    name, (unsigned long long)range[0],
+		    (unsigned long long)(range[0] + size), filePath);
+	return ok;
+}
+
+/* fetch one file, or a range of it, on a connection of its own */
+static int fetch_one(char *name)
+{
+	struct proto_resp rs;
+	struct conn c;
+	size_t namelen;
+	size_t order[NCANDIDATES], n, j;
+	int i;
+
+	if ((namelen = strlen(name)) == 0 || namelen > PROTO_MAXNAME)
+		errx(1, "file names are 1 to %d bytes long", PROTO_MAXNAME);
+
+	/* the best proxy for it, or the next best if that one is down */
+	n = hrw_rank(members, name, namelen, order, NCANDIDATES);
+	for (j = 0; j < n; ++j) {
+		printf("Proxy to use: %s\n", hrw_name(members, order[j]));
+		if (conn_open(&c, hrw_name(members, order[j])) == 0)
+			break;
+	}
+	if (j == n)
+		return 1;
+	printf("Client: %s TLS handshake\n",
+	    tls_conn_session_resumed(c.tls) ? "resumed" : "full");
+
+	/*
+	 * finally, we are connected. ask for the file and tell the proxy
+	 * that is all we want; it still answers before it closes.
+	 */
+	if (send_request(c.tls, 1, name, namelen) == -1)
+		goto fail;
 	do {
-		i = tls_close(tls_ctx);
+		i = tls_close(c.tls);
 	} while(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
-	
-	//get filesize from proxy
-	int size = -1;
-	r = tls_read(tls_ctx, &size, sizeof(size));
-	
-	if (size <= 0)
+
+	if (read_response(c.tls, &rs) == -1)
+		goto fail;
+	if (rs.status != PROTO_OK && rs.status != PROTO_NOTFOUND) {
+		warnx("%s: %s", name, proto_strstatus(rs.status));
+		goto fail;
+	}
+	if (rs.id != 1) {
+		warnx("response to request %u, not ours", rs.id);
+		goto fail;
+	}
+
+	if (rs.status == PROTO_NOTFOUND)
+	{
+		printf("Client: %s does not exist; no file received\n", name);
+	}
+	else if (ranged)
 	{
-		printf("Client: File size is %i bytes\n", size);
-		printf("Client: %s does not exist; no file received\n", buffer);
+		if (receive_range(c.tls, name, rs.size) != 1)
+			goto fail;
 	}
 	else
 	{
-		printf("Client: File size is %i bytes\n", size);
-		char fileBuffer[size];
-		
-		//get file from proxy
-		r = -1;
-		rc = 0;
-		maxread = size;
-		while ((r != 0) && rc < maxread) {
-			r = tls_read(tls_ctx, fileBuffer + rc, maxread - rc);
-			if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
-				continue;
-			if (r < 0) {
-				err(1, "tls_read failed (%s)", tls_error(tls_ctx));
-			} else
-				rc += r;
-		}
-		
-		char filePath[160];
-		strcpy(filePath, "clientfiles/");
-		printf("File %s received, writing to %s\n", buffer, filePath);
-		
-		strcat(filePath, buffer);
-		FILE *file = fopen(filePath, "w");
-		for (int a = 0; a < size; ++a)
-		{
-			fputc(fileBuffer[a], file);
-		}
-	}
-	
-	close(sd);
-	return(0);
+		printf("Client: File size is %llu bytes%s\n",
+		    (unsigned long long)rs.size,
+		    rs.encoding == PROTO_DEFLATE ? ", deflated" : "");
+		if (receive_file(c.tls, name, rs.size, rs.encoding) != 1)
+			goto fail;
+	}
+	conn_close(&c, 0);
+	return 0;
+fail:
+	conn_close(&c, 0);
+	return 1;
+}
+
+/*
+ * One connection's share of a batch: keep up to window requests in
+ * flight and take the answers in whatever order they come, until the
+ * group has nothing left to ask for. The connections to a proxy all
+ * take the next file from its group as they have room. A request's id
+ * is its file's index in the group.
+ */
+static void *batch_conn(void *arg)
+{
+	struct group *g = arg;
+	struct proto_resp rs;
+	struct item *it;
+	struct conn c;
+	size_t i;
+	int inflight = 0, ret;
+
+	if (conn_open(&c, g->proxy) == -1)
+		return NULL;
+	__atomic_add_fetch(&g->connected, 1, __ATOMIC_RELAXED);
+	for (;;) {
+		while (inflight < window && (i = __atomic_fetch_add(&g->next, 1,
+		    __ATOMIC_RELAXED)) < g->nitems) {
+			it = g->items[i];
+			it->owner = &c;
+			if (send_request(c.tls, i, it->name, it->namelen) == -1)
+				goto fail;
+			++inflight;
+		}
+		if (inflight == 0)
+			break;
+
+		if (read_response(c.tls, &rs) == -1)
+			goto fail;
+		if (rs.id >= g->nitems || (it = g->items[rs.id])->owner != &c ||
+		    it->status != -1) {
+			warnx("response to request %u, not ours", rs.id);
+			goto fail;
+		}
+		--inflight;
+		if (rs.status != PROTO_OK) {
+			if (rs.status == PROTO_NOTFOUND)
+				printf("Client: %s does not exist\n", it->name);
+			else
+				warnx("%s: %s", it->name, proto_strstatus(rs.status));
+			it->status = rs.status;
+			continue;
+		}
+		if ((ret = receive_file(c.tls, it->name, rs.size,
+		    rs.encoding)) == -1)
+			goto fail;
+		it->size = rs.size;
+		it->status = ret ? PROTO_OK : PROTO_ERROR;
+	}
+	conn_close(&c, 1);
+	return NULL;
+fail:
+	/* whatever was still in flight on this connection is lost */
+	conn_close(&c, 0);
+	return NULL;
+}
+
+/* the names in manifest, one per line */
+static struct item *read_manifest(const char *manifest, size_t *nitems)
+{
+	struct item *items = NULL, *tmp;
+	size_t n = 0, cap = 0, linesize = 0;
+	char *line = NULL;
+	ssize_t len;
+	FILE *fp;
+
+	if (strcmp(manifest, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(manifest, "r")) == NULL)
+		err(1, "%s", manifest);
+	while ((len = getline(&line, &linesize, fp)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if ((size_t)len > PROTO_MAXNAME || strlen(line) != (size_t)len) {
+			warnx("%s: skipping a bad file name", manifest);
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			if ((tmp = reallocarray(items, cap, sizeof(*items))) == NULL)
+				err(1, "reallocarray");
+			items = tmp;
+		}
+		if ((items[n].name = strdup(line)) == NULL)
+			err(1, "strdup");
+		items[n].namelen = len;
+		items[n].status = -1;
+		items[n].size = 0;
+		items[n].owner = NULL;
+		++n;
+	}
+	if (ferror(fp))
+		err(1, "%s", manifest);
+	if (fp != stdin)
+		fclose(fp);
+	free(line);
+	*nitems = n;
+	return items;
+}
+
+/*
+ * One round of a batch: every file not yet asked for goes to the best
+ * proxy that is not down, and each proxy gets up to conns connections
+ * for its share. A proxy none of them could reach is down from then
+ * on. Returns how many connections got through.
+ */
+static size_t batch_round(struct item *items, size_t nitems, char *down,
+    int conns)
+{
+	struct group *groups, *g;
+	pthread_t *threads;
+	size_t nproxies = hrw_count(members), *order, *proxies;
+	size_t i, j, n, ndown = 0, nthreads = 0, nconnected = 0;
+	int k;
+
+	if ((groups = calloc(nproxies, sizeof(*groups))) == NULL ||
+	    (order = calloc(nproxies, sizeof(*order))) == NULL ||
+	    (proxies = calloc(nitems ? nitems : 1, sizeof(*proxies))) == NULL ||
+	    (threads = calloc(nproxies * conns, sizeof(*threads))) == NULL)
+		err(1, "calloc");
+	for (j = 0; j < nproxies; ++j)
+		ndown += down[j];
+
+	/* sort the files by proxy */
+	for (i = 0; i < nitems; ++i) {
+		proxies[i] = nproxies;
+		if (items[i].owner != NULL || items[i].status != -1)
+			continue;
+		n = hrw_rank(members, items[i].name, items[i].namelen, order,
+		    ndown + 1);
+		for (j = 0; j < n; ++j)
+			if (!down[order[j]]) {
+				proxies[i] = order[j];
+				++groups[order[j]].nitems;
+				break;
+			}
+	}
+	for (j = 0; j < nproxies; ++j) {
+		groups[j].proxy = hrw_name(members, j);
+		if (groups[j].nitems == 0)
+			continue;
+		if ((groups[j].items = calloc(groups[j].nitems,
+		    sizeof(*groups[j].items))) == NULL)
+			err(1, "calloc");
+		groups[j].nitems = 0;
+	}
+	for (i = 0; i < nitems; ++i) {
+		if (proxies[i] == nproxies)
+			continue;
+		g = &groups[proxies[i]];
+		g->items[g->nitems++] = &items[i];
+	}
+
+	for (j = 0; j < nproxies; ++j)
+		for (k = 0; k < conns && (size_t)k < groups[j].nitems; ++k) {
+			if ((errno = pthread_create(&threads[nthreads], NULL,
+			    batch_conn, &groups[j])) != 0) {
+				warn("pthread_create");
+				break;
+			}
+			++nthreads;
+		}
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+
+	for (j = 0; j < nproxies; ++j) {
+		if (groups[j].nitems > 0 && groups[j].connected == 0) {
+			warnx("proxy %s is down, trying the next best", groups[j].proxy);
+			down[j] = 1;
+		}
+		nconnected += groups[j].connected;
+		free(groups[j].items);
+	}
+	free(threads);
+	free(proxies);
+	free(order);
+	free(groups);
+	return nconnected;
+}
+
+/*
+ * Fetch every file in manifest over a few long-lived connections to
+ * each proxy, instead of a process, a connection and a handshake per
+ * file, then say how long it took. Files whose proxy is down go to
+ * their next best proxy, as with a single fetch.
+ */
+static int fetch_batch(const char *manifest, int conns)
+{
+	struct timespec start, end;
+	struct item *items;
+	size_t nitems, i, nconns = 0;
+	size_t nok = 0, nmissing = 0, nfailed = 0;
+	unsigned long long bytes = 0;
+	double secs;
+	char *down;
+	int round;
+
+	items = read_manifest(manifest, &nitems);
+	if ((down = calloc(hrw_count(members), 1)) == NULL)
+		err(1, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < NCANDIDATES; ++round) {
+		nconns += batch_round(items, nitems, down, conns);
+		for (i = 0; i < nitems; ++i)
+			if (items[i].owner == NULL && items[i].status == -1)
+				break;
+		if (i == nitems)
+			break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < nitems; ++i) {
+		if (items[i].status == PROTO_OK) {
+			++nok;
+			bytes += items[i].size;
+		} else if (items[i].status == PROTO_NOTFOUND)
+			++nmissing;
+		else {
+			if (items[i].status == -1)
+				warnx("%s: not fetched", items[i].name);
+			++nfailed;
+		}
+		free(items[i].name);
+	}
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+	printf("Client: %zu files: %zu received, %zu missing, %zu failed\n",
+	    nitems, nok, nmissing, nfailed);
+	printf("Client: %llu bytes in %.3f s over %zu connections, "
+	    "%.1f files/s, %.2f MB/s\n", bytes, secs, nconns,
+	    nitems / secs, bytes / secs / 1e6);
+
+	free(down);
+	free(items);
+	return nfailed != 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option longopts[] = {
+		{ "batch",	required_argument,	NULL,	'b' },
+		{ "conns",	required_argument,	NULL,	'c' },
+		{ "window",	required_argument,	NULL,	'w' },
+		{ "members",	required_argument,	NULL,	'm' },
+		{ "raw",	no_argument,		NULL,	'r' },
+		{ "range",	required_argument,	NULL,	'R' },
+		{ NULL,		0,			NULL,	0 }
+	};
+	const char *manifest = NULL, *membership = NULL;
+	int ch, conns = DEFAULT_CONNS;
+
+	while ((ch = getopt_long_only(argc, argv, "", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'b':
+			manifest = optarg;
+			break;
+		case 'c':
+			conns = getcount(optarg, 1, 64);
+			break;
+		case 'w':
+			window = getcount(optarg, 1, MAXWINDOW);
+			break;
+		case 'm':
+			membership = optarg;
+			break;
+		case 'r':
+			accept_deflate = 0;
+			break;
+		case 'R':
+			getrange(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	/* a file name, or a manifest, but not both; ranges are one at a time */
+	if (optind != argc - (manifest == NULL) || (ranged && manifest != NULL))
+		usage();
+
+	/*
+	 * the proxies to choose from; without a membership file, the six
+	 * that start.sh runs
+	 */
+	if (membership != NULL || access(MEMBERSHIP, F_OK) == 0) {
+		if ((members = hrw_load(membership ? membership : MEMBERSHIP)) == NULL)
+			exit(1);
+	} else {
+		members = hrw_new();
+		for (int i = 0; i < 6; ++i) {
+			char proxy[8];
+
+			snprintf(proxy, sizeof(proxy), "%d", 9000 + i);
+			hrw_add(members, proxy, 1);
+		}
+	}
+
+	/* set up TLS */
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+	if ((ca = tls_load_file("../../certificates/root.pem", &calen, NULL)) == NULL)
+		errx(1, "unable to set root CA file");
+
+	/* a proxy that drops us must not take the whole batch down */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (manifest == NULL)
+		return fetch_one(argv[optind]);
+	return fetch_batch(manifest, conns);
 }
@@ -0,0 +1,40 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "addr.h"
+
+/* -1 if name is not an address we understand */
+int addr_parse(const char *name, struct sockaddr_in *sa)
+{
+	char host[INET_ADDRSTRLEN];
+	const char *portstr = name, *colon;
+	char *ep;
+	u_long p;
+
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((colon = strrchr(name, ':')) != NULL) {
+		if ((size_t)(colon - name) >= sizeof(host))
+			return -1;
+		memcpy(host, name, colon - name);
+		host[colon - name] = '\0';
+		if (inet_pton(AF_INET, host, &sa->sin_addr) != 1)
+			return -1;
+		portstr = colon + 1;
+	}
+	errno = 0;
+	p = strtoul(portstr, &ep, 10);
+	if (*portstr == '\0' || *ep != '\0' || errno == ERANGE || p == 0 ||
+	    p > USHRT_MAX)
+		return -1;
+	sa->sin_port = htons(p);
+	return 0;
+}
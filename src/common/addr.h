@@ -0,0 +1,12 @@
+#ifndef ADDR_H
+#define ADDR_H
+
+#include <netinet/in.h>
+
+/*
+ * Proxies are named "[address:]port", in membership files and on the
+ * command line. The address is IPv4 and defaults to 127.0.0.1.
+ */
+int	addr_parse(const char *, struct sockaddr_in *);
+
+#endif /* ADDR_H */
@@ -0,0 +1,15 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fast non-cryptographic hashes, for filters and tables where SHA is
+ * far more than we need.
+ */
+void	hash128(const void *, size_t, uint64_t, uint64_t[2]);
+uint64_t hash64(const void *, size_t, uint64_t);
+uint64_t hash_mix64(uint64_t);
+
+#endif /* HASH_H */
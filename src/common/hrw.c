@@ -0,0 +1,203 @@
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "hrw.h"
+
+#define HRW_SEED	0x9e3779b97f4a7c15ULL
+
+struct hrw_node {
+	char *name;
+	double weight;
+	uint64_t seed;		/* hash of the name */
+};
+
+struct hrw {
+	struct hrw_node *nodes;
+	size_t nnodes, cap;
+	int weighted;		/* not all weights are the same */
+};
+
+struct hrw *hrw_new(void)
+{
+	struct hrw *h;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL)
+		err(1, "calloc");
+	return h;
+}
+
+/* -1 if the name is taken or the weight is no good */
+int hrw_add(struct hrw *h, const char *name, double weight)
+{
+	struct hrw_node *n;
+	size_t i;
+
+	if (!(weight > 0) || !isfinite(weight))
+		return -1;
+	for (i = 0; i < h->nnodes; ++i)
+		if (strcmp(h->nodes[i].name, name) == 0)
+			return -1;
+	if (h->nnodes == h->cap) {
+		h->cap = h->cap ? h->cap * 2 : 8;
+		if ((n = reallocarray(h->nodes, h->cap, sizeof(*n))) == NULL)
+			err(1, "reallocarray");
+		h->nodes = n;
+	}
+	n = &h->nodes[h->nnodes];
+	if ((n->name = strdup(name)) == NULL)
+		err(1, "strdup");
+	n->weight = weight;
+	n->seed = hash64(name, strlen(name), HRW_SEED);
+	if (h->nnodes > 0 && weight != h->nodes[0].weight)
+		h->weighted = 1;
+	++h->nnodes;
+	return 0;
+}
+
+/* the next blank-separated word in *p, or NULL if there is none */
+static char *nextword(char **p)
+{
+	char *w = *p + strspn(*p, " \t\r\n");
+
+	if (*w == '\0')
+		return NULL;
+	*p = w + strcspn(w, " \t\r\n");
+	if (**p != '\0')
+		*(*p)++ = '\0';
+	return w;
+}
+
+/*
+ * A membership file has one node per line: its name and, optionally,
+ * its weight, which is 1 if left out. Blank lines and anything after
+ * a '#' are ignored.
+ */
+struct hrw *hrw_load(const char *path)
+{
+	struct hrw *h;
+	FILE *fp;
+	char *line = NULL, *p, *name, *wstr, *ep;
+	size_t linesize = 0, lineno = 0;
+	double weight;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		return NULL;
+	}
+	h = hrw_new();
+	while (getline(&line, &linesize, fp) != -1) {
+		++lineno;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		p = line;
+		if ((name = nextword(&p)) == NULL)
+			continue;
+		weight = 1;
+		if ((wstr = nextword(&p)) != NULL) {
+			errno = 0;
+			weight = strtod(wstr, &ep);
+			if (*ep != '\0' || errno == ERANGE)
+				weight = -1;
+		}
+		if (nextword(&p) != NULL || hrw_add(h, name, weight) == -1) {
+			warnx("%s:%zu: bad or duplicate node", path, lineno);
+			goto fail;
+		}
+	}
+	if (ferror(fp)) {
+		warn("%s", path);
+		goto fail;
+	}
+	if (h->nnodes == 0) {
+		warnx("%s: no nodes", path);
+		goto fail;
+	}
+	free(line);
+	fclose(fp);
+	return h;
+fail:
+	free(line);
+	fclose(fp);
+	hrw_free(h);
+	return NULL;
+}
+
+size_t hrw_count(const struct hrw *h)
+{
+	return h->nnodes;
+}
+
+const char *hrw_name(const struct hrw *h, size_t i)
+{
+	return h->nodes[i].name;
+}
+
+double hrw_weight(const struct hrw *h, size_t i)
+{
+	return h->nodes[i].weight;
+}
+
+/*
+ * The node's score for a key hash. Unweighted, the mixed hash itself
+ * is the score. Weighted, it becomes a uniform u in (0, 1) and the
+ * score is -w / ln u: the node with the highest such score is then
+ * node i with probability w_i / sum w, and as with plain rendezvous
+ * hashing the other nodes' keys stay put when a node comes or goes.
+ */
+static double hrw_score(const struct hrw *h, const struct hrw_node *n,
+    uint64_t key)
+{
+	uint64_t x = hash_mix64(key ^ n->seed);
+	double u;
+
+	if (!h->weighted)
+		return (double)x;
+	u = ((x >> 11) + 0.5) * 0x1.0p-53;
+	return -n->weight / log(u);
+}
+
+/*
+ * Put the indices of the k best nodes for key into order, best first,
+ * and return how many there are: k, or fewer if there are not that
+ * many nodes.
+ */
+size_t hrw_rank(const struct hrw *h, const void *key, size_t len,
+    size_t *order, size_t k)
+{
+	double best[k > 0 ? k : 1], s;
+	uint64_t kh = hash64(key, len, HRW_SEED);
+	size_t i, j, n = 0;
+
+	for (i = 0; i < h->nnodes; ++i) {
+		s = hrw_score(h, &h->nodes[i], kh);
+		if (n == k && (k == 0 || s <= best[k - 1]))
+			continue;
+		/* insert it, dropping the last one if we are full */
+		j = n < k ? n++ : k - 1;
+		for (; j > 0 && best[j - 1] < s; --j) {
+			best[j] = best[j - 1];
+			order[j] = order[j - 1];
+		}
+		best[j] = s;
+		order[j] = i;
+	}
+	return n;
+}
+
+void hrw_free(struct hrw *h)
+{
+	size_t i;
+
+	if (h == NULL)
+		return;
+	for (i = 0; i < h->nnodes; ++i)
+		free(h->nodes[i].name);
+	free(h->nodes);
+	free(h);
+}
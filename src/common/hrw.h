@@ -0,0 +1,28 @@
+#ifndef HRW_H
+#define HRW_H
+
+#include <stddef.h>
+
+/*
+ * Weighted rendezvous (highest random weight) hashing. Every key gives
+ * every node a score, and the nodes in order of score are where the
+ * key should go: the first one normally, the next ones if that fails.
+ * Adding or removing a node only moves the keys that had it first,
+ * and a node of weight 2 gets twice the keys of a node of weight 1.
+ *
+ * The key is hashed once; each node's score is then one mix of that
+ * hash with the node's own seed, so ranking hundreds of nodes is
+ * still cheap.
+ */
+struct hrw;
+
+struct hrw *hrw_new(void);
+struct hrw *hrw_load(const char *);
+int	hrw_add(struct hrw *, const char *, double);
+size_t	hrw_count(const struct hrw *);
+const char *hrw_name(const struct hrw *, size_t);
+double	hrw_weight(const struct hrw *, size_t);
+size_t	hrw_rank(const struct hrw *, const void *, size_t, size_t *, size_t);
+void	hrw_free(struct hrw *);
+
+#endif /* HRW_H */
@@ -0,0 +1,212 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+
+/*
+ * The wire format shared by client, proxy and server, version 3. A
+ * connection carries any number of requests, and the client may send
+ * more before the answers to the earlier ones are in. Every request
+ * carries an id of the client's choosing that comes back on its
+ * response; responses may come back in any order, but each is sent
+ * whole, body and all, before the next one starts.
+ *
+ *	request:	version (1) type (1) name length (2) id (4) tag (8) name
+ *	response:	version (1) status (1) encoding (1) flags (1) id (4)
+ *			size (8) tag (8) body
+ *
+ * Numbers are big-endian. Only a PROTO_OK response has a body. The
+ * client is done when it sends its close_notify; the other side still
+ * answers everything it was asked and then closes as well. A frame of
+ * some other version gets a PROTO_BADVERSION answer, with id 0, and
+ * the connection is closed.
+ */
+#define PROTO_VERSION	3
+
+/*
+ * A tag names one version of a file; the server makes it up from the
+ * file's inode, size and modification time, and it is never 0. Every
+ * answer about a file carries its tag. A GET with a tag other than 0
+ * is conditional: if the file still has that tag, the answer is
+ * PROTO_NOTMODIFIED and no body, so a proxy can check that its copy is
+ * current without getting it again.
+ */
+
+/*
+ * A GET with PROTO_ACCEPT_DEFLATE or'ed into its type takes the body
+ * deflated, if that makes it smaller; the response's encoding says
+ * which it got, and its size is that of the body as sent. A deflated
+ * body is the size of the file itself (8) and then a zlib stream. It
+ * is the same version of the file, with the same tag.
+ */
+#define PROTO_ACCEPT_DEFLATE	0x80
+#define PROTO_TYPEMASK		0x7f
+
+#define PROTO_RAW	0
+#define PROTO_DEFLATE	1
+#define PROTO_ZHDRLEN	8
+
+/*
+ * Response flags. A proxy says when the answer came out of its own
+ * cache rather than from the server or a peer, even if it asked the
+ * server first whether its copy was current. That is only there for
+ * measuring; nothing else need look at it.
+ */
+#define PROTO_CACHED	0x01
+
+/*
+ * A RANGE request is a GET for part of a file: its name is followed by
+ * the offset (8) and length (8) of the bytes it wants, which the name
+ * length does not count. The body of the answer is the size of the
+ * whole file (8), then as much of the range as the file has, nothing
+ * if it starts past the end. It is never deflated; a tag makes it
+ * conditional, as with a GET.
+ */
+#define PROTO_RANGELEN		16
+#define PROTO_RANGEHDRLEN	8
+
+/*
+ * Request types. Clients GET files, or a RANGE of one. Proxies also
+ * ask each other for a digest of what they have cached (no name; see
+ * bloom_digest) and PEEK at each other's caches: a GET that is
+ * answered from the cache or with PROTO_NOTFOUND, never by going to
+ * the server. The server only knows GET and RANGE.
+ */
+#define PROTO_GET	1
+#define PROTO_DIGEST	2
+#define PROTO_PEEK	3
+#define PROTO_RANGE	4
+
+#define PROTO_REQLEN	16
+#define PROTO_RESPLEN	24
+#define PROTO_MAXNAME	4096
+
+enum proto_status {
+	PROTO_OK,
+	PROTO_NOTFOUND,
+	PROTO_BADREQ,		/* unknown type, bad name */
+	PROTO_BADVERSION,
+	PROTO_ERROR,		/* could not get the file, try again later */
+	PROTO_NOTMODIFIED,	/* the tag asked about is still current */
+};
+
+struct proto_req {
+	uint8_t version;
+	uint8_t type;		/* PROTO_ACCEPT_DEFLATE and all */
+	uint16_t namelen;
+	uint32_t id;
+	uint64_t tag;
+};
+
+struct proto_resp {
+	uint8_t version;
+	uint8_t status;
+	uint32_t id;
+	uint64_t size;
+	uint64_t tag;
+	uint8_t encoding;
+	uint8_t flags;
+};
+
+/* files move in pieces of this size, never whole */
+#define CHUNKSIZE	(64 * 1024)
+
+static inline void proto_put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static inline uint16_t proto_get16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline void proto_put32(unsigned char *p, uint32_t v)
+{
+	proto_put16(p, v >> 16);
+	proto_put16(p + 2, v & 0xffff);
+}
+
+static inline uint32_t proto_get32(const unsigned char *p)
+{
+	return (uint32_t)proto_get16(p) << 16 | proto_get16(p + 2);
+}
+
+static inline void proto_put64(unsigned char *p, uint64_t v)
+{
+	for (int i = 7; i >= 0; --i) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static inline uint64_t proto_get64(const unsigned char *p)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < 8; ++i)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static inline void proto_put_req(unsigned char *p, const struct proto_req *rq)
+{
+	p[0] = rq->version;
+	p[1] = rq->type;
+	proto_put16(p + 2, rq->namelen);
+	proto_put32(p + 4, rq->id);
+	proto_put64(p + 8, rq->tag);
+}
+
+static inline void proto_get_req(const unsigned char *p, struct proto_req *rq)
+{
+	rq->version = p[0];
+	rq->type = p[1];
+	rq->namelen = proto_get16(p + 2);
+	rq->id = proto_get32(p + 4);
+	rq->tag = proto_get64(p + 8);
+}
+
+static inline void proto_put_resp(unsigned char *p, const struct proto_resp *rs)
+{
+	p[0] = rs->version;
+	p[1] = rs->status;
+	p[2] = rs->encoding;
+	p[3] = rs->flags;
+	proto_put32(p + 4, rs->id);
+	proto_put64(p + 8, rs->size);
+	proto_put64(p + 16, rs->tag);
+}
+
+static inline void proto_get_resp(const unsigned char *p, struct proto_resp *rs)
+{
+	rs->version = p[0];
+	rs->status = p[1];
+	rs->encoding = p[2];
+	rs->flags = p[3];
+	rs->id = proto_get32(p + 4);
+	rs->size = proto_get64(p + 8);
+	rs->tag = proto_get64(p + 16);
+}
+
+static inline const char *proto_strstatus(int status)
+{
+	switch (status) {
+	case PROTO_OK:
+		return "ok";
+	case PROTO_NOTFOUND:
+		return "no such file";
+	case PROTO_BADREQ:
+		return "bad request";
+	case PROTO_BADVERSION:
+		return "unsupported protocol version";
+	case PROTO_ERROR:
+		return "unable to get the file";
+	case PROTO_NOTMODIFIED:
+		return "not modified";
+	}
+	return "unknown status";
+}
+
+#endif /* PROTO_H */
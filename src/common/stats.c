@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "addr.h"
+#include "stats.h"
+
+/* nanoseconds, monotonic */
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* h gets the time from since (stats_now) to now */
+void stats_time(struct stats_hist *h, uint64_t since)
+{
+	uint64_t us = (stats_now() - since) / 1000;
+	int i = us == 0 ? 0 : 64 - __builtin_clzll(us);
+
+	if (i >= STATS_BUCKETS)
+		i = STATS_BUCKETS - 1;
+	stats_add(&h->b[i], 1);
+	stats_add(&h->sum, us);
+	stats_add(&h->count, 1);
+}
+
+void stats_merge(struct stats_hist *to, const struct stats_hist *from)
+{
+	int i;
+
+	to->count += stats_get(&from->count);
+	to->sum += stats_get(&from->sum);
+	for (i = 0; i < STATS_BUCKETS; ++i)
+		to->b[i] += stats_get(&from->b[i]);
+}
+
+/* one number, for one worker if label is not NULL */
+void stats_put(FILE *fp, const char *name, const char *label, int n,
+    uint64_t v)
+{
+	if (label != NULL)
+		fprintf(fp, "%s{%s=\"%d\"} %llu\n", name, label, n,
+		    (unsigned long long)v);
+	else
+		fprintf(fp, "%s %llu\n", name, (unsigned long long)v);
+}
+
+/* a histogram, in seconds, with every bucket counting those below it */
+void stats_put_hist(FILE *fp, const char *name, const struct stats_hist *h)
+{
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS - 1; ++i) {
+		seen += h->b[i];
+		fprintf(fp, "%s_bucket{le=\"%g\"} %llu\n", name,
+		    (double)(1ULL << i) / 1e6, (unsigned long long)seen);
+	}
+	fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+	    (unsigned long long)h->count);
+	fprintf(fp, "%s_sum %.6f\n", name, h->sum / 1e6);
+	fprintf(fp, "%s_count %llu\n", name, (unsigned long long)h->count);
+}
+
+/*
+ * A non-blocking listening socket for addr, "[address:]port"; only
+ * local scrapers get in unless an address says otherwise.
+ */
+int stats_listen(const char *addr)
+{
+	struct sockaddr_in sa;
+	int sd, one = 1;
+
+	if (addr_parse(addr, &sa) == -1)
+		errx(1, "%s - not a stats address", addr);
+	if ((sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		err(1, "socket failed");
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+		err(1, "setsockopt SO_REUSEADDR failed");
+	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		err(1, "stats bind failed");
+	if (listen(sd, 16) == -1)
+		err(1, "listen failed");
+	return sd;
+}
+
+/*
+ * Everyone waiting on sd gets a snapshot, written by put, and is hung
+ * up on. A snapshot is a few kilobytes, which the socket buffer takes
+ * whole; a scraper that does not read it does not hold us up either,
+ * since we give up on what does not fit at once.
+ */
+void stats_serve(int sd, void (*put)(FILE *, void *), void *arg)
+{
+	char *buf, junk[512];
+	size_t len, off;
+	ssize_t n;
+	FILE *fp;
+	int cd;
+
+	while ((cd = accept4(sd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+		if ((fp = open_memstream(&buf, &len)) == NULL) {
+			warn("open_memstream");
+			close(cd);
+			continue;
+		}
+		put(fp, arg);
+		if (fclose(fp) == 0) {
+			for (off = 0; off < len; off += n)
+				if ((n = send(cd, buf + off, len - off,
+				    MSG_NOSIGNAL)) <= 0)
+					break;
+			free(buf);
+		}
+		/* whatever the scraper sent, so closing does not reset it */
+		shutdown(cd, SHUT_WR);
+		while (recv(cd, junk, sizeof(junk), 0) > 0)
+			;
+		close(cd);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    errno != ECONNABORTED)
+		warn("stats accept failed");
+}
@@ -0,0 +1,48 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Counters and latency histograms for the stats port. Each one has a
+ * single writer, the worker that owns it, so it is bumped with a
+ * relaxed load and store rather than a locked read-modify-write, and
+ * a snapshot reads it the same way: one counter may be a little
+ * behind another, but none is ever torn.
+ *
+ * Histograms count in powers of two of microseconds, from 1 us up to
+ * about half a minute; anything longer goes in the last bucket.
+ *
+ * A snapshot is plain text, one "name{label} value" line per number,
+ * the way Prometheus reads them; whoever connects to the stats port
+ * gets one and the connection is closed.
+ */
+#define STATS_BUCKETS	26
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t sum;		/* microseconds */
+	uint64_t b[STATS_BUCKETS];
+};
+
+static inline void stats_add(uint64_t *c, uint64_t n)
+{
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n,
+	    __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_get(const uint64_t *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now(void);
+void	stats_time(struct stats_hist *, uint64_t);
+void	stats_merge(struct stats_hist *, const struct stats_hist *);
+void	stats_put(FILE *, const char *, const char *, int, uint64_t);
+void	stats_put_hist(FILE *, const char *, const struct stats_hist *);
+int	stats_listen(const char *);
+void	stats_serve(int, void (*)(FILE *, void *), void *);
+
+#endif /* STATS_H */
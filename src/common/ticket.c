@@ -0,0 +1,70 @@
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tls.h>
+#include <openssl/sha.h>
+
+#include "ticket.h"
+
+/*
+ * A new key every quarter of the lifetime. libtls keeps the last four
+ * and honours each for a lifetime from when we added it, so a ticket
+ * made just before a rotation still works for most of its life.
+ */
+static uint32_t tickets_period(const struct tickets *t)
+{
+	int period = t->lifetime / 4 > 0 ? t->lifetime / 4 : 1;
+
+	return time(NULL) / period;
+}
+
+void tickets_init(struct tickets *t, int lifetime)
+{
+	arc4random_buf(t->secret, sizeof(t->secret));
+	arc4random_buf(t->sessionid, sizeof(t->sessionid));
+	t->lifetime = lifetime;
+}
+
+/*
+ * Turn on tickets in config, with the current key. keyrev remembers
+ * which key config has; tickets_rotate keeps it up to date. A lifetime
+ * of 0 leaves tickets off.
+ */
+int tickets_configure(const struct tickets *t, struct tls_config *config,
+    uint32_t *keyrev)
+{
+	/* sessions only resume where the session id context matches */
+	if (tls_config_set_session_id(config, t->sessionid,
+	    sizeof(t->sessionid)) == -1)
+		return -1;
+	if (t->lifetime == 0)
+		return 0;
+	if (tls_config_set_session_lifetime(config, t->lifetime) == -1)
+		return -1;
+	*keyrev = tickets_period(t) - 1;
+	return tickets_rotate(t, config, keyrev);
+}
+
+/* add the key for the current period, if config does not have it yet */
+int tickets_rotate(const struct tickets *t, struct tls_config *config,
+    uint32_t *keyrev)
+{
+	unsigned char buf[sizeof(t->secret) + sizeof(uint32_t)];
+	unsigned char md[SHA512_DIGEST_LENGTH];
+	uint32_t period;
+	int rv;
+
+	if (t->lifetime == 0 || (period = tickets_period(t)) == *keyrev)
+		return 0;
+	memcpy(buf, t->secret, sizeof(t->secret));
+	memcpy(buf + sizeof(t->secret), &period, sizeof(period));
+	SHA512(buf, sizeof(buf), md);
+	rv = tls_config_add_ticket_key(config, period, md, TLS_TICKET_KEY_SIZE);
+	explicit_bzero(md, sizeof(md));
+	if (rv == 0)
+		*keyrev = period;
+	return rv;
+}
@@ -0,0 +1,26 @@
+#ifndef TICKET_H
+#define TICKET_H
+
+#include <stdint.h>
+
+#include <tls.h>
+
+/*
+ * TLS session tickets. Every TLS server context that should accept the
+ * others' tickets shares one secret, and the ticket key in use at any
+ * moment is derived from that secret and the current key period. So
+ * contexts rotate to the same new key at the same time without talking
+ * to each other: each only has to call tickets_rotate now and then.
+ */
+struct tickets {
+	unsigned char secret[32];
+	unsigned char sessionid[TLS_MAX_SESSION_ID_LENGTH];
+	int lifetime;		/* seconds a ticket stays good */
+};
+
+void	tickets_init(struct tickets *, int);
+int	tickets_configure(const struct tickets *, struct tls_config *,
+	    uint32_t *);
+int	tickets_rotate(const struct tickets *, struct tls_config *, uint32_t *);
+
+#endif /* TICKET_H */
@@ -0,0 +1,204 @@
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * Each thread that traces has its own ring, written only by it and
+ * read only by the drain thread, so neither side takes a lock: the
+ * writer publishes an event by moving head on, the drainer frees the
+ * slot by moving tail on. When the drainer falls behind the ring
+ * fills, and events are counted and dropped rather than waited for.
+ */
+#define TRACE_RING	8192	/* events per thread, a power of two */
+#define TRACE_EVERY	10	/* milliseconds between drains */
+#define TRACE_BUF	65536
+
+struct trace_rec {
+	uint64_t ts;
+	uint64_t conn;
+	int64_t arg;
+	uint32_t req;
+	uint32_t phase;
+};
+
+struct trace_ring {
+	struct trace_rec ev[TRACE_RING];
+	uint64_t head;		/* moved on by the writer */
+	uint64_t tail;		/* moved on by the drainer */
+	uint64_t dropped;
+	uint64_t reported;	/* the drainer's copy of dropped */
+	int thread;
+	struct trace_ring *next;
+};
+
+int trace_enabled;
+
+static const char *phases[T_NPHASES] = {
+	"accept", "handshake", "name", "lookup", "up_connect",
+	"up_handshake", "up_answer", "first_byte", "last_byte"
+};
+
+static __thread struct trace_ring *ring;
+static struct trace_ring *rings;
+static int nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t conns;
+static int fd = -1;
+static pid_t pid;
+static char buf[TRACE_BUF];
+static size_t buflen;
+
+/* whole lines only, so workers appending to one file do not mix them */
+static void trace_flush(void)
+{
+	size_t off = 0;
+	ssize_t w;
+
+	while (off < buflen) {
+		if ((w = write(fd, buf + off, buflen - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("trace write failed");
+			break;
+		}
+		off += w;
+	}
+	buflen = 0;
+}
+
+static void trace_put(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void trace_put(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (sizeof(buf) - buflen < 256)
+		trace_flush();
+	va_start(ap, fmt);
+	n = vsnprintf(buf + buflen, sizeof(buf) - buflen, fmt, ap);
+	va_end(ap);
+	if (n > 0 && (size_t)n < sizeof(buf) - buflen)
+		buflen += n;
+}
+
+static void trace_drain(void)
+{
+	struct trace_ring *tr;
+	struct trace_rec *e;
+	uint64_t h, t, d;
+
+	pthread_mutex_lock(&drain_lock);
+	pthread_mutex_lock(&rings_lock);
+	tr = rings;
+	pthread_mutex_unlock(&rings_lock);
+	for (; tr != NULL; tr = tr->next) {
+		h = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+		for (t = tr->tail; t != h; ++t) {
+			e = &tr->ev[t & (TRACE_RING - 1)];
+			trace_put("{\"ts\":%llu,\"pid\":%d,\"thread\":%d,"
+			    "\"conn\":%llu,\"req\":%u,\"phase\":\"%s\","
+			    "\"arg\":%lld}\n", (unsigned long long)e->ts,
+			    (int)pid, tr->thread, (unsigned long long)e->conn,
+			    e->req, phases[e->phase], (long long)e->arg);
+		}
+		__atomic_store_n(&tr->tail, h, __ATOMIC_RELEASE);
+		d = __atomic_load_n(&tr->dropped, __ATOMIC_RELAXED);
+		if (d != tr->reported) {
+			trace_put("{\"pid\":%d,\"thread\":%d,\"dropped\":%llu}\n",
+			    (int)pid, tr->thread,
+			    (unsigned long long)(d - tr->reported));
+			tr->reported = d;
+		}
+	}
+	trace_flush();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void *trace_main(void *arg)
+{
+	struct timespec ts = { 0, TRACE_EVERY * 1000000L };
+
+	(void)arg;
+	for (;;) {
+		nanosleep(&ts, NULL);
+		trace_drain();
+	}
+	return NULL;
+}
+
+/*
+ * Starts tracing to path, appended to. A process that forks its
+ * workers calls this in each of them, as the drain thread does not
+ * survive a fork.
+ */
+void trace_open(const char *path)
+{
+	pthread_t t;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+		err(1, "%s", path);
+	pid = getpid();
+	if (pthread_create(&t, NULL, trace_main, NULL) != 0)
+		errx(1, "trace thread creation failed");
+	pthread_detach(t);
+	atexit(trace_drain);
+	trace_enabled = 1;
+}
+
+/* a number for a new connection, unique in this process */
+uint64_t trace_conn(void)
+{
+	return __atomic_add_fetch(&conns, 1, __ATOMIC_RELAXED);
+}
+
+static struct trace_ring *trace_ring_new(void)
+{
+	struct trace_ring *tr;
+
+	if ((tr = calloc(1, sizeof(*tr))) == NULL)
+		err(1, "calloc");
+	pthread_mutex_lock(&rings_lock);
+	tr->thread = nrings++;
+	tr->next = rings;
+	rings = tr;
+	pthread_mutex_unlock(&rings_lock);
+	return tr;
+}
+
+void trace_event(uint64_t conn, uint32_t req, int phase, int64_t arg)
+{
+	struct trace_ring *tr = ring;
+	struct trace_rec *e;
+	uint64_t h;
+
+	if (tr == NULL)
+		tr = ring = trace_ring_new();
+	h = tr->head;
+	if (h - __atomic_load_n(&tr->tail, __ATOMIC_ACQUIRE) == TRACE_RING) {
+		stats_add(&tr->dropped, 1);
+		return;
+	}
+	e = &tr->ev[h & (TRACE_RING - 1)];
+	e->ts = stats_now();
+	e->conn = conn;
+	e->req = req;
+	e->phase = phase;
+	e->arg = arg;
+	__atomic_store_n(&tr->head, h + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * How much gets said, fixed when the program is built (-DLOG_LEVEL=n
+ * to cmake). Startup lines and reports are always printed. Phase
+ * traces are compiled in from LOG_TRACE on and cost a branch each
+ * unless a trace file is given; the old line per step of every request
+ * only comes back at LOG_DEBUG.
+ */
+#define LOG_INFO	1
+#define LOG_TRACE	2
+#define LOG_DEBUG	3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL	LOG_TRACE
+#endif
+
+/*
+ * Steps of a request. Those of a connection as a whole have request 0;
+ * the upstream ones are recorded for the request that started the
+ * fetch.
+ */
+enum trace_phase {
+	T_ACCEPT,
+	T_HANDSHAKE,		/* arg: 1 if resumed */
+	T_NAME,			/* the request has been read */
+	T_LOOKUP,		/* arg: 1 for a hit, or a file the server has */
+	T_UPCONNECT,		/* arg: peer index, -1 for the server */
+	T_UPHANDSHAKE,		/* arg: 1 if resumed */
+	T_UPANSWER,		/* arg: the upstream status */
+	T_FIRSTBYTE,
+	T_LASTBYTE,		/* arg: body bytes */
+	T_NPHASES
+};
+
+extern int trace_enabled;
+
+#if LOG_LEVEL >= LOG_TRACE
+#define TRACE(conn, req, phase, arg) do {				\
+	if (trace_enabled)						\
+		trace_event((conn), (req), (phase), (arg));		\
+} while (0)
+#else
+#define TRACE(conn, req, phase, arg) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_DEBUG
+#define DEBUG(...)	printf(__VA_ARGS__)
+#else
+#define DEBUG(...)	do { } while (0)
+#endif
+
+void	trace_open(const char *);
+uint64_t trace_conn(void);
+void	trace_event(uint64_t, uint32_t, int, int64_t);
+
+#endif /* TRACE_H */
@@ -0,0 +1,980 @@
+#include <arpa/inet.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tls.h>
+
+#include "addr.h"
+#include "hash.h"
+#include "hrw.h"
+#include "proto.h"
+
+/*
+ * A load generator for the whole cluster. Each thread has its own
+ * connections to every proxy and sends each request to the proxy its
+ * name hashes to, as the client does, with any number of them in
+ * flight at once. Closed loop, every thread keeps -window requests in
+ * flight and asks for the next one as soon as one is answered; open
+ * loop, the requests go out at -rate a second between them, whether or
+ * not the earlier ones have been answered, and their latency counts
+ * from when they were due to go out, so a slow cluster is not hidden
+ * by the load backing off.
+ *
+ * The names come from the corpus that -generate writes into the
+ * server's directory, picked uniformly or by a Zipf distribution, or
+ * are replayed from a trace, one name per line.
+ */
+
+/* the proxies, one "[address:]port [weight]" per line */
+#define MEMBERSHIP	"proxies.conf"
+
+/* the corpus: files named lg000000.dat and on, in the server's directory */
+#define CORPUSDIR	"serverfiles"
+#define CORPUSNAME	"lg%06zu.dat"
+
+#define DEFAULT_THREADS		4
+#define DEFAULT_CONNS		1
+#define DEFAULT_WINDOW		8
+#define DEFAULT_FILES		1000
+#define DEFAULT_DURATION	10
+#define DEFAULT_ZIPF		0.99
+#define DEFAULT_MINSIZE		1024
+#define DEFAULT_MAXSIZE		(64 * 1024)
+#define MAXWINDOW	64	/* the proxy reads no further ahead than this */
+#define MAXSKIP		1024	/* names in a row for proxies that are down */
+
+/*
+ * Latency histograms, in microseconds: exact below 64, and from there
+ * 32 buckets to every power of two, so any percentile is within about
+ * 3% of the real one.
+ */
+#define HIST_SUBBITS	5
+#define HIST_SUB	(1 << HIST_SUBBITS)
+#define HIST_BUCKETS	(64 * HIST_SUB)
+
+struct hist {
+	unsigned long long n;
+	unsigned long long b[HIST_BUCKETS];
+};
+
+enum dist {
+	D_UNIFORM,
+	D_ZIPF,
+	D_TRACE,
+};
+
+/* a name we ask for, and the proxy it goes to */
+struct key {
+	char *name;
+	size_t namelen;
+	size_t proxy;
+};
+
+/* a request in flight; its id is its slot's index */
+struct slot {
+	uint64_t start;
+	size_t key;
+	int busy;
+};
+
+/* a request that is due but has to wait for a slot */
+struct pending {
+	uint64_t start;
+	size_t key;
+};
+
+struct lconn {
+	struct tls *tls;
+	int sd;
+	int dead;
+	struct slot slots[MAXWINDOW];
+	int freeslots[MAXWINDOW];
+	int nfree;
+	struct pending *backlog;
+	size_t bhead, btail, bcap;
+
+	/* requests not yet written */
+	unsigned char *out;
+	size_t outlen, outoff, outcap;
+	int wantout;		/* the last write wanted POLLOUT */
+
+	/* the response being read */
+	unsigned char hdr[PROTO_RESPLEN];
+	size_t hdroff;
+	struct proto_resp rs;
+	uint64_t body;		/* bytes of its body still to come */
+	int inbody;
+};
+
+struct worker {
+	pthread_t thread;
+	struct tls_config *cfg;
+	struct lconn *conns;	/* -conns to each proxy, by proxy */
+	size_t nconns, rr;
+	uint64_t rng;
+	size_t outstanding;	/* issued and not yet answered */
+	uint64_t start, end;
+	struct hist hit, miss;
+	unsigned long long hits, misses, missing, failed, skipped, bytes;
+};
+
+/* the root CA, read once and shared by every connection */
+static uint8_t *ca;
+static size_t calen;
+
+static struct hrw *members;
+static struct key *keys;
+static size_t nkeys;
+
+static enum dist dist = D_UNIFORM;
+static double zipfs = DEFAULT_ZIPF;
+static double *zipfcdf;
+static size_t tracenext;
+
+static int nthreads = DEFAULT_THREADS;
+static int connsper = DEFAULT_CONNS;
+static int window = DEFAULT_WINDOW;
+static double rate;		/* requests a second, open loop; 0 closed */
+static int duration = -1;
+static unsigned long long maxrequests, nissued;
+static int accept_deflate;	/* PROTO_ACCEPT_DEFLATE with -deflate */
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-threads n] [-conns n] [-window n | -rate r] "
+	    "[-duration s] [-requests n]\n"
+	    "           [-dist uniform|zipf[:s]|trace:file] [-files n] [-deflate]\n"
+	    "       %s -generate [-files n] [-size min:max]\n"
+	    "       (a run may start with -members file)\n",
+	    __progname, __progname);
+	exit(1);
+}
+
+static long long getnumber(const char *arg, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(arg, &ep, 10);
+	if (*arg == '\0' || *ep != '\0' || errno == ERANGE || n < min || n > max) {
+		fprintf(stderr, "%s - must be a number from %lld to %lld\n", arg,
+		    min, max);
+		usage();
+	}
+	return n;
+}
+
+static double getreal(const char *arg)
+{
+	char *ep;
+	double d;
+
+	errno = 0;
+	d = strtod(arg, &ep);
+	if (*arg == '\0' || *ep != '\0' || errno == ERANGE || !(d > 0)) {
+		fprintf(stderr, "%s - must be a number above 0\n", arg);
+		usage();
+	}
+	return d;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, one per thread */
+static uint64_t rng_next(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniform in [0, 1) */
+static double rng_real(uint64_t *s)
+{
+	return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t hist_bucket(uint64_t v)
+{
+	int shift;
+
+	if (v < 2 * HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUBBITS;
+	if (shift + 1 >= HIST_BUCKETS / HIST_SUB)
+		return HIST_BUCKETS - 1;
+	return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+/* the middle of bucket i */
+static double hist_value(size_t i)
+{
+	int shift;
+
+	if (i < 2 * HIST_SUB)
+		return i;
+	shift = i / HIST_SUB - 1;
+	return (double)((i % HIST_SUB + HIST_SUB) << shift) +
+	    (double)(1ULL << shift) / 2;
+}
+
+static void hist_add(struct hist *h, uint64_t ns)
+{
+	++h->n;
+	++h->b[hist_bucket(ns / 1000)];
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	size_t i;
+
+	to->n += from->n;
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		to->b[i] += from->b[i];
+}
+
+/* the q quantile, in milliseconds */
+static double hist_quantile(const struct hist *h, double q)
+{
+	unsigned long long want, seen = 0;
+	size_t i;
+
+	if (h->n == 0)
+		return 0;
+	want = ceil(q * h->n);
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		if ((seen += h->b[i]) >= want)
+			break;
+	return hist_value(i) / 1000;
+}
+
+static void key_add(size_t *cap, const char *name, size_t namelen)
+{
+	struct key *tmp, *k;
+
+	if (nkeys == *cap) {
+		*cap = *cap ? *cap * 2 : 1024;
+		if ((tmp = reallocarray(keys, *cap, sizeof(*keys))) == NULL)
+			err(1, "reallocarray");
+		keys = tmp;
+	}
+	k = &keys[nkeys++];
+	if ((k->name = strdup(name)) == NULL)
+		err(1, "strdup");
+	k->namelen = namelen;
+	hrw_rank(members, name, namelen, &k->proxy, 1);
+}
+
+/* the names of the corpus, in order */
+static void corpus_keys(size_t nfiles)
+{
+	char name[32];
+	size_t cap = 0, i;
+	int len;
+
+	for (i = 0; i < nfiles; ++i) {
+		len = snprintf(name, sizeof(name), CORPUSNAME, i);
+		key_add(&cap, name, len);
+	}
+}
+
+/* the names in a trace, one per line, in the order they are asked for */
+static void trace_keys(const char *trace)
+{
+	size_t cap = 0, linesize = 0;
+	char *line = NULL;
+	ssize_t len;
+	FILE *fp;
+
+	if ((fp = fopen(trace, "r")) == NULL)
+		err(1, "%s", trace);
+	while ((len = getline(&line, &linesize, fp)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if ((size_t)len > PROTO_MAXNAME || strlen(line) != (size_t)len) {
+			warnx("%s: skipping a bad file name", trace);
+			continue;
+		}
+		key_add(&cap, line, len);
+	}
+	if (ferror(fp))
+		err(1, "%s", trace);
+	fclose(fp);
+	free(line);
+	if (nkeys == 0)
+		errx(1, "%s: no file names", trace);
+}
+
+/* rank i is asked for in proportion to 1 / (i + 1)^s */
+static void zipf_setup(void)
+{
+	double sum = 0;
+	size_t i;
+
+	if ((zipfcdf = calloc(nkeys, sizeof(*zipfcdf))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nkeys; ++i)
+		zipfcdf[i] = sum += pow(i + 1, -zipfs);
+	for (i = 0; i < nkeys; ++i)
+		zipfcdf[i] /= sum;
+}
+
+/* the next name to ask for, or -1 once a trace has run out */
+static ssize_t next_key(struct worker *w)
+{
+	size_t lo, hi, mid;
+	double u;
+
+	switch (dist) {
+	case D_UNIFORM:
+		return rng_next(&w->rng) % nkeys;
+	case D_ZIPF:
+		u = rng_real(&w->rng);
+		for (lo = 0, hi = nkeys - 1; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			if (zipfcdf[mid] <= u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	case D_TRACE:
+		if ((lo = __atomic_fetch_add(&tracenext, 1, __ATOMIC_RELAXED)) >=
+		    nkeys)
+			return -1;
+		return lo;
+	}
+	return -1;
+}
+
+/*
+ * Write the corpus: nfiles files of sizes spread evenly over the
+ * orders of magnitude from min to max, so a few big files carry much
+ * of the bytes, as they tend to. The same -files always gives the same
+ * names and sizes.
+ */
+static int generate(size_t nfiles, uint64_t min, uint64_t max)
+{
+	char path[PATH_MAX], buf[64 * 1024];
+	unsigned long long total = 0;
+	uint64_t rng = hash_mix64(nfiles) | 1, size, n, i;
+	size_t f;
+	FILE *fp;
+
+	if (mkdir(CORPUSDIR, 0755) == -1 && errno != EEXIST)
+		err(1, "%s", CORPUSDIR);
+	for (f = 0; f < nfiles; ++f) {
+		size = exp(log(min) + rng_real(&rng) * (log(max) - log(min)));
+		snprintf(path, sizeof(path), CORPUSDIR "/" CORPUSNAME, f);
+		if ((fp = fopen(path, "w")) == NULL)
+			err(1, "%s", path);
+		for (; size > 0; size -= n) {
+			n = size < sizeof(buf) ? size : sizeof(buf);
+			for (i = 0; i + 8 <= n; i += 8) {
+				uint64_t v = rng_next(&rng);
+
+				memcpy(buf + i, &v, 8);
+			}
+			for (; i < n; ++i)
+				buf[i] = rng_next(&rng);
+			if (fwrite(buf, 1, n, fp) != n)
+				err(1, "%s", path);
+			total += n;
+		}
+		if (fclose(fp) == EOF)
+			err(1, "%s", path);
+	}
+	printf("Loadgen: wrote %zu files, %llu bytes, into %s\n", nfiles, total,
+	    CORPUSDIR);
+	return 0;
+}
+
+static void conn_close(struct lconn *c)
+{
+	if (c->tls != NULL)
+		tls_free(c->tls);
+	if (c->sd != -1)
+		close(c->sd);
+	c->tls = NULL;
+	c->sd = -1;
+}
+
+/* connect and do the handshake, then go non-blocking */
+static int conn_open(struct worker *w, struct lconn *c, const char *proxy)
+{
+	struct sockaddr_in sa;
+	int i, one = 1;
+
+	c->tls = NULL;
+	c->dead = 1;
+	c->nfree = MAXWINDOW;
+	for (i = 0; i < MAXWINDOW; ++i)
+		c->freeslots[i] = MAXWINDOW - 1 - i;
+	if (addr_parse(proxy, &sa) == -1) {
+		warnx("%s - not a proxy address", proxy);
+		return -1;
+	}
+	if ((c->sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		warn("socket failed");
+		return -1;
+	}
+	if (connect(c->sd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		warn("connect to %s failed", proxy);
+		goto fail;
+	}
+	/* requests go out one at a time; none should wait on the last's ACK */
+	setsockopt(c->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ((c->tls = tls_client()) == NULL) {
+		warnx("tls client creation failed");
+		goto fail;
+	}
+	if (tls_configure(c->tls, w->cfg) == -1 ||
+	    tls_connect_socket(c->tls, c->sd, "localhost") == -1) {
+		warnx("tls connection failed (%s)", tls_error(c->tls));
+		goto fail;
+	}
+	do {
+		if ((i = tls_handshake(c->tls)) == -1) {
+			warnx("tls handshake failed (%s)", tls_error(c->tls));
+			goto fail;
+		}
+	} while(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	if (fcntl(c->sd, F_SETFL, fcntl(c->sd, F_GETFL) | O_NONBLOCK) == -1) {
+		warn("fcntl");
+		goto fail;
+	}
+	c->dead = 0;
+	return 0;
+fail:
+	conn_close(c);
+	return -1;
+}
+
+/* c is gone, and whatever it had in flight or waiting failed with it */
+static void conn_fail(struct worker *w, struct lconn *c)
+{
+	size_t n = (MAXWINDOW - c->nfree) + (c->btail - c->bhead);
+
+	w->failed += n;
+	w->outstanding -= n;
+	c->nfree = MAXWINDOW;
+	c->bhead = c->btail = 0;
+	c->outlen = c->outoff = 0;
+	c->dead = 1;
+	conn_close(c);
+}
+
+/* k goes out on c in a slot of its own; it was due at start */
+static void conn_send(struct lconn *c, size_t k, uint64_t start)
+{
+	struct proto_req rq = { .version = PROTO_VERSION,
+	    .type = PROTO_GET | accept_deflate, .namelen = keys[k].namelen };
+	unsigned char *tmp;
+	int s = c->freeslots[--c->nfree];
+
+	c->slots[s].start = start;
+	c->slots[s].key = k;
+	c->slots[s].busy = 1;
+	rq.id = s;
+	if (c->outlen + PROTO_REQLEN + rq.namelen > c->outcap) {
+		c->outcap = c->outcap ? c->outcap * 2 : 4096;
+		if (c->outcap < c->outlen + PROTO_REQLEN + rq.namelen)
+			c->outcap = c->outlen + PROTO_REQLEN + rq.namelen;
+		if ((tmp = realloc(c->out, c->outcap)) == NULL)
+			err(1, "realloc");
+		c->out = tmp;
+	}
+	proto_put_req(c->out + c->outlen, &rq);
+	memcpy(c->out + c->outlen + PROTO_REQLEN, keys[k].name, rq.namelen);
+	c->outlen += PROTO_REQLEN + rq.namelen;
+}
+
+/* one of our live connections to proxy p, or NULL if they are all down */
+static struct lconn *proxy_conn(struct worker *w, size_t p)
+{
+	struct lconn *c;
+	int i;
+
+	for (i = 0; i < connsper; ++i) {
+		c = &w->conns[p * connsper + w->rr++ % connsper];
+		if (!c->dead)
+			return c;
+	}
+	return NULL;
+}
+
+/*
+ * Ask for the next name, due at start. Its connection takes it if it
+ * has a slot, or it waits there for one. A name for a proxy we have
+ * lost is skipped, and counted once, rather than failed on the spot
+ * over and over; the loop would do nothing else. 0 once there is
+ * nothing more to ask for, or nothing but names for lost proxies.
+ */
+static int issue(struct worker *w, uint64_t start)
+{
+	struct pending *tmp;
+	struct lconn *c;
+	ssize_t k;
+	int tries;
+
+	for (tries = 0; ; ++tries) {
+		if (tries == MAXSKIP || (k = next_key(w)) == -1)
+			return 0;
+		if ((c = proxy_conn(w, keys[k].proxy)) != NULL)
+			break;
+		++w->skipped;
+	}
+	if (maxrequests != 0 && __atomic_fetch_add(&nissued, 1,
+	    __ATOMIC_RELAXED) >= maxrequests)
+		return 0;
+	++w->outstanding;
+	if (c->nfree > 0) {
+		conn_send(c, k, start);
+		return 1;
+	}
+	if (c->btail == c->bcap) {
+		if (c->bhead > 0) {
+			memmove(c->backlog, c->backlog + c->bhead,
+			    (c->btail - c->bhead) * sizeof(*c->backlog));
+			c->btail -= c->bhead;
+			c->bhead = 0;
+		} else {
+			c->bcap = c->bcap ? c->bcap * 2 : 64;
+			if ((tmp = reallocarray(c->backlog, c->bcap,
+			    sizeof(*c->backlog))) == NULL)
+				err(1, "reallocarray");
+			c->backlog = tmp;
+		}
+	}
+	c->backlog[c->btail].key = k;
+	c->backlog[c->btail++].start = start;
+	return 1;
+}
+
+/* the response in c->rs is all in */
+static void conn_done(struct worker *w, struct lconn *c)
+{
+	struct slot *s = &c->slots[c->rs.id];
+	uint64_t lat = now_ns() - s->start;
+	struct pending *p;
+
+	s->busy = 0;
+	c->freeslots[c->nfree++] = c->rs.id;
+	--w->outstanding;
+	switch (c->rs.status) {
+	case PROTO_OK:
+	case PROTO_NOTMODIFIED:
+		if (c->rs.flags & PROTO_CACHED) {
+			++w->hits;
+			hist_add(&w->hit, lat);
+		} else {
+			++w->misses;
+			hist_add(&w->miss, lat);
+		}
+		break;
+	case PROTO_NOTFOUND:
+		++w->missing;
+		break;
+	default:
+		++w->failed;
+		break;
+	}
+	if (c->bhead < c->btail) {
+		p = &c->backlog[c->bhead++];
+		conn_send(c, p->key, p->start);
+	}
+}
+
+/* write what we can of the requests waiting on c */
+static int conn_flush(struct lconn *c)
+{
+	ssize_t n;
+
+	c->wantout = 0;
+	while (c->outoff < c->outlen) {
+		n = tls_write(c->tls, c->out + c->outoff, c->outlen - c->outoff);
+		if (n == TLS_WANT_POLLIN)
+			return 0;
+		if (n == TLS_WANT_POLLOUT) {
+			c->wantout = 1;
+			return 0;
+		}
+		if (n < 0) {
+			warnx("TLS write failed (%s)", tls_error(c->tls));
+			return -1;
+		}
+		c->outoff += n;
+	}
+	c->outoff = c->outlen = 0;
+	return 0;
+}
+
+/* read and take apart whatever responses c has for us */
+static int conn_read(struct worker *w, struct lconn *c)
+{
+	unsigned char buf[64 * 1024], *p;
+	ssize_t n;
+	size_t take;
+
+	for (;;) {
+		n = tls_read(c->tls, buf, sizeof(buf));
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+			return 0;
+		if (n < 0) {
+			warnx("tls_read failed (%s)", tls_error(c->tls));
+			return -1;
+		}
+		if (n == 0) {
+			warnx("proxy closed the connection");
+			return -1;
+		}
+		for (p = buf; n > 0; p += take, n -= take) {
+			if (c->inbody) {
+				take = c->body < (uint64_t)n ? c->body : (size_t)n;
+				c->body -= take;
+				w->bytes += take;
+				if (c->body == 0) {
+					c->inbody = 0;
+					conn_done(w, c);
+				}
+				continue;
+			}
+			take = PROTO_RESPLEN - c->hdroff;
+			if (take > (size_t)n)
+				take = n;
+			memcpy(c->hdr + c->hdroff, p, take);
+			if ((c->hdroff += take) < PROTO_RESPLEN)
+				continue;
+			c->hdroff = 0;
+			proto_get_resp(c->hdr, &c->rs);
+			if (c->rs.version != PROTO_VERSION ||
+			    c->rs.id >= MAXWINDOW || !c->slots[c->rs.id].busy) {
+				warnx("response to request %u, not ours", c->rs.id);
+				return -1;
+			}
+			if (c->rs.status == PROTO_OK && c->rs.size > 0) {
+				c->inbody = 1;
+				c->body = c->rs.size;
+			} else
+				conn_done(w, c);
+		}
+	}
+}
+
+/*
+ * One thread's share of the load: its connections to every proxy, and
+ * its share of the requests until the time, the requests or the trace
+ * run out. Every response is timed when its last byte is in.
+ */
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct pollfd *pfd;
+	uint64_t now, deadline = 0, next, gap = 0;
+	size_t i, nlive;
+	int stopping = 0, timeout;
+
+	if ((pfd = calloc(w->nconns, sizeof(*pfd))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < w->nconns; ++i)
+		conn_open(w, &w->conns[i], hrw_name(members, i / connsper));
+
+	w->start = next = now_ns();
+	if (duration > 0)
+		deadline = w->start + duration * 1000000000ULL;
+	if (rate > 0)
+		gap = 1e9 * nthreads / rate;
+	for (;;) {
+		now = now_ns();
+		for (i = nlive = 0; i < w->nconns; ++i)
+			nlive += !w->conns[i].dead;
+		if (nlive == 0 || (deadline != 0 && now >= deadline))
+			stopping = 1;
+		/* open loop, the gaps between requests are exponential */
+		while (!stopping && (rate > 0 ? next <= now :
+		    w->outstanding < (size_t)window)) {
+			if (!issue(w, rate > 0 ? next : now))
+				stopping = 1;
+			next += -log(1 - rng_real(&w->rng)) * gap;
+		}
+		if (stopping && w->outstanding == 0)
+			break;
+
+		for (i = 0; i < w->nconns; ++i) {
+			struct lconn *c = &w->conns[i];
+
+			pfd[i].fd = -1;
+			if (c->dead)
+				continue;
+			if (c->outoff < c->outlen && !c->wantout &&
+			    conn_flush(c) == -1) {
+				conn_fail(w, c);
+				continue;
+			}
+			pfd[i].fd = c->sd;
+			pfd[i].events = POLLIN;
+			if (c->wantout)
+				pfd[i].events |= POLLOUT;
+		}
+		timeout = 100;
+		if (!stopping && rate > 0)
+			timeout = next > now ? (next - now + 999999) / 1000000 : 0;
+		if (!stopping && deadline != 0 && (deadline - now) / 1000000 <
+		    (uint64_t)timeout)
+			timeout = (deadline - now) / 1000000 + 1;
+		if (poll(pfd, w->nconns, timeout) == -1 && errno != EINTR)
+			err(1, "poll");
+		for (i = 0; i < w->nconns; ++i) {
+			struct lconn *c = &w->conns[i];
+
+			if (c->dead || pfd[i].fd == -1 || pfd[i].revents == 0)
+				continue;
+			if (conn_read(w, c) == -1 || conn_flush(c) == -1)
+				conn_fail(w, c);
+		}
+	}
+	w->end = now_ns();
+
+	for (i = 0; i < w->nconns; ++i) {
+		conn_close(&w->conns[i]);
+		free(w->conns[i].out);
+		free(w->conns[i].backlog);
+	}
+	free(pfd);
+	return NULL;
+}
+
+static void report_latency(const char *what, const struct hist *h)
+{
+	printf("Loadgen: %-6s %10llu, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms\n",
+	    what, h->n, hist_quantile(h, 0.5), hist_quantile(h, 0.99),
+	    hist_quantile(h, 0.999));
+}
+
+static int run(void)
+{
+	struct worker *workers, total;
+	uint64_t start = UINT64_MAX, end = 0;
+	unsigned long long n;
+	double secs;
+	int i;
+
+	if ((workers = calloc(nthreads, sizeof(*workers))) == NULL)
+		err(1, "calloc");
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nthreads; ++i) {
+		struct worker *w = &workers[i];
+
+		w->rng = hash_mix64(i + 1) | 1;
+		w->nconns = hrw_count(members) * connsper;
+		if ((w->conns = calloc(w->nconns, sizeof(*w->conns))) == NULL)
+			err(1, "calloc");
+		if ((w->cfg = tls_config_new()) == NULL)
+			errx(1, "unable to allocate TLS config");
+		if (tls_config_set_ca_mem(w->cfg, ca, calen) == -1)
+			errx(1, "unable to set root CA file");
+		if ((errno = pthread_create(&w->thread, NULL, worker_run, w)) != 0)
+			err(1, "pthread_create");
+	}
+	for (i = 0; i < nthreads; ++i) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		if (w->start < start)
+			start = w->start;
+		if (w->end > end)
+			end = w->end;
+		hist_merge(&total.hit, &w->hit);
+		hist_merge(&total.miss, &w->miss);
+		total.hits += w->hits;
+		total.misses += w->misses;
+		total.missing += w->missing;
+		total.failed += w->failed;
+		total.skipped += w->skipped;
+		total.bytes += w->bytes;
+		tls_config_free(w->cfg);
+		free(w->conns);
+	}
+	free(workers);
+
+	/* what failed is not throughput */
+	n = total.hits + total.misses + total.missing;
+	secs = (end - start) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+	if (rate > 0)
+		printf("Loadgen: open loop, %d threads, %.1f requests/s offered\n",
+		    nthreads, rate);
+	else
+		printf("Loadgen: closed loop, %d threads, %d requests in flight "
+		    "on each\n", nthreads, window);
+	printf("Loadgen: %llu requests in %.3f s, %.1f requests/s, %.2f MB/s\n",
+	    n, secs, n / secs, total.bytes / secs / 1e6);
+	printf("Loadgen: %llu received, %llu missing, %llu failed\n",
+	    total.hits + total.misses, total.missing, total.failed);
+	if (total.skipped != 0)
+		printf("Loadgen: %llu not asked for, their proxy was down\n",
+		    total.skipped);
+	report_latency("hits", &total.hit);
+	report_latency("misses", &total.miss);
+	printf("Loadgen: hit ratio %.1f%% across %zu proxies\n",
+	    total.hits + total.misses ? 100.0 * total.hits /
+	    (total.hits + total.misses) : 0.0, hrw_count(members));
+	return total.failed != 0 || total.skipped != 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option longopts[] = {
+		{ "threads",	required_argument,	NULL,	't' },
+		{ "conns",	required_argument,	NULL,	'c' },
+		{ "window",	required_argument,	NULL,	'w' },
+		{ "rate",	required_argument,	NULL,	'r' },
+		{ "duration",	required_argument,	NULL,	'd' },
+		{ "requests",	required_argument,	NULL,	'n' },
+		{ "dist",	required_argument,	NULL,	'D' },
+		{ "files",	required_argument,	NULL,	'f' },
+		{ "members",	required_argument,	NULL,	'm' },
+		{ "deflate",	no_argument,		NULL,	'z' },
+		{ "generate",	no_argument,		NULL,	'g' },
+		{ "size",	required_argument,	NULL,	's' },
+		{ NULL,		0,			NULL,	0 }
+	};
+	const char *membership = NULL, *trace = NULL;
+	uint64_t minsize = DEFAULT_MINSIZE, maxsize = DEFAULT_MAXSIZE;
+	size_t nfiles = DEFAULT_FILES;
+	int ch, gen = 0;
+	char *ep;
+
+	while ((ch = getopt_long_only(argc, argv, "", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 't':
+			nthreads = getnumber(optarg, 1, 256);
+			break;
+		case 'c':
+			connsper = getnumber(optarg, 1, 64);
+			break;
+		case 'w':
+			window = getnumber(optarg, 1, MAXWINDOW);
+			break;
+		case 'r':
+			rate = getreal(optarg);
+			break;
+		case 'd':
+			duration = getnumber(optarg, 0, 86400);
+			break;
+		case 'n':
+			maxrequests = getnumber(optarg, 1, LLONG_MAX);
+			break;
+		case 'D':
+			if (strcmp(optarg, "uniform") == 0)
+				dist = D_UNIFORM;
+			else if (strcmp(optarg, "zipf") == 0)
+				dist = D_ZIPF;
+			else if (strncmp(optarg, "zipf:", 5) == 0) {
+				dist = D_ZIPF;
+				zipfs = getreal(optarg + 5);
+			} else if (strncmp(optarg, "trace:", 6) == 0) {
+				dist = D_TRACE;
+				trace = optarg + 6;
+			} else
+				usage();
+			break;
+		case 'f':
+			nfiles = getnumber(optarg, 1, 1000000);
+			break;
+		case 'm':
+			membership = optarg;
+			break;
+		case 'z':
+			accept_deflate = PROTO_ACCEPT_DEFLATE;
+			break;
+		case 'g':
+			gen = 1;
+			break;
+		case 's':
+			minsize = strtoull(optarg, &ep, 10);
+			if (ep == optarg || *ep != ':' || *optarg == '-')
+				usage();
+			maxsize = strtoull(ep + 1, &ep, 10);
+			if (*ep != '\0' || minsize == 0 || maxsize < minsize)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+	if (gen)
+		return generate(nfiles, minsize, maxsize);
+
+	/* run until the time is up; a trace or a count of requests may end it first */
+	if (duration == -1)
+		duration = trace != NULL || maxrequests != 0 ? 0 : DEFAULT_DURATION;
+
+	/* the same proxies the client would use */
+	if (membership != NULL || access(MEMBERSHIP, F_OK) == 0) {
+		if ((members = hrw_load(membership ? membership : MEMBERSHIP)) == NULL)
+			exit(1);
+	} else {
+		members = hrw_new();
+		for (int i = 0; i < 6; ++i) {
+			char proxy[8];
+
+			snprintf(proxy, sizeof(proxy), "%d", 9000 + i);
+			hrw_add(members, proxy, 1);
+		}
+	}
+
+	if (trace != NULL)
+		trace_keys(trace);
+	else
+		corpus_keys(nfiles);
+	if (dist == D_ZIPF)
+		zipf_setup();
+
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+	if ((ca = tls_load_file("../../certificates/root.pem", &calen, NULL)) == NULL)
+		errx(1, "unable to set root CA file");
+
+	/* a proxy that drops us only fails its own requests */
+	signal(SIGPIPE, SIG_IGN);
+
+	return run();
+}
@@ -0,0 +1,517 @@
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/sha.h>
+
+#include "bloom.h"
+#include "cache.h"
+#include "evict.h"
+#include "hash.h"
+#include "hrw.h"
+#include "proto.h"
+#include "stats.h"
+
+/*
+ * Microbenchmarks for the hashing on every request: the digest and
+ * filter probe the proxy starts a lookup with, the cache's hash table,
+ * and the HRW ranking the client and peers pick a proxy with. Each one
+ * runs for long enough to time, over the key lengths, cache sizes or
+ * proxy counts it depends on, and says how long one operation took and
+ * how many allocations it made.
+ *
+ * The results are JSON, one line per benchmark and size, with the time
+ * they were taken and whatever -label says (a commit, say), so that
+ * -out can keep appending them to one file to be compared over time.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc when
+ * linking (see CMakeLists.txt), so only those the tree's own code makes
+ * are seen, not libc's or libcrypto's.
+ */
+
+#define DEFAULT_TIME	200	/* milliseconds to run each benchmark for */
+#define NKEYS		(1 << 16)	/* names to go round, a power of two */
+#define KEYLEN		32	/* when the benchmark is not about key length */
+#define MAXKEYLEN	1024
+#define FILTERFP	0.01
+
+struct result {
+	const char *bench;
+	const char *policy;	/* NULL if there is no cache */
+	size_t keylen, nodes, entries;	/* 0 where it does not apply */
+	uint64_t iters;
+	double ns;
+	double allocs;
+};
+
+/* what a benchmark works on; built before the clock starts */
+struct fixture {
+	size_t keylen;
+	char *keys;		/* NKEYS names, keylen + 1 bytes apart */
+	unsigned char (*hashes)[HASHSIZE];	/* and their digests */
+	uint64_t (*fhashes)[2];		/* and their hash128 */
+	size_t nhashes;
+	struct bloom *filter;
+	struct cache *cache;
+	struct hrw *ring;
+	size_t k;
+};
+
+static const char *label;
+static FILE *out;
+static uint64_t mintime = DEFAULT_TIME * 1000000ULL;
+static const char *only;
+static volatile uint64_t sink;		/* so no result is optimized away */
+static uint64_t nallocs;
+
+void	*__real_malloc(size_t);
+void	*__real_calloc(size_t, size_t);
+void	*__real_realloc(void *, size_t);
+
+void *__wrap_malloc(size_t n)
+{
+	++nallocs;
+	return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	++nallocs;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+	++nallocs;
+	return __real_realloc(p, n);
+}
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-time ms] [-only name] [-label text] "
+	    "[-out file]\n", __progname);
+	exit(1);
+}
+
+#define KEY(fx, i)	((fx)->keys + (i) * ((fx)->keylen + 1))
+
+/* a name the way the corpus has them, padded out to len */
+static void make_key(char *key, size_t len, const char *prefix, size_t i)
+{
+	size_t n;
+
+	n = snprintf(key, len + 1, "%s%06zu.dat", prefix, i);
+	for (; n < len; ++n)
+		key[n] = 'a' + (i + n) % 26;
+	key[len] = '\0';
+}
+
+static void make_keys(struct fixture *fx, const char *prefix)
+{
+	size_t i;
+
+	free(fx->keys);
+	if ((fx->keys = malloc(NKEYS * (fx->keylen + 1))) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < NKEYS; ++i)
+		make_key(KEY(fx, i), fx->keylen, prefix, i);
+}
+
+/* the digests of n names, the way the proxy keys its cache and filter */
+static void make_hashes(struct fixture *fx, size_t n, const char *prefix)
+{
+	char key[MAXKEYLEN + 1];
+	size_t i;
+
+	free(fx->hashes);
+	free(fx->fhashes);
+	if ((fx->hashes = malloc(n * sizeof(*fx->hashes))) == NULL ||
+	    (fx->fhashes = malloc(n * sizeof(*fx->fhashes))) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < n; ++i) {
+		make_key(key, fx->keylen, prefix, i);
+		SHA512((unsigned char *)key, fx->keylen, fx->hashes[i]);
+		hash128(key, fx->keylen, 0, fx->fhashes[i]);
+	}
+	fx->nhashes = n;
+}
+
+/* go round the keys in an order the prefetcher cannot guess */
+static size_t pick(uint64_t i, size_t n)
+{
+	return (i * 2654435761ULL) % n;
+}
+
+static void run_sha512(struct fixture *fx, uint64_t iters)
+{
+	unsigned char h[HASHSIZE];
+	uint64_t i, s = 0;
+
+	for (i = 0; i < iters; ++i) {
+		SHA512((unsigned char *)KEY(fx, i & (NKEYS - 1)), fx->keylen, h);
+		s += h[0];
+	}
+	sink += s;
+}
+
+static void run_hash128(struct fixture *fx, uint64_t iters)
+{
+	uint64_t h[2], i, s = 0;
+
+	for (i = 0; i < iters; ++i) {
+		hash128(KEY(fx, i & (NKEYS - 1)), fx->keylen, 0, h);
+		s += h[0];
+	}
+	sink += s;
+}
+
+/* the start of every lookup: hash the name, ask the filter */
+static void run_filter_probe(struct fixture *fx, uint64_t iters)
+{
+	uint64_t h[2], i, s = 0;
+
+	for (i = 0; i < iters; ++i) {
+		hash128(KEY(fx, pick(i, NKEYS)), fx->keylen, 0, h);
+		s += bloom_check(fx->filter, h);
+	}
+	sink += s;
+}
+
+static void run_bloom_check(struct fixture *fx, uint64_t iters)
+{
+	uint64_t i, s = 0;
+
+	for (i = 0; i < iters; ++i)
+		s += bloom_check(fx->filter, fx->fhashes[pick(i, fx->nhashes)]);
+	sink += s;
+}
+
+static void run_cache_lookup(struct fixture *fx, uint64_t iters)
+{
+	struct cache_entry *e;
+	uint64_t i, s = 0;
+
+	for (i = 0; i < iters; ++i) {
+		if ((e = cache_lookup(fx->cache,
+		    fx->hashes[pick(i, fx->nhashes)])) != NULL) {
+			s += e->size;
+			cache_release(e);
+		}
+	}
+	sink += s;
+}
+
+/* what client_lookup does before it has an answer, on a hit */
+static void run_request_lookup(struct fixture *fx, uint64_t iters)
+{
+	unsigned char h[HASHSIZE];
+	struct cache_entry *e;
+	uint64_t fh[2], i, s = 0;
+	const char *key;
+
+	for (i = 0; i < iters; ++i) {
+		key = KEY(fx, pick(i, NKEYS));
+		SHA512((const unsigned char *)key, fx->keylen, h);
+		hash128(key, fx->keylen, 0, fh);
+		if (bloom_check(fx->filter, fh) &&
+		    (e = cache_lookup(fx->cache, h)) != NULL) {
+			s += e->size;
+			cache_release(e);
+		}
+	}
+	sink += s;
+}
+
+static void run_hrw_rank(struct fixture *fx, uint64_t iters)
+{
+	size_t order[fx->k];
+	uint64_t i, s = 0;
+
+	for (i = 0; i < iters; ++i) {
+		hrw_rank(fx->ring, KEY(fx, i & (NKEYS - 1)), fx->keylen,
+		    order, fx->k);
+		s += order[0];
+	}
+	sink += s;
+}
+
+/*
+ * Run it for longer and longer until it takes mintime, and report the
+ * last run. The first one, of one iteration, warms things up.
+ */
+static void bench(struct result *res, struct fixture *fx,
+    void (*run)(struct fixture *, uint64_t))
+{
+	uint64_t iters = 1, t, a, grow;
+
+	if (only != NULL && strncmp(res->bench, only, strlen(only)) != 0)
+		return;
+	for (;;) {
+		a = nallocs;
+		t = stats_now();
+		run(fx, iters);
+		t = stats_now() - t;
+		a = nallocs - a;
+		if (t >= mintime)
+			break;
+		/* aim a little past mintime, but no more than 100 times on */
+		grow = t == 0 ? 100 : mintime * 6 / 5 / t + 1;
+		iters *= grow > 100 ? 100 : grow < 2 ? 2 : grow;
+	}
+	res->iters = iters;
+	res->ns = (double)t / iters;
+	res->allocs = (double)a / iters;
+
+	fprintf(out, "{\"time\":%lld,", (long long)time(NULL));
+	if (label != NULL)
+		fprintf(out, "\"label\":\"%s\",", label);
+	fprintf(out, "\"bench\":\"%s\",", res->bench);
+	if (res->policy != NULL)
+		fprintf(out, "\"policy\":\"%s\",", res->policy);
+	fprintf(out, "\"keylen\":%zu,\"nodes\":%zu,\"entries\":%zu,"
+	    "\"iters\":%llu,\"ns_op\":%.2f,\"allocs_op\":%.3f}\n",
+	    res->keylen, res->nodes, res->entries,
+	    (unsigned long long)res->iters, res->ns, res->allocs);
+	fflush(out);
+}
+
+/* a filter of n names, with those in fx->hashes in it */
+static void fill_filter(struct fixture *fx, size_t n)
+{
+	size_t i;
+
+	fx->filter = bloom_new(n, FILTERFP);
+	for (i = 0; i < fx->nhashes; ++i)
+		bloom_add(fx->filter, fx->fhashes[i]);
+}
+
+static void fill_cache(struct fixture *fx, const struct evict_ops *policy)
+{
+	struct cache_entry *e;
+	size_t i;
+
+	/* room for all of them, so none is evicted */
+	fx->cache = cache_new(16, fx->nhashes * 1024, policy, fx->filter);
+	for (i = 0; i < fx->nhashes; ++i) {
+		if ((e = cache_entry_new(fx->hashes[i], fx->fhashes[i], 1)) == NULL)
+			errx(1, "cache entry allocation failed");
+		cache_add(fx->cache, e);
+		cache_release(e);
+	}
+}
+
+static void bench_keys(void)
+{
+	static const size_t lens[] = { 8, 32, 128, MAXKEYLEN };
+	struct fixture fx = { 0 };
+	struct result res;
+	size_t i;
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+		fx.keylen = lens[i];
+		make_keys(&fx, "lg");
+		memset(&res, 0, sizeof(res));
+		res.keylen = fx.keylen;
+		res.bench = "sha512";
+		bench(&res, &fx, run_sha512);
+		res.bench = "hash128";
+		bench(&res, &fx, run_hash128);
+
+		/* half the names are in the filter, the way a warm cache is */
+		make_hashes(&fx, NKEYS / 2, "lg");
+		fill_filter(&fx, NKEYS);
+		res.entries = NKEYS / 2;
+		res.bench = "filter_probe";
+		bench(&res, &fx, run_filter_probe);
+	}
+	free(fx.keys);
+	free(fx.hashes);
+	free(fx.fhashes);
+}
+
+static void bench_filter(void)
+{
+	static const size_t sizes[] = { 1 << 12, 1 << 16, 1 << 20, 1 << 23 };
+	struct fixture fx = { 0 };
+	struct result res;
+	size_t i;
+
+	if (only != NULL && strncmp("bloom_check", only, strlen(only)) != 0)
+		return;
+	fx.keylen = KEYLEN;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		memset(&res, 0, sizeof(res));
+		res.keylen = fx.keylen;
+		res.entries = sizes[i];
+		make_hashes(&fx, sizes[i], "lg");
+		fill_filter(&fx, sizes[i]);
+		res.bench = "bloom_check_hit";
+		bench(&res, &fx, run_bloom_check);
+		make_hashes(&fx, sizes[i] < NKEYS ? sizes[i] : NKEYS, "no");
+		res.bench = "bloom_check_miss";
+		bench(&res, &fx, run_bloom_check);
+	}
+	free(fx.hashes);
+	free(fx.fhashes);
+}
+
+/*
+ * A filter and a cache of each size, for each policy. Nothing in the
+ * tree frees either, as they last as long as the proxy does, so the
+ * entries are taken out again to give their memory back and the rest
+ * stays.
+ */
+static void bench_cache(void)
+{
+	static const size_t sizes[] = { 1 << 10, 1 << 16, 1 << 20 };
+	static const struct {
+		const char *name;
+		const struct evict_ops *ops;
+	} policies[] = {
+		{ "lru", &evict_lru },
+		{ "s3fifo", &evict_s3fifo },
+		{ "wtinylfu", &evict_wtinylfu },
+	};
+	struct fixture fx = { 0 };
+	struct result res;
+	size_t i, j, n;
+
+	if (only != NULL && strncmp("cache_lookup", only, strlen(only)) != 0 &&
+	    strncmp("request_lookup", only, strlen(only)) != 0)
+		return;
+	fx.keylen = KEYLEN;
+	make_keys(&fx, "lg");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		for (j = 0; j < sizeof(policies) / sizeof(policies[0]); ++j) {
+			memset(&res, 0, sizeof(res));
+			res.keylen = fx.keylen;
+			res.entries = sizes[i];
+			res.policy = policies[j].name;
+			make_hashes(&fx, sizes[i], "lg");
+			fill_filter(&fx, sizes[i]);
+			fill_cache(&fx, policies[j].ops);
+			res.bench = "cache_lookup_hit";
+			bench(&res, &fx, run_cache_lookup);
+			/* every name in fx.keys is in the cache, up to its size */
+			res.bench = "request_lookup";
+			if (sizes[i] >= NKEYS)
+				bench(&res, &fx, run_request_lookup);
+			make_hashes(&fx, sizes[i] < NKEYS ? sizes[i] : NKEYS, "no");
+			res.bench = "cache_lookup_miss";
+			bench(&res, &fx, run_cache_lookup);
+			make_hashes(&fx, sizes[i], "lg");
+			for (n = 0; n < fx.nhashes; ++n)
+				cache_remove(fx.cache, fx.hashes[n]);
+		}
+	}
+	free(fx.keys);
+	free(fx.hashes);
+	free(fx.fhashes);
+}
+
+static void bench_hrw(void)
+{
+	static const size_t counts[] = { 2, 6, 16, 64, 256 };
+	struct fixture fx = { 0 };
+	struct result res;
+	char name[32];
+	size_t i, n;
+
+	fx.keylen = KEYLEN;
+	make_keys(&fx, "lg");
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		if ((fx.ring = hrw_new()) == NULL)
+			err(1, "hrw_new");
+		for (n = 0; n < counts[i]; ++n) {
+			snprintf(name, sizeof(name), "127.0.0.1:%zu", 9000 + n);
+			if (hrw_add(fx.ring, name, 1 + n % 3) == -1)
+				err(1, "hrw_add");
+		}
+		memset(&res, 0, sizeof(res));
+		res.keylen = fx.keylen;
+		res.nodes = counts[i];
+		/* the proxy a name goes to, then the client's candidates */
+		fx.k = 1;
+		res.bench = "hrw_first";
+		bench(&res, &fx, run_hrw_rank);
+		fx.k = counts[i] < 3 ? counts[i] : 3;
+		res.bench = "hrw_rank";
+		bench(&res, &fx, run_hrw_rank);
+		/* and the whole order, as a peer falls back along it */
+		fx.k = counts[i];
+		res.bench = "hrw_order";
+		bench(&res, &fx, run_hrw_rank);
+		hrw_free(fx.ring);
+	}
+	free(fx.keys);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option longopts[] = {
+		{ "time",	required_argument,	NULL,	't' },
+		{ "only",	required_argument,	NULL,	'o' },
+		{ "label",	required_argument,	NULL,	'l' },
+		{ "out",	required_argument,	NULL,	'O' },
+		{ NULL,		0,			NULL,	0 }
+	};
+	const char *outfile = NULL;
+	char *ep;
+	long ms;
+	int ch;
+
+	while ((ch = getopt_long_only(argc, argv, "", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 't':
+			errno = 0;
+			ms = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno == ERANGE ||
+			    ms < 1 || ms > 60000) {
+				fprintf(stderr, "%s - must be a number from 1 to 60000\n",
+				    optarg);
+				usage();
+			}
+			mintime = ms * 1000000ULL;
+			break;
+		case 'o':
+			only = optarg;
+			break;
+		case 'l':
+			if (strpbrk(optarg, "\"\\") != NULL) {
+				fprintf(stderr, "%s - no quotes or backslashes\n",
+				    optarg);
+				usage();
+			}
+			label = optarg;
+			break;
+		case 'O':
+			outfile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+	out = stdout;
+	if (outfile != NULL && (out = fopen(outfile, "a")) == NULL)
+		err(1, "%s", outfile);
+
+	bench_keys();
+	bench_filter();
+	bench_cache();
+	bench_hrw();
+
+	if (out != stdout && fclose(out) == EOF)
+		err(1, "%s", outfile);
+	return 0;
+}
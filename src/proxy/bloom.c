@@ -0,0 +1,176 @@
+#include <sys/types.h>
+
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "proto.h"
+
+/*
+ * Counters are four bits, sixteen to a 64-bit word, and are updated
+ * with compare-and-swap on the word. A counter that reaches 15 sticks
+ * there, since we no longer know how many files share it; that only
+ * costs us the ability to forget those files.
+ */
+#define COUNTER_MAX	15
+
+struct bloom {
+	uint64_t *words;
+	uint64_t m;		/* counters */
+	int k;			/* probes per file */
+	unsigned long long negatives;	/* said no */
+	unsigned long long falsepos;	/* said maybe, was wrong */
+};
+
+/*
+ * For n files and a false positive rate p the best filter has
+ * m = -n ln p / (ln 2)^2 counters and k = (m / n) ln 2 probes.
+ */
+struct bloom *bloom_new(uint64_t n, double p)
+{
+	struct bloom *b;
+	double m;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		err(1, "calloc");
+	m = ceil(-(double)n * log(p) / (M_LN2 * M_LN2));
+	b->m = m < 64 ? 64 : (uint64_t)m;
+	b->k = (int)round((double)b->m / n * M_LN2);
+	if (b->k < 1)
+		b->k = 1;
+	if ((b->words = calloc((b->m + 15) / 16, sizeof(*b->words))) == NULL)
+		err(1, "Bloom filter allocation failed");
+	return b;
+}
+
+/*
+ * Kirsch and Mitzenmacher: probe i is h1 + i * h2, which is as good as
+ * k independent hashes. The product trick maps it onto [0, m) without
+ * a division.
+ */
+static uint64_t probe(uint64_t m, const uint64_t h[2], int i)
+{
+	uint64_t x = h[0] + (uint64_t)i * h[1];
+
+	return (uint64_t)(((unsigned __int128)x * m) >> 64);
+}
+
+static uint64_t bloom_probe(struct bloom *b, const uint64_t h[2], int i)
+{
+	return probe(b->m, h, i);
+}
+
+static unsigned int counter_get(struct bloom *b, uint64_t c)
+{
+	uint64_t w = __atomic_load_n(&b->words[c / 16], __ATOMIC_RELAXED);
+
+	return (w >> (c % 16 * 4)) & COUNTER_MAX;
+}
+
+static void counter_add(struct bloom *b, uint64_t c, int delta)
+{
+	uint64_t *wp = &b->words[c / 16], w, nw;
+	int shift = c % 16 * 4;
+	unsigned int v;
+
+	w = __atomic_load_n(wp, __ATOMIC_RELAXED);
+	do {
+		v = (w >> shift) & COUNTER_MAX;
+		if (v == COUNTER_MAX || (delta < 0 && v == 0))
+			return;
+		nw = delta > 0 ? w + (1ULL << shift) : w - (1ULL << shift);
+	} while (!__atomic_compare_exchange_n(wp, &w, nw, 1,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+int bloom_check(struct bloom *b, const uint64_t h[2])
+{
+	for (int i = 0; i < b->k; ++i) {
+		if (counter_get(b, bloom_probe(b, h, i)) == 0) {
+			__atomic_add_fetch(&b->negatives, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void bloom_add(struct bloom *b, const uint64_t h[2])
+{
+	for (int i = 0; i < b->k; ++i)
+		counter_add(b, bloom_probe(b, h, i), 1);
+}
+
+void bloom_remove(struct bloom *b, const uint64_t h[2])
+{
+	for (int i = 0; i < b->k; ++i)
+		counter_add(b, bloom_probe(b, h, i), -1);
+}
+
+/* bloom_check said maybe, but the file was not in the cache after all */
+void bloom_false_positive(struct bloom *b)
+{
+	__atomic_add_fetch(&b->falsepos, 1, __ATOMIC_RELAXED);
+}
+
+void bloom_report(struct bloom *b, u_short port)
+{
+	unsigned long long neg, fp;
+
+	neg = __atomic_load_n(&b->negatives, __ATOMIC_RELAXED);
+	fp = __atomic_load_n(&b->falsepos, __ATOMIC_RELAXED);
+	printf("Proxy %u: filter: %llu counters, %d hashes, %llu false positives "
+	    "in %llu misses, false positive rate %.3f%%\n", port,
+	    (unsigned long long)b->m, b->k, fp, neg + fp,
+	    neg + fp ? 100.0 * fp / (neg + fp) : 0.0);
+	fflush(stdout);
+}
+
+size_t bloom_digest_size(struct bloom *b)
+{
+	return BLOOM_DIGEST_HDR + (b->m + 7) / 8;
+}
+
+/*
+ * Write the digest to buf, bloom_digest_size bytes. Counters change
+ * under us as we go; the digest is only ever a hint, so that is fine.
+ */
+void bloom_digest(struct bloom *b, unsigned char *buf)
+{
+	unsigned char *bits = buf + BLOOM_DIGEST_HDR;
+	uint64_t w, c;
+
+	memset(buf, 0, bloom_digest_size(b));
+	proto_put64(buf, b->m);
+	buf[8] = b->k;
+	for (c = 0; c < b->m; c += 16) {
+		w = __atomic_load_n(&b->words[c / 16], __ATOMIC_RELAXED);
+		for (int j = 0; j < 16 && w != 0; ++j, w >>= 4)
+			if (w & COUNTER_MAX)
+				bits[(c + j) / 8] |= 1 << ((c + j) % 8);
+	}
+}
+
+/* bloom_check against a digest; 0 for a digest that makes no sense */
+int bloom_digest_check(const unsigned char *d, size_t len, const uint64_t h[2])
+{
+	const unsigned char *bits = d + BLOOM_DIGEST_HDR;
+	uint64_t m, c;
+	int k;
+
+	if (len < BLOOM_DIGEST_HDR)
+		return 0;
+	m = proto_get64(d);
+	k = d[8];
+	if (m == 0 || k == 0 || (len - BLOOM_DIGEST_HDR) != (m + 7) / 8)
+		return 0;
+	for (int i = 0; i < k; ++i) {
+		c = probe(m, h, i);
+		if (!(bits[c / 8] & (1 << (c % 8))))
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,36 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * A counting Bloom filter over the files in the cache, keyed by the
+ * 128-bit hash of the file name (see hash128). It is sized from how
+ * many files we expect and the false positive rate we can live with,
+ * and since it counts, files can be taken out again when they are
+ * evicted. Safe to use from any number of threads.
+ */
+struct bloom;
+
+struct bloom *bloom_new(uint64_t, double);
+int	bloom_check(struct bloom *, const uint64_t[2]);
+void	bloom_add(struct bloom *, const uint64_t[2]);
+void	bloom_remove(struct bloom *, const uint64_t[2]);
+void	bloom_false_positive(struct bloom *);
+void	bloom_report(struct bloom *, u_short);
+
+/*
+ * A digest is a snapshot of the filter for other proxies: a plain Bloom
+ * filter with one bit per counter, set where the counter is not 0, after
+ * a header that gives the number of bits and of probes. It answers
+ * bloom_check's question for whoever holds it.
+ */
+#define BLOOM_DIGEST_HDR	16
+
+size_t	bloom_digest_size(struct bloom *);
+void	bloom_digest(struct bloom *, unsigned char *);
+int	bloom_digest_check(const unsigned char *, size_t, const uint64_t[2]);
+
+#endif /* BLOOM_H */
@@ -0,0 +1,402 @@
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "cache.h"
+#include "evict.h"
+#include "store.h"
+
+/*
+ * Each shard is an open addressing hash table with linear probing. A
+ * slot keeps 64 bits of the digest inline next to the entry pointer,
+ * so a probe only touches the slot array until the prefix matches;
+ * the full digest in the entry is compared after that. Slots are
+ * deleted by shifting the rest of the probe run back, so there are no
+ * tombstones and lookups stay short however much churn there is.
+ */
+struct cache_slot {
+	uint64_t prefix;
+	struct cache_entry *entry;	/* NULL if the slot is empty */
+};
+
+struct cache_shard {
+	pthread_rwlock_t lock;
+	size_t count;
+	size_t mask;			/* slots - 1, a power of two */
+	struct cache_slot *slots;
+	unsigned long long hits, misses;
+} __attribute__((aligned(64)));
+
+/*
+ * The eviction policy sees every entry in every shard, so it has a
+ * lock of its own. It is never held together with a shard lock:
+ * entries the policy gives up are taken out of their shard after the
+ * policy lock is dropped, and the references keep them alive.
+ */
+struct cache {
+	unsigned int mask;	/* nshards - 1, nshards is a power of two */
+	struct cache_shard *shards;
+	pthread_mutex_t policylock;
+	const struct evict_ops *ops;
+	void *policy;
+	size_t budget;
+	size_t used;
+	unsigned long long evictions;
+	struct bloom *filter;
+};
+
+#define SHARD_MINSLOTS	16
+
+struct cache *cache_new(int nshards, size_t budget, const struct evict_ops *ops,
+    struct bloom *filter)
+{
+	struct cache *c;
+	unsigned int n = 1;
+
+	while (n < (unsigned int)nshards)
+		n <<= 1;
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(1, "cache allocation failed");
+	if (posix_memalign((void **)&c->shards, 64, n * sizeof(*c->shards)) != 0)
+		errx(1, "cache allocation failed");
+	memset(c->shards, 0, n * sizeof(*c->shards));
+	for (unsigned int i = 0; i < n; ++i) {
+		struct cache_shard *s = &c->shards[i];
+
+		if (pthread_rwlock_init(&s->lock, NULL) != 0)
+			errx(1, "cache lock initialization failed");
+		if ((s->slots = calloc(SHARD_MINSLOTS, sizeof(*s->slots))) == NULL)
+			err(1, "cache allocation failed");
+		s->mask = SHARD_MINSLOTS - 1;
+	}
+	c->mask = n - 1;
+	if (pthread_mutex_init(&c->policylock, NULL) != 0)
+		errx(1, "cache lock initialization failed");
+	c->ops = ops;
+	c->budget = budget;
+	c->policy = ops->init(budget);
+	c->filter = filter;
+	return c;
+}
+
+/*
+ * The digest is already uniformly distributed, so any bytes will do:
+ * the first four pick the shard, the next eight are the slot prefix
+ * and home position inside it.
+ */
+static struct cache_shard *cache_shard(struct cache *c, const unsigned char *hash)
+{
+	uint32_t h;
+
+	memcpy(&h, hash, sizeof(h));
+	return &c->shards[h & c->mask];
+}
+
+static uint64_t cache_prefix(const unsigned char *hash)
+{
+	uint64_t p;
+
+	memcpy(&p, hash + 4, sizeof(p));
+	return p;
+}
+
+void cache_ref(struct cache_entry *e)
+{
+	__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+}
+
+void cache_release(struct cache_entry *e)
+{
+	if (e == NULL)
+		return;
+	if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (e->store == NULL)
+			free(e->body);
+		else
+			store_free(e);
+		free(e);
+	}
+}
+
+static size_t shard_find(struct cache_shard *s, const unsigned char *hash)
+{
+	uint64_t prefix = cache_prefix(hash);
+	size_t i;
+
+	for (i = prefix & s->mask; s->slots[i].entry != NULL; i = (i + 1) & s->mask)
+	{
+		if (s->slots[i].prefix == prefix &&
+		    memcmp(hash, s->slots[i].entry->hash, HASHSIZE) == 0)
+			return i;
+	}
+	return i;	/* the empty slot the digest would go in */
+}
+
+/* double the table and reinsert everything, done with the lock held */
+static int shard_grow(struct cache_shard *s)
+{
+	struct cache_slot *old = s->slots;
+	size_t oldslots = s->mask + 1, i, j;
+
+	if ((s->slots = calloc(oldslots * 2, sizeof(*s->slots))) == NULL) {
+		s->slots = old;
+		return -1;
+	}
+	s->mask = oldslots * 2 - 1;
+	for (i = 0; i < oldslots; ++i) {
+		if (old[i].entry == NULL)
+			continue;
+		for (j = old[i].prefix & s->mask; s->slots[j].entry != NULL;
+		    j = (j + 1) & s->mask)
+			;
+		s->slots[j] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/*
+ * empty slot i. Entries after it in the same probe run are moved back
+ * into the hole if that brings them no further from their home slot,
+ * which keeps every run contiguous.
+ */
+static void shard_delete(struct cache_shard *s, size_t i)
+{
+	size_t j, home;
+
+	for (j = (i + 1) & s->mask; s->slots[j].entry != NULL; j = (j + 1) & s->mask) {
+		home = s->slots[j].prefix & s->mask;
+		/* can slot j move to i? only if home is not in (i, j] */
+		if (((j - home) & s->mask) >= ((j - i) & s->mask)) {
+			s->slots[i] = s->slots[j];
+			i = j;
+		}
+	}
+	s->slots[i].entry = NULL;
+	--s->count;
+}
+
+/*
+ * take e out of its shard if it is still there, dropping the table's
+ * reference.
+ */
+static void cache_unlink(struct cache *c, struct cache_entry *e)
+{
+	struct cache_shard *s = cache_shard(c, e->hash);
+	size_t i;
+	int found;
+
+	pthread_rwlock_wrlock(&s->lock);
+	i = shard_find(s, e->hash);
+	if ((found = s->slots[i].entry == e))
+		shard_delete(s, i);
+	pthread_rwlock_unlock(&s->lock);
+	if (found) {
+		bloom_remove(c->filter, e->fhash);
+		store_forget(e);
+		cache_release(e);
+	}
+}
+
+/*
+ * returns the cached file with a reference the caller has to release,
+ * or NULL if we do not have it.
+ */
+struct cache_entry *cache_lookup(struct cache *c, const unsigned char *hash)
+{
+	struct cache_shard *s = cache_shard(c, hash);
+	struct cache_entry *e;
+
+	pthread_rwlock_rdlock(&s->lock);
+	if ((e = s->slots[shard_find(s, hash)].entry) != NULL)
+		cache_ref(e);
+	pthread_rwlock_unlock(&s->lock);
+	if (e == NULL) {
+		__atomic_add_fetch(&s->misses, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	__atomic_add_fetch(&s->hits, 1, __ATOMIC_RELAXED);
+	if (c->ops->lockfree_hit)
+		c->ops->hit(c->policy, e);
+	else {
+		pthread_mutex_lock(&c->policylock);
+		c->ops->hit(c->policy, e);
+		pthread_mutex_unlock(&c->policylock);
+	}
+	return e;
+}
+
+/* count a miss we found out about without looking, from the filter */
+void cache_miss(struct cache *c, const unsigned char *hash)
+{
+	__atomic_add_fetch(&cache_shard(c, hash)->misses, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * A new entry with room for size bytes of body, not in the cache yet;
+ * the caller has the only reference.
+ */
+struct cache_entry *cache_entry_new(const unsigned char *hash,
+    const uint64_t fhash[2], uint64_t size)
+{
+	struct cache_entry *e;
+
+	/* empty files are cached too, with a body of one unused byte */
+	if ((e = calloc(1, sizeof(*e))) == NULL ||
+	    (e->body = malloc(size > 0 ? size : 1)) == NULL) {
+		warn("cache allocation failed");
+		free(e);
+		return NULL;
+	}
+	memcpy(e->hash, hash, HASHSIZE);
+	e->fhash[0] = fhash[0];
+	e->fhash[1] = fhash[1];
+	e->size = size;
+	e->refs = 1;
+	return e;
+}
+
+/* would a file of this size be cached at all? */
+int cache_fits(struct cache *c, uint64_t size)
+{
+	return size <= c->budget && c->budget - size >= sizeof(struct cache_entry);
+}
+
+/*
+ * Put a complete entry into the cache; the caller keeps its reference.
+ * If another thread got the same file in first, theirs stays. 1 if the
+ * entry went in, 0 if not.
+ */
+int cache_add(struct cache *c, struct cache_entry *e)
+{
+	struct cache_shard *s = cache_shard(c, e->hash);
+	struct cache_entry *v, *victims = NULL;
+	size_t i;
+
+	if (!cache_fits(c, e->size))
+		return 0;
+	pthread_rwlock_wrlock(&s->lock);
+	if (s->slots[i = shard_find(s, e->hash)].entry != NULL) {
+		pthread_rwlock_unlock(&s->lock);
+		return 0;
+	}
+	/*
+	 * into the store's index before anyone can see the entry, so the
+	 * record is there before anything can evict it and write one
+	 * saying so; and only for the fetch that got in
+	 */
+	if (e->store != NULL && !e->persisted)
+		store_commit(e);
+	/* keep the load factor under 3/4 */
+	if ((s->count + 1) * 4 > (s->mask + 1) * 3) {
+		if (shard_grow(s) == -1)
+			err(1, "cache allocation failed");
+		i = shard_find(s, e->hash);
+	}
+	s->slots[i].prefix = cache_prefix(e->hash);
+	s->slots[i].entry = e;
+	++s->count;
+	/* the table's and the policy's */
+	__atomic_add_fetch(&e->refs, 2, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&s->lock);
+	bloom_add(c->filter, e->fhash);
+
+	/*
+	 * hand it to the policy, and collect whatever it gives up to get
+	 * us back under budget on a list threaded through the entries
+	 */
+	pthread_mutex_lock(&c->policylock);
+	c->ops->insert(c->policy, e);
+	c->used += cache_charge(e);
+	while (c->used > c->budget && (v = c->ops->victim(c->policy)) != NULL) {
+		c->used -= cache_charge(v);
+		++c->evictions;
+		v->next = victims;
+		victims = v;
+	}
+	pthread_mutex_unlock(&c->policylock);
+
+	while ((v = victims) != NULL) {
+		victims = v->next;
+		v->next = NULL;
+		cache_unlink(c, v);
+		cache_release(v);	/* the policy's reference */
+	}
+	return 1;
+}
+
+/* drop a file from the cache, if we have it */
+int cache_remove(struct cache *c, const unsigned char *hash)
+{
+	struct cache_shard *s = cache_shard(c, hash);
+	struct cache_entry *e;
+	size_t i;
+	int listed;
+
+	pthread_rwlock_wrlock(&s->lock);
+	if ((e = s->slots[i = shard_find(s, hash)].entry) != NULL)
+		shard_delete(s, i);
+	pthread_rwlock_unlock(&s->lock);
+	if (e == NULL)
+		return 0;
+
+	pthread_mutex_lock(&c->policylock);
+	if ((listed = e->queue != 0)) {
+		c->ops->remove(c->policy, e);
+		c->used -= cache_charge(e);
+	}
+	pthread_mutex_unlock(&c->policylock);
+	if (listed)
+		cache_release(e);
+	bloom_remove(c->filter, e->fhash);
+	store_forget(e);
+	cache_release(e);	/* the table's reference */
+	return 1;
+}
+
+/* print how well the cache is doing */
+void cache_report(struct cache *c, u_short port)
+{
+	unsigned long long hits = 0, misses = 0;
+	unsigned long long evictions;
+	size_t files = 0, used;
+
+	for (unsigned int i = 0; i <= c->mask; ++i) {
+		hits += __atomic_load_n(&c->shards[i].hits, __ATOMIC_RELAXED);
+		misses += __atomic_load_n(&c->shards[i].misses, __ATOMIC_RELAXED);
+		files += c->shards[i].count;
+	}
+	pthread_mutex_lock(&c->policylock);
+	used = c->used;
+	evictions = c->evictions;
+	pthread_mutex_unlock(&c->policylock);
+	printf("Proxy %u: cache %s: %zu files, %zu of %zu bytes, %llu hits, "
+	    "%llu misses, hit ratio %.2f%%, %llu evictions\n", port, c->ops->name,
+	    files, used, c->budget, hits, misses,
+	    hits + misses ? 100.0 * hits / (hits + misses) : 0.0, evictions);
+	fflush(stdout);
+}
+
+/* for the stats port: what is in the cache, and what it let go */
+void cache_stats(struct cache *c, FILE *fp)
+{
+	unsigned long long evictions;
+	size_t files = 0, used;
+
+	for (unsigned int i = 0; i <= c->mask; ++i)
+		files += __atomic_load_n(&c->shards[i].count, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&c->policylock);
+	used = c->used;
+	evictions = c->evictions;
+	pthread_mutex_unlock(&c->policylock);
+	stats_put(fp, "proxy_cache_files", NULL, 0, files);
+	stats_put(fp, "proxy_cache_bytes", NULL, 0, used);
+	stats_put(fp, "proxy_cache_budget_bytes", NULL, 0, c->budget);
+	stats_put(fp, "proxy_cache_evictions_total", NULL, 0, evictions);
+}
@@ -0,0 +1,65 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "proxy.h"
+
+/*
+ * The file cache, shared by every worker thread. It is split into
+ * shards by digest, each behind its own lock, so threads only contend
+ * when they touch the same shard. What stays in the cache is decided
+ * by an eviction policy (see evict.c) that keeps the total size under
+ * a byte budget. The Bloom filter is kept in step with what is in the
+ * hash table: files are added to it and taken out of it here.
+ */
+struct cache;
+
+/*
+ * A cached file. Entries are reference counted: the hash table holds
+ * one reference, the eviction policy another while the entry is on
+ * one of its lists, and everyone sending the file one each, so an
+ * entry evicted in the middle of a send stays valid until it is done.
+ */
+struct cache_entry {
+	unsigned char hash[HASHSIZE];
+	uint64_t fhash[2];	/* the name's hash128, for the filter */
+	uint64_t size;
+	uint64_t tag;		/* the server's name for this version */
+	int encoding;		/* PROTO_RAW, or the body is deflated */
+	time_t checked;		/* when the server last said it is current */
+	char *body;
+	int refs;
+	struct store *store;	/* the body is in its segment, if not NULL */
+	int persisted;		/* and the store's index knows about it */
+
+	/* eviction policy bookkeeping, under the policy lock */
+	struct cache_entry *prev, *next;
+	uint8_t queue;		/* which policy list we are on, 0 if none */
+	uint8_t freq;		/* access count, for policies that keep one */
+};
+
+/* what an entry costs against the budget */
+#define cache_charge(e)	((size_t)(e)->size + sizeof(struct cache_entry))
+
+struct evict_ops;
+struct bloom;
+struct store;
+
+struct cache *cache_new(int, size_t, const struct evict_ops *, struct bloom *);
+struct cache_entry *cache_lookup(struct cache *, const unsigned char *);
+void	cache_miss(struct cache *, const unsigned char *);
+struct cache_entry *cache_entry_new(const unsigned char *, const uint64_t[2],
+    uint64_t);
+int	cache_fits(struct cache *, uint64_t);
+int	cache_add(struct cache *, struct cache_entry *);
+int	cache_remove(struct cache *, const unsigned char *);
+void	cache_ref(struct cache_entry *);
+void	cache_release(struct cache_entry *);
+void	cache_report(struct cache *, u_short);
+void	cache_stats(struct cache *, FILE *);
+
+#endif /* CACHE_H */
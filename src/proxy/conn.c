@@ -0,0 +1,1025 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tls.h>
+#include <openssl/sha.h>
+#include <zlib.h>
+
+#include "bloom.h"
+#include "cache.h"
+#include "hash.h"
+#include "negcache.h"
+#include "proto.h"
+#include "proxy.h"
+#include "ticket.h"
+#include "trace.h"
+
+static void client_run(struct client *);
+static int range_ready(struct request *);
+
+/*
+ * handshakes with clients, old copies we fell back on, what became of
+ * deflated bodies, and where ranges came from, for the report
+ */
+static unsigned long long nfull, nresumed, nstale, npassed, ninflated;
+static unsigned long long nrangewhole, npiecehits, npiecefetches;
+
+/*
+ * A deflated body on its way to a client that wants it as it is. It
+ * reads the body, cache entry or fetch, from in on, and has the next
+ * piece of the file in out.
+ */
+struct inflater {
+	z_stream zs;
+	uint64_t in;
+	size_t outlen, outoff;
+	int done;
+	char out[CHUNKSIZE];
+};
+
+static struct request *request_new(struct client *c, uint32_t id,
+    size_t namelen)
+{
+	struct request *rq;
+
+	if ((rq = calloc(1, sizeof(*rq))) == NULL ||
+	    (rq->name = malloc(namelen + 1)) == NULL) {
+		warn("calloc");
+		free(rq);
+		return NULL;
+	}
+	rq->c = c;
+	rq->id = id;
+	rq->namelen = namelen;
+	rq->chunk = -1;
+	rq->status = -1;
+	rq->started = stats_now();
+	stats_add(&c->r->stats.requests, 1);
+	return rq;
+}
+
+static void request_free(struct request *rq)
+{
+	if (rq->f != NULL)
+		fetch_detach(rq->f, rq);
+	if (rq->z != NULL) {
+		inflateEnd(&rq->z->zs);
+		free(rq->z);
+	}
+	cache_release(rq->entry);
+	free(rq->name);
+	free(rq);
+}
+
+/*
+ * we know the answer to rq: put its response header together. A client
+ * that has this version of the file already is only told so.
+ */
+static void request_answer(struct request *rq, int status, uint64_t size,
+    uint64_t tag)
+{
+	struct proto_resp rs;
+
+	if (status == PROTO_OK && rq->tag != 0 && rq->tag == tag)
+		status = PROTO_NOTMODIFIED;
+	rq->status = status;
+	rq->size = status == PROTO_OK ? size : 0;
+	rs.version = PROTO_VERSION;
+	rs.status = status;
+	rs.id = rq->id;
+	rs.size = rq->size;
+	rs.tag = tag;
+	rs.encoding = status == PROTO_OK ? rq->encoding : PROTO_RAW;
+	/* a body out of the cache, not a fetch */
+	rs.flags = (status == PROTO_OK || status == PROTO_NOTMODIFIED) &&
+	    rq->f == NULL && rq->entry != NULL ? PROTO_CACHED : 0;
+	rq->cached = rs.flags & PROTO_CACHED;
+	proto_put_resp(rq->hdr, &rs);
+	rq->hdrlen = PROTO_RESPLEN;
+}
+
+/*
+ * rq gets a body of size bytes in encoding, starting with head: as it
+ * is, or, for a client that does not take it deflated, inflated as it
+ * goes out, and then it is the size of the file in the header.
+ */
+static void request_answer_body(struct request *rq, uint64_t size,
+    uint64_t tag, int encoding, const char *head)
+{
+	if (encoding != PROTO_DEFLATE || (rq->tag != 0 && rq->tag == tag)) {
+		request_answer(rq, PROTO_OK, size, tag);
+		return;
+	}
+	if (rq->accept) {
+		__atomic_add_fetch(&npassed, 1, __ATOMIC_RELAXED);
+		rq->encoding = PROTO_DEFLATE;
+		request_answer(rq, PROTO_OK, size, tag);
+		return;
+	}
+	if ((rq->z = calloc(1, sizeof(*rq->z))) == NULL ||
+	    inflateInit(&rq->z->zs) != Z_OK) {
+		warnx("unable to set up inflating");
+		free(rq->z);
+		rq->z = NULL;
+		request_answer(rq, PROTO_ERROR, 0, 0);
+		return;
+	}
+	rq->z->in = PROTO_ZHDRLEN;
+	__atomic_add_fetch(&ninflated, 1, __ATOMIC_RELAXED);
+	request_answer(rq, PROTO_OK, proto_get64((const unsigned char *)head),
+	    tag);
+}
+
+/* the copy the fetch was checking will do: answer from that after all */
+static void request_from_stale(struct request *rq)
+{
+	struct fetch *f = rq->f;
+
+	rq->entry = f->stale;
+	cache_ref(rq->entry);
+	rq->f = NULL;
+	fetch_detach(f, rq);
+	request_answer_body(rq, rq->entry->size, rq->entry->tag,
+	    rq->entry->encoding, rq->entry->body);
+}
+
+/*
+ * whether rq can be answered yet. A fetch that failed before we sent
+ * anything still gets a proper answer, the copy we have if it was only
+ * checking that; only once the size is out does a failure cost the
+ * client the connection. A body we inflate has to have the size of the
+ * file in before we can say what it is.
+ */
+static int request_ready(struct request *rq)
+{
+	struct fetch *f = rq->f;
+	enum fetch_state state;
+	const char *head;
+	size_t len;
+
+	if (rq->status != -1)
+		return 1;
+	if (rq->range)
+		return range_ready(rq);
+	if ((state = fetch_check(f)) != F_WAITING && f->ring != NULL &&
+	    fetch_hold(f, rq) == -1) {
+		/* the ring went on without it: ask again */
+		rq->f = NULL;
+		rq->lapped = 0;
+		fetch_detach(f, rq);
+		if ((rq->f = fetch_start(rq->c->r, rq)) == NULL) {
+			request_answer(rq, PROTO_ERROR, 0, 0);
+			return 1;
+		}
+		return 0;
+	}
+	switch (state) {
+	case F_WAITING:
+		return 0;
+	case F_FAILED:
+		if (f->stale != NULL) {
+			__atomic_add_fetch(&nstale, 1, __ATOMIC_RELAXED);
+			request_from_stale(rq);
+		} else
+			request_answer(rq, PROTO_ERROR, 0, 0);
+		break;
+	default:
+		if (f->status == PROTO_NOTMODIFIED && f->stale != NULL)
+			request_from_stale(rq);
+		else if (f->status != PROTO_OK)
+			request_answer(rq, f->status, f->size, f->tag);
+		else {
+			head = fetch_avail(f, 0, &len);
+			if (f->encoding == PROTO_DEFLATE && !rq->accept &&
+			    len < PROTO_ZHDRLEN) {
+				if (state == F_STREAMING)
+					return 0;
+				request_answer(rq, PROTO_ERROR, 0, 0);
+			} else
+				request_answer_body(rq, f->size, f->tag,
+				    f->encoding, head);
+		}
+		break;
+	}
+	return 1;
+}
+
+/* rq is all out: if it was a hit or a miss, how long it took */
+static void request_stats(struct request *rq)
+{
+	struct proxy_stats *st = &rq->c->r->stats;
+
+	if (rq->status != PROTO_OK && rq->status != PROTO_NOTMODIFIED)
+		return;
+	if (rq->cached) {
+		stats_add(&st->hits, 1);
+		stats_time(&st->hit, rq->started);
+	} else {
+		stats_add(&st->misses, 1);
+		stats_time(&st->miss, rq->started);
+	}
+}
+
+static void client_kill(struct client *c)
+{
+	struct request *rq;
+
+	/* let go of the fetches, so the ones passing through stop */
+	while ((rq = c->reqs) != NULL) {
+		c->reqs = rq->next;
+		request_free(rq);
+	}
+	c->reqtail = c->cur = NULL;
+	c->nreqs = 0;
+	if (c->rreq != NULL) {
+		request_free(c->rreq);
+		c->rreq = NULL;
+	}
+	reactor_kill(c->r, &c->ev);
+}
+
+void client_free(struct client *c)
+{
+	tls_free(c->tls);
+	free(c);
+}
+
+/*
+ * accept everything that is waiting on the listening socket; each new
+ * connection starts its TLS handshake right away.
+ */
+void client_accept(struct reactor *r)
+{
+	struct client *c;
+	struct tls *tls_cctx;
+	int clientsd, one = 1;
+
+	/* moves on to a new ticket key when it is time */
+	if (tickets_rotate(r->tickets, r->tlscfg, &r->keyrev) == -1)
+		warnx("TLS ticket key rotation failed (%s)",
+		    tls_config_error(r->tlscfg));
+	for (;;) {
+		clientsd = accept4(r->listener.fd, NULL, NULL, SOCK_NONBLOCK);
+		if (clientsd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED)
+				warn("accept failed");
+			return;
+		}
+		/* a response header is not to wait on the ACK for the last body */
+		setsockopt(clientsd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		tls_cctx = NULL;
+		if (tls_accept_socket(r->tls, &tls_cctx, clientsd) == -1) {
+			warnx("tls accept failed (%s)", tls_error(r->tls));
+			close(clientsd);
+			continue;
+		}
+		if ((c = calloc(1, sizeof(*c))) == NULL) {
+			warn("calloc");
+			tls_free(tls_cctx);
+			close(clientsd);
+			continue;
+		}
+		c->ev.kind = EV_CLIENT;
+		c->ev.fd = clientsd;
+		c->r = r;
+		c->started = stats_now();
+		c->serial = trace_conn();
+		TRACE(c->serial, 0, T_ACCEPT, 0);
+		c->tls = tls_cctx;
+		c->state = CL_HANDSHAKE;
+		client_run(c);
+	}
+}
+
+void client_event(struct client *c, uint32_t events)
+{
+	/* the client is gone, there is no one left to answer */
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		client_kill(c);
+		return;
+	}
+	client_run(c);
+}
+
+void client_report(u_short port)
+{
+	printf("Proxy %u: client handshakes: %llu full, %llu resumed\n", port,
+	    __atomic_load_n(&nfull, __ATOMIC_RELAXED),
+	    __atomic_load_n(&nresumed, __ATOMIC_RELAXED));
+	printf("Proxy %u: old copies served for want of the server: %llu\n",
+	    port, __atomic_load_n(&nstale, __ATOMIC_RELAXED));
+	printf("Proxy %u: deflated bodies: %llu sent as they are, %llu inflated "
+	    "for the client\n", port,
+	    __atomic_load_n(&npassed, __ATOMIC_RELAXED),
+	    __atomic_load_n(&ninflated, __ATOMIC_RELAXED));
+	printf("Proxy %u: ranges: %llu from whole files, %llu pieces from the "
+	    "cache, %llu fetched\n", port,
+	    __atomic_load_n(&nrangewhole, __ATOMIC_RELAXED),
+	    __atomic_load_n(&npiecehits, __ATOMIC_RELAXED),
+	    __atomic_load_n(&npiecefetches, __ATOMIC_RELAXED));
+}
+
+/*
+ * whether the server should be asked if e is still current before we
+ * send it: with a TTL of 0, on every hit
+ */
+static int entry_expired(struct reactor *r, struct cache_entry *e)
+{
+	return r->cachettl >= 0 && time(NULL) -
+	    __atomic_load_n(&e->checked, __ATOMIC_RELAXED) >= r->cachettl;
+}
+
+/*
+ * Answer from the cache if we can, or go and get the file. A peer that
+ * PEEKs only wants what we already have; it does not count towards
+ * what the cache should keep, either, nor does it wait for us to check
+ * our copy with the server. A name the server told us about not long
+ * ago that it does not have is not worth asking about again.
+ */
+static void client_lookup(struct client *c, struct request *rq, int peek)
+{
+	struct reactor *r = c->r;
+
+	SHA512((unsigned char *)rq->name, rq->namelen, rq->hash);
+	hash128(rq->name, rq->namelen, 0, rq->fhash);
+	if (!bloom_check(r->filter, rq->fhash)) {
+		DEBUG("Proxy %i: File %s not found in filter\n", r->port, rq->name);
+		if (!peek)
+			cache_miss(r->cache, rq->hash);
+	} else {
+		DEBUG("Proxy %i: File %s found in filter\n", r->port, rq->name);
+		if ((rq->entry = cache_lookup(r->cache, rq->hash)) != NULL) {
+			if (peek || !entry_expired(r, rq->entry)) {
+				DEBUG("Proxy %i: File %s found in cache\n", r->port, rq->name);
+				request_answer_body(rq, rq->entry->size,
+				    rq->entry->tag, rq->entry->encoding,
+				    rq->entry->body);
+				return;
+			}
+			DEBUG("Proxy %i: File %s found in cache, checking it is current\n",
+			    r->port, rq->name);
+			/* the fetch holds on to the copy from here on */
+			if ((rq->f = fetch_start(r, rq)) == NULL)
+				request_answer_body(rq, rq->entry->size,
+				    rq->entry->tag, rq->entry->encoding,
+				    rq->entry->body);
+			else {
+				cache_release(rq->entry);
+				rq->entry = NULL;
+			}
+			return;
+		}
+		DEBUG("Proxy %i: Bloom filter false positive for %s\n", r->port, rq->name);
+		bloom_false_positive(r->filter);
+		stats_add(&r->stats.falsepos, 1);
+	}
+
+	if (peek) {
+		request_answer(rq, PROTO_NOTFOUND, 0, 0);
+		return;
+	}
+	if (r->negcache != NULL && negcache_check(r->negcache, rq->fhash)) {
+		DEBUG("Proxy %i: File %s is known not to exist\n", r->port, rq->name);
+		stats_add(&r->stats.neghits, 1);
+		request_answer(rq, PROTO_NOTFOUND, 0, 0);
+		return;
+	}
+	if ((rq->f = fetch_start(r, rq)) == NULL)
+		request_answer(rq, PROTO_ERROR, 0, 0);
+}
+
+/*
+ * A peer wants our digest. It goes out like a cached file would, from
+ * an entry of its own that never goes into the cache.
+ */
+static void client_digest(struct client *c, struct request *rq)
+{
+	struct reactor *r = c->r;
+	size_t size = bloom_digest_size(r->filter);
+	struct cache_entry *e;
+
+	if ((e = cache_entry_new(rq->hash, rq->fhash, size)) == NULL) {
+		request_answer(rq, PROTO_ERROR, 0, 0);
+		return;
+	}
+	bloom_digest(r->filter, (unsigned char *)e->body);
+	/* an entry, but not out of the cache: answer before it is ours */
+	request_answer(rq, PROTO_OK, size, 0);
+	rq->entry = e;
+}
+
+/*
+ * Piece chunk of rq's file, as the cache and the fetches know it: the
+ * digests of the name, a 0 byte that no name has, and the number.
+ */
+static void chunk_key(struct request *rq, int64_t chunk)
+{
+	unsigned char key[PROTO_MAXNAME + 1 + 8];
+	size_t len = rq->namelen;
+
+	memcpy(key, rq->name, len);
+	key[len++] = '\0';
+	proto_put64(key + len, chunk);
+	len += 8;
+	SHA512(key, len, rq->hash);
+	hash128(key, len, 0, rq->fhash);
+}
+
+/*
+ * rq goes on to piece chunk of its range: out of the cache if it is
+ * there and current, or from a fetch, which checks our copy with the
+ * server if we have an old one. -1 if it cannot be had at all.
+ */
+static int chunk_start(struct request *rq, int64_t chunk)
+{
+	struct reactor *r = rq->c->r;
+
+	rq->chunk = chunk;
+	rq->chunkok = 0;
+	chunk_key(rq, chunk);
+	if (!bloom_check(r->filter, rq->fhash))
+		cache_miss(r->cache, rq->hash);
+	else if ((rq->entry = cache_lookup(r->cache, rq->hash)) == NULL) {
+		bloom_false_positive(r->filter);
+		stats_add(&r->stats.falsepos, 1);
+	}
+	else if (!entry_expired(r, rq->entry)) {
+		__atomic_add_fetch(&npiecehits, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	__atomic_add_fetch(&npiecefetches, 1, __ATOMIC_RELAXED);
+	/* the old copy will do if there is no asking about it */
+	if ((rq->f = fetch_start(r, rq)) == NULL)
+		return rq->entry != NULL ? 0 : -1;
+	cache_release(rq->entry);
+	rq->entry = NULL;
+	return 0;
+}
+
+/* rq is done with the piece it was on */
+static void chunk_stop(struct request *rq)
+{
+	struct fetch *f = rq->f;
+
+	if (f != NULL) {
+		rq->f = NULL;
+		fetch_detach(f, rq);
+	}
+	cache_release(rq->entry);
+	rq->entry = NULL;
+}
+
+/*
+ * What became of the piece rq is on: -1 while we wait for it, or else
+ * a status, and if that is PROTO_OK the piece's body (which starts
+ * with the size of the file), its size and its version. An old copy
+ * the server says is current, or that we fall back on for want of the
+ * server, is read from the cache entry, like a hit.
+ */
+static int chunk_settle(struct request *rq, const char **head,
+    uint64_t *size, uint64_t *tag)
+{
+	struct fetch *f = rq->f;
+	enum fetch_state state = F_DONE;
+	size_t len;
+
+	if (f != NULL) {
+		if ((state = fetch_check(f)) == F_WAITING)
+			return -1;
+		if (f->stale != NULL && (state == F_FAILED ||
+		    f->status == PROTO_NOTMODIFIED)) {
+			if (state == F_FAILED)
+				__atomic_add_fetch(&nstale, 1, __ATOMIC_RELAXED);
+			rq->entry = f->stale;
+			cache_ref(rq->entry);
+			rq->f = NULL;
+			fetch_detach(f, rq);
+		} else if (state == F_FAILED)
+			return PROTO_ERROR;
+		else if (f->status != PROTO_OK)
+			return f->status;
+	}
+	if (rq->entry != NULL) {
+		*head = rq->entry->body;
+		*size = rq->entry->size;
+		*tag = rq->entry->tag;
+		return PROTO_OK;
+	}
+	if ((*head = fetch_avail(f, 0, &len)) == NULL ||
+	    len < PROTO_RANGEHDRLEN)
+		return state == F_STREAMING ? -1 : PROTO_ERROR;
+	*size = f->size;
+	*tag = f->tag;
+	return PROTO_OK;
+}
+
+/*
+ * rq's range is sent from version tag of the file, which is total bytes
+ * long: the size of the file goes out with the header, and then as much
+ * of the range as there is.
+ */
+static void range_answer(struct request *rq, uint64_t total, uint64_t tag)
+{
+	uint64_t n = 0;
+
+	if (rq->off < total)
+		n = total - rq->off < rq->len ? total - rq->off : rq->len;
+	rq->total = total;
+	rq->version = tag;
+	request_answer(rq, PROTO_OK, PROTO_RANGEHDRLEN + n, tag);
+	if (rq->status != PROTO_OK)
+		return;
+	proto_put64(rq->hdr + PROTO_RESPLEN, total);
+	rq->hdrlen += PROTO_RANGEHDRLEN;
+	rq->size = n;
+}
+
+/* request_ready, for a range: its first piece says what the file is */
+static int range_ready(struct request *rq)
+{
+	const char *head;
+	uint64_t size, tag;
+	int status;
+
+	if ((status = chunk_settle(rq, &head, &size, &tag)) == -1)
+		return 0;
+	if (status == PROTO_OK)
+		range_answer(rq, proto_get64((const unsigned char *)head), tag);
+	else
+		request_answer(rq, status, 0, 0);
+	return 1;
+}
+
+/*
+ * A range comes out of the whole file if we have that cached as it is,
+ * and otherwise out of pieces of RANGECHUNK bytes that are cached on
+ * their own, so that a little of a big file never costs us all of it.
+ * Only the pieces we do not have are fetched, each with a RANGE of its
+ * own.
+ */
+static void client_range(struct client *c, struct request *rq)
+{
+	struct reactor *r = c->r;
+
+	SHA512((unsigned char *)rq->name, rq->namelen, rq->hash);
+	hash128(rq->name, rq->namelen, 0, rq->fhash);
+	if (r->negcache != NULL && negcache_check(r->negcache, rq->fhash)) {
+		DEBUG("Proxy %i: File %s is known not to exist\n", r->port, rq->name);
+		stats_add(&r->stats.neghits, 1);
+		request_answer(rq, PROTO_NOTFOUND, 0, 0);
+		return;
+	}
+	if (bloom_check(r->filter, rq->fhash) &&
+	    (rq->entry = cache_lookup(r->cache, rq->hash)) != NULL) {
+		if (rq->entry->encoding == PROTO_RAW &&
+		    !entry_expired(r, rq->entry)) {
+			DEBUG("Proxy %i: File %s found in cache\n", r->port, rq->name);
+			__atomic_add_fetch(&nrangewhole, 1, __ATOMIC_RELAXED);
+			range_answer(rq, rq->entry->size, rq->entry->tag);
+			return;
+		}
+		cache_release(rq->entry);
+		rq->entry = NULL;
+	}
+	DEBUG("Proxy %i: Range of %s, from piece %llu on\n", r->port, rq->name,
+	    (unsigned long long)(rq->off / RANGECHUNK));
+	if (chunk_start(rq, rq->off / RANGECHUNK) == -1)
+		request_answer(rq, PROTO_ERROR, 0, 0);
+}
+
+/*
+ * The next bytes of a range, out of the whole file or the piece they
+ * are in; nothing yet if that is still on its way. A piece has to be
+ * of the version the range started with. An old one from the cache is
+ * got again; one from the server means the file changed while we were
+ * sending it, and the piece we started with is old and has to go.
+ */
+static const char *range_body(struct request *rq, size_t *len)
+{
+	struct reactor *r = rq->c->r;
+	uint64_t pos = rq->off + rq->sent, start, n = 0, size, tag;
+	const char *head, *p;
+	int status;
+
+	if (rq->chunk < 0) {
+		*len = rq->size - rq->sent;
+		return rq->entry->body + pos;
+	}
+	*len = 0;
+	if (pos / RANGECHUNK != (uint64_t)rq->chunk) {
+		chunk_stop(rq);
+		if (chunk_start(rq, pos / RANGECHUNK) == -1)
+			return NULL;
+	}
+	while (!rq->chunkok) {
+		if ((status = chunk_settle(rq, &head, &size, &tag)) == -1)
+			return "";
+		if (status != PROTO_OK) {
+			warnx("%s: piece %lld: %s", rq->name, (long long)rq->chunk,
+			    proto_strstatus(status));
+			return NULL;
+		}
+		start = rq->chunk * RANGECHUNK;
+		if (start < rq->total)
+			n = rq->total - start < RANGECHUNK ?
+			    rq->total - start : RANGECHUNK;
+		if (tag == rq->version && size == PROTO_RANGEHDRLEN + n &&
+		    proto_get64((const unsigned char *)head) == rq->total) {
+			rq->chunkok = 1;
+			break;
+		}
+		if (rq->entry == NULL) {
+			warnx("%s changed while we sent a range of it", rq->name);
+			chunk_key(rq, rq->off / RANGECHUNK);
+			cache_remove(r->cache, rq->hash);
+			return NULL;
+		}
+		cache_remove(r->cache, rq->hash);
+		chunk_stop(rq);
+		__atomic_add_fetch(&npiecefetches, 1, __ATOMIC_RELAXED);
+		if ((rq->f = fetch_start(r, rq)) == NULL)
+			return NULL;
+	}
+	start = PROTO_RANGEHDRLEN + pos - rq->chunk * RANGECHUNK;
+	if (rq->entry != NULL) {
+		p = rq->entry->body + start;
+		*len = rq->entry->size - start;
+	} else
+		p = fetch_avail(rq->f, start, len);
+	if (*len > rq->size - rq->sent)
+		*len = rq->size - rq->sent;
+	return p;
+}
+
+/* a request has been read in full: queue it up and go find the answer */
+static void client_request(struct client *c, struct request *rq)
+{
+	TRACE(c->serial, rq->id, T_NAME, 0);
+	if (c->reqtail != NULL)
+		c->reqtail->next = rq;
+	else
+		c->reqs = rq;
+	c->reqtail = rq;
+	++c->nreqs;
+
+	if (rq->status != -1)
+		return;
+	if ((c->rframe.type & PROTO_TYPEMASK) == PROTO_RANGE) {
+		/* the offset and length came in after the name */
+		rq->range = 1;
+		rq->namelen -= PROTO_RANGELEN;
+		rq->off = proto_get64((unsigned char *)rq->name + rq->namelen);
+		rq->len = proto_get64((unsigned char *)rq->name + rq->namelen + 8);
+	}
+	rq->name[rq->namelen] = '\0';
+	switch (c->rframe.type & PROTO_TYPEMASK) {
+	case PROTO_GET:
+	case PROTO_PEEK:
+	case PROTO_RANGE:
+		if (rq->namelen == 0 || rq->namelen > PROTO_MAXNAME ||
+		    memchr(rq->name, '\0', rq->namelen))
+			request_answer(rq, PROTO_BADREQ, 0, 0);
+		else if (rq->range)
+			client_range(c, rq);
+		else
+			client_lookup(c, rq, (c->rframe.type & PROTO_TYPEMASK) ==
+			    PROTO_PEEK);
+		break;
+	case PROTO_DIGEST:
+		if (rq->namelen != 0)
+			request_answer(rq, PROTO_BADREQ, 0, 0);
+		else
+			client_digest(c, rq);
+		break;
+	default:
+		request_answer(rq, PROTO_BADREQ, 0, 0);
+		break;
+	}
+	TRACE(c->serial, rq->id, T_LOOKUP, rq->f == NULL && rq->entry != NULL);
+}
+
+/*
+ * Read requests for as long as the client sends them and we have room.
+ * Returns what tls_read is waiting for, 0 if we are not reading right
+ * now, or -1 if the connection is no good.
+ */
+static int client_read(struct client *c, int *progress)
+{
+	struct request *rq;
+	ssize_t ret;
+	int i;
+
+	for (;;) {
+		if (c->eof || c->badversion || c->nreqs >= MAXPIPELINE)
+			return 0;
+		if ((rq = c->rreq) == NULL)
+			ret = tls_read(c->tls, c->rhdr + c->rhdroff,
+			    sizeof(c->rhdr) - c->rhdroff);
+		else
+			ret = tls_read(c->tls, rq->name + c->rnameoff,
+			    rq->namelen - c->rnameoff);
+		if ((i = ret) == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT)
+			return i;
+		if (ret < 0) {
+			warnx("tls_read failed (%s)", tls_error(c->tls));
+			return -1;
+		}
+		*progress = 1;
+		if (ret == 0) {
+			/* all the requests we are going to get */
+			c->eof = 1;
+			if (rq != NULL) {
+				request_free(rq);
+				c->rreq = NULL;
+			}
+			return 0;
+		}
+
+		if (rq != NULL) {
+			if ((c->rnameoff += ret) < rq->namelen)
+				continue;
+			c->rreq = NULL;
+			client_request(c, rq);
+			continue;
+		}
+		if ((c->rhdroff += ret) < sizeof(c->rhdr))
+			continue;
+		c->rhdroff = 0;
+		proto_get_req(c->rhdr, &c->rframe);
+		if (c->rframe.version != PROTO_VERSION) {
+			/* no telling where the next frame starts */
+			c->badversion = 1;
+			if ((rq = request_new(c, 0, 0)) == NULL)
+				return -1;
+			request_answer(rq, PROTO_BADVERSION, 0, 0);
+			client_request(c, rq);
+			return 0;
+		}
+		/* a range is read along with the name */
+		if ((rq = request_new(c, c->rframe.id, c->rframe.namelen +
+		    ((c->rframe.type & PROTO_TYPEMASK) == PROTO_RANGE ?
+		    PROTO_RANGELEN : 0))) == NULL)
+			return -1;
+		rq->tag = c->rframe.tag;
+		rq->accept = c->rframe.type & PROTO_ACCEPT_DEFLATE;
+		c->rnameoff = 0;
+		if (rq->namelen > 0)
+			c->rreq = rq;
+		else
+			client_request(c, rq);
+	}
+}
+
+static struct request *client_next(struct client *c)
+{
+	struct request *rq;
+
+	for (rq = c->reqs; rq != NULL; rq = rq->next)
+		if (request_ready(rq))
+			return rq;
+	return NULL;
+}
+
+static void client_unlink(struct client *c, struct request *rq)
+{
+	struct request **rp, *prev = NULL;
+
+	for (rp = &c->reqs; *rp != rq; rp = &(*rp)->next)
+		prev = *rp;
+	*rp = rq->next;
+	if (c->reqtail == rq)
+		c->reqtail = prev;
+	--c->nreqs;
+}
+
+/*
+ * the body as it is from off on: straight out of the cache entry on a
+ * hit, or whatever the fetch has received so far on a miss.
+ */
+static const char *request_source(struct request *rq, uint64_t off,
+    size_t *len)
+{
+	if (rq->f != NULL)
+		return fetch_avail(rq->f, off, len);
+	*len = rq->entry->size - off;
+	return rq->entry->body + off;
+}
+
+/*
+ * the next piece of body to send, inflated first if it has to be. NULL
+ * if the body is no good.
+ */
+static const char *request_body(struct request *rq, size_t *len)
+{
+	struct inflater *z = rq->z;
+	const char *p;
+	size_t n;
+	int ret;
+
+	if (rq->range)
+		return range_body(rq, len);
+	if (z == NULL)
+		return request_source(rq, rq->sent, len);
+	while (z->outoff == z->outlen && !z->done) {
+		if ((p = request_source(rq, z->in, &n)) == NULL || n == 0)
+			break;
+		z->zs.next_in = (Bytef *)p;
+		z->zs.avail_in = n > UINT_MAX ? UINT_MAX : n;
+		z->zs.next_out = (Bytef *)z->out;
+		z->zs.avail_out = sizeof(z->out);
+		if ((ret = inflate(&z->zs, Z_NO_FLUSH)) != Z_OK &&
+		    ret != Z_STREAM_END) {
+			warnx("bad deflated body for %s", rq->name);
+			*len = 0;
+			return NULL;
+		}
+		z->done = ret == Z_STREAM_END;
+		z->in += (n > UINT_MAX ? UINT_MAX : n) - z->zs.avail_in;
+		z->outoff = 0;
+		z->outlen = sizeof(z->out) - z->zs.avail_out;
+		if (rq->f != NULL)
+			fetch_consumed(rq->f, rq, z->in);
+	}
+	*len = z->outlen - z->outoff;
+	if (*len == 0 && (z->done || rq->f == NULL)) {
+		/* it ended short of the size we gave */
+		warnx("bad deflated body for %s", rq->name);
+		return NULL;
+	}
+	return z->out + z->outoff;
+}
+
+/*
+ * Send responses, each one whole, in whatever order their answers come
+ * in. Returns what tls_write is waiting for, 0 if there is nothing to
+ * send right now, or -1 if the connection is no good.
+ */
+static int client_write(struct client *c, int *progress)
+{
+	struct request *rq;
+	const char *p;
+	size_t len;
+	ssize_t ret;
+	int i;
+
+	for (;;) {
+		if ((rq = c->cur) == NULL && (rq = c->cur = client_next(c)) == NULL)
+			return 0;
+		if (rq->hdroff < rq->hdrlen) {
+			p = (const char *)rq->hdr + rq->hdroff;
+			len = rq->hdrlen - rq->hdroff;
+		} else if (rq->sent < rq->size) {
+			if ((p = request_body(rq, &len)) == NULL)
+				return -1;
+			if (len == 0) {
+				/*
+				 * the size is out, all we can do now is hang up;
+				 * a range finds out for itself
+				 */
+				if (!rq->range && fetch_check(rq->f) == F_FAILED)
+					return -1;
+				return 0;
+			}
+		} else {
+			TRACE(c->serial, rq->id, T_LASTBYTE, rq->size);
+			request_stats(rq);
+			client_unlink(c, rq);
+			request_free(rq);
+			c->cur = NULL;
+			*progress = 1;
+			continue;
+		}
+
+		ret = tls_write(c->tls, p, len);
+		if ((i = ret) == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT)
+			return i;
+		if (ret < 0) {
+			warnx("TLS write failed (%s)", tls_error(c->tls));
+			return -1;
+		}
+		*progress = 1;
+		stats_add(&c->r->stats.bytesout, ret);
+		if (rq->hdroff < rq->hdrlen) {
+			if (rq->hdroff == 0)
+				TRACE(c->serial, rq->id, T_FIRSTBYTE, 0);
+			rq->hdroff += ret;
+		} else {
+			rq->sent += ret;
+			if (rq->z != NULL)
+				rq->z->outoff += ret;
+			else if (rq->f != NULL)
+				fetch_consumed(rq->f, rq, rq->sent);
+		}
+	}
+}
+
+static uint32_t want_events(int want)
+{
+	if (want == TLS_WANT_POLLIN)
+		return EPOLLIN;
+	if (want == TLS_WANT_POLLOUT)
+		return EPOLLOUT;
+	return 0;
+}
+
+/*
+ * A handshake worker is done with c. It leaves our epoll and goes to
+ * the I/O workers in turn, where it is run as if a fetch had woken it;
+ * from then on it is theirs, and we must not touch it again.
+ */
+static void client_handoff(struct client *c)
+{
+	struct reactor *r = c->r, *to = &r->io[r->nextio++ % r->nio];
+
+	if (c->ev.registered &&
+	    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->ev.fd, NULL) == -1) {
+		warn("epoll_ctl");
+		client_kill(c);
+		return;
+	}
+	c->ev.registered = 0;
+	c->ev.events = 0;
+	c->r = to;
+	reactor_post(to, &c->ev);
+}
+
+/*
+ * Drive the connection as far as it will go without blocking. Once the
+ * handshake is done we read requests and write responses side by side,
+ * until neither can go on; then we ask epoll for whatever the two are
+ * waiting on. A response waiting on its fetch asks for nothing, the
+ * fetch wakes us through reactor_defer.
+ */
+static void client_run(struct client *c)
+{
+	struct reactor *r = c->r;
+	int i, rw, ww, progress;
+
+	for (;;) {
+		switch (c->state) {
+		case CL_HANDSHAKE:
+			if ((i = tls_handshake(c->tls)) == TLS_WANT_POLLIN ||
+			    i == TLS_WANT_POLLOUT)
+				goto wait;
+			if (i == -1) {
+				warnx("tls handshake failed (%s)", tls_error(c->tls));
+				client_kill(c);
+				return;
+			}
+			__atomic_add_fetch(tls_conn_session_resumed(c->tls) ?
+			    &nresumed : &nfull, 1, __ATOMIC_RELAXED);
+			stats_add(&r->stats.handshakes, 1);
+			stats_time(&r->stats.handshake, c->started);
+			TRACE(c->serial, 0, T_HANDSHAKE,
+			    tls_conn_session_resumed(c->tls));
+			c->state = CL_OPEN;
+			if (r->io != NULL) {
+				client_handoff(c);
+				return;
+			}
+			break;
+
+		case CL_OPEN:
+			do {
+				progress = 0;
+				if ((rw = client_read(c, &progress)) == -1 ||
+				    (ww = client_write(c, &progress)) == -1) {
+					client_kill(c);
+					return;
+				}
+			} while (progress);
+			if ((c->eof || c->badversion) && c->reqs == NULL) {
+				c->state = CL_CLOSE;
+				break;
+			}
+			i = want_events(rw) | want_events(ww);
+			goto wait;
+
+		case CL_CLOSE:
+			if ((i = tls_close(c->tls)) == TLS_WANT_POLLIN ||
+			    i == TLS_WANT_POLLOUT)
+				goto wait;
+			client_kill(c);
+			return;
+		}
+	}
+
+wait:
+	if (reactor_want(r, &c->ev, i) == -1)
+		client_kill(c);
+}
@@ -0,0 +1,432 @@
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evict.h"
+
+/*
+ * Eviction policies for the proxy cache. All of them work on byte
+ * sizes rather than entry counts, since our files vary a lot in size,
+ * and keep their entries on intrusive lists threaded through
+ * cache_entry so no policy allocates per entry.
+ */
+
+/* which list an entry is on, stored in cache_entry.queue */
+enum {
+	Q_NONE,
+	Q_LRU,
+	Q_SMALL,	/* S3-FIFO */
+	Q_MAIN,
+	Q_WINDOW,	/* W-TinyLFU */
+	Q_PROBATION,
+	Q_PROTECTED,
+};
+
+struct elist {
+	struct cache_entry *head, *tail;
+	size_t bytes;
+	size_t count;
+};
+
+static void elist_push(struct elist *l, struct cache_entry *e, int queue)
+{
+	e->prev = NULL;
+	e->next = l->head;
+	if (l->head != NULL)
+		l->head->prev = e;
+	else
+		l->tail = e;
+	l->head = e;
+	l->bytes += cache_charge(e);
+	++l->count;
+	e->queue = queue;
+}
+
+static void elist_unlink(struct elist *l, struct cache_entry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		l->head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		l->tail = e->prev;
+	e->prev = e->next = NULL;
+	l->bytes -= cache_charge(e);
+	--l->count;
+	e->queue = Q_NONE;
+}
+
+static struct cache_entry *elist_pop(struct elist *l)
+{
+	struct cache_entry *e = l->tail;
+
+	if (e != NULL)
+		elist_unlink(l, e);
+	return e;
+}
+
+/* the digest is random already, so any eight of its bytes are a hash */
+static uint64_t entry_hash(const struct cache_entry *e)
+{
+	uint64_t h;
+
+	memcpy(&h, e->hash + 12, sizeof(h));
+	return h;
+}
+
+/*
+ * LRU: one list, most recently used at the head. Every hit moves the
+ * entry, so hits need the policy lock.
+ */
+struct lru {
+	struct elist list;
+};
+
+static void *lru_init(size_t budget)
+{
+	struct lru *p;
+
+	(void)budget;
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		err(1, "calloc");
+	return p;
+}
+
+static void lru_insert(void *arg, struct cache_entry *e)
+{
+	struct lru *p = arg;
+
+	elist_push(&p->list, e, Q_LRU);
+}
+
+static void lru_hit(void *arg, struct cache_entry *e)
+{
+	struct lru *p = arg;
+
+	if (e->queue != Q_LRU)
+		return;
+	elist_unlink(&p->list, e);
+	elist_push(&p->list, e, Q_LRU);
+}
+
+static void lru_remove(void *arg, struct cache_entry *e)
+{
+	struct lru *p = arg;
+
+	elist_unlink(&p->list, e);
+}
+
+static struct cache_entry *lru_victim(void *arg)
+{
+	struct lru *p = arg;
+
+	return elist_pop(&p->list);
+}
+
+const struct evict_ops evict_lru = {
+	"lru", 0, lru_init, lru_insert, lru_hit, lru_remove, lru_victim
+};
+
+/*
+ * S3-FIFO (Yang et al., SOSP '23): new entries go into a small FIFO
+ * holding 10% of the budget. Whatever leaves it without being hit is
+ * evicted and remembered in a ghost table; the rest, and anything the
+ * ghost table recognizes when it comes back, goes into the main FIFO,
+ * which gives entries hit since their last pass another round. Hits
+ * only bump a two bit counter, so they need no lock at all.
+ */
+#define S3_MAXFREQ	3
+
+struct s3fifo {
+	size_t budget;
+	struct elist small, main;
+	uint64_t *ghost;	/* direct mapped, 0 is empty */
+	size_t ghostmask;
+};
+
+static void *s3fifo_init(size_t budget)
+{
+	struct s3fifo *p;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		err(1, "calloc");
+	p->budget = budget;
+	p->ghostmask = 4096 - 1;
+	if ((p->ghost = calloc(p->ghostmask + 1, sizeof(*p->ghost))) == NULL)
+		err(1, "calloc");
+	return p;
+}
+
+/*
+ * The ghost table only has to remember about as many entries as the
+ * main FIFO holds; collisions just forget an older one early. When it
+ * grows, what it remembers goes along into the bigger table.
+ */
+static void s3fifo_ghost_add(struct s3fifo *p, struct cache_entry *e)
+{
+	uint64_t h = entry_hash(e) | 1;
+	size_t i, mask;
+	uint64_t *g;
+
+	if (p->main.count > (p->ghostmask + 1) / 2) {
+		mask = p->ghostmask * 2 + 1;
+		if ((g = calloc(mask + 1, sizeof(*g))) != NULL) {
+			for (i = 0; i <= p->ghostmask; ++i)
+				if (p->ghost[i] != 0)
+					g[p->ghost[i] & mask] = p->ghost[i];
+			free(p->ghost);
+			p->ghost = g;
+			p->ghostmask = mask;
+		}
+	}
+	p->ghost[h & p->ghostmask] = h;
+}
+
+static int s3fifo_ghost_take(struct s3fifo *p, struct cache_entry *e)
+{
+	uint64_t h = entry_hash(e) | 1;
+
+	if (p->ghost[h & p->ghostmask] != h)
+		return 0;
+	p->ghost[h & p->ghostmask] = 0;
+	return 1;
+}
+
+static void s3fifo_insert(void *arg, struct cache_entry *e)
+{
+	struct s3fifo *p = arg;
+
+	__atomic_store_n(&e->freq, 0, __ATOMIC_RELAXED);
+	if (s3fifo_ghost_take(p, e))
+		elist_push(&p->main, e, Q_MAIN);
+	else
+		elist_push(&p->small, e, Q_SMALL);
+}
+
+static void s3fifo_hit(void *arg, struct cache_entry *e)
+{
+	uint8_t f = __atomic_load_n(&e->freq, __ATOMIC_RELAXED);
+
+	(void)arg;
+	if (f < S3_MAXFREQ)
+		__atomic_store_n(&e->freq, f + 1, __ATOMIC_RELAXED);
+}
+
+static void s3fifo_remove(void *arg, struct cache_entry *e)
+{
+	struct s3fifo *p = arg;
+
+	elist_unlink(e->queue == Q_SMALL ? &p->small : &p->main, e);
+}
+
+static struct cache_entry *s3fifo_victim(void *arg)
+{
+	struct s3fifo *p = arg;
+	struct cache_entry *e;
+	uint8_t f;
+
+	for (;;) {
+		if (p->small.count > 0 &&
+		    (p->small.bytes > p->budget / 10 || p->main.count == 0)) {
+			e = elist_pop(&p->small);
+			if (__atomic_load_n(&e->freq, __ATOMIC_RELAXED) > 0) {
+				__atomic_store_n(&e->freq, 0, __ATOMIC_RELAXED);
+				elist_push(&p->main, e, Q_MAIN);
+				continue;
+			}
+			s3fifo_ghost_add(p, e);
+			return e;
+		}
+		if ((e = elist_pop(&p->main)) == NULL)
+			return NULL;
+		if ((f = __atomic_load_n(&e->freq, __ATOMIC_RELAXED)) > 0) {
+			__atomic_store_n(&e->freq, f - 1, __ATOMIC_RELAXED);
+			elist_push(&p->main, e, Q_MAIN);
+			continue;
+		}
+		return e;
+	}
+}
+
+const struct evict_ops evict_s3fifo = {
+	"s3fifo", 1, s3fifo_init, s3fifo_insert, s3fifo_hit, s3fifo_remove,
+	s3fifo_victim
+};
+
+/*
+ * W-TinyLFU (Einziger et al., ACM ToS '17): new entries land in a
+ * small LRU window (1% of the budget). When the window overflows its
+ * oldest entry has to win against the main cache's next victim on
+ * estimated access frequency to get in; otherwise it is dropped. The
+ * main cache is a segmented LRU, 80% protected. Frequencies come from
+ * a count-min sketch that is halved every so often, so it favours
+ * what is popular now.
+ */
+#define SKETCH_ROWS	4
+#define SKETCH_MAX	15
+
+struct wtinylfu {
+	size_t budget, wcap, pcap;
+	struct elist window, probation, protected;
+	uint8_t *sketch;	/* SKETCH_ROWS rows of sketchmask + 1 */
+	size_t sketchmask;
+	size_t samples;
+};
+
+static void *wtinylfu_init(size_t budget)
+{
+	struct wtinylfu *p;
+	size_t width = 1024;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		err(1, "calloc");
+	p->budget = budget;
+	p->wcap = budget / 100;
+	p->pcap = (budget - p->wcap) / 10 * 8;
+	/* about one counter per 4k of budget */
+	while (width < budget / 4096 && width < (1 << 22))
+		width <<= 1;
+	p->sketchmask = width - 1;
+	if ((p->sketch = calloc(SKETCH_ROWS, width)) == NULL)
+		err(1, "calloc");
+	return p;
+}
+
+static size_t sketch_index(struct wtinylfu *p, uint64_t h, int row)
+{
+	/* double hashing on the two halves of h */
+	uint64_t h2 = (h >> 32) | 1;
+
+	return row * (p->sketchmask + 1) + ((h + row * h2) & p->sketchmask);
+}
+
+static int sketch_estimate(struct wtinylfu *p, struct cache_entry *e)
+{
+	uint64_t h = entry_hash(e);
+	int row, min = SKETCH_MAX;
+
+	for (row = 0; row < SKETCH_ROWS; ++row)
+		if (p->sketch[sketch_index(p, h, row)] < min)
+			min = p->sketch[sketch_index(p, h, row)];
+	return min;
+}
+
+/* conservative update: only bump the counters at the minimum */
+static void sketch_record(struct wtinylfu *p, struct cache_entry *e)
+{
+	uint64_t h = entry_hash(e);
+	int row, min = sketch_estimate(p, e);
+
+	if (min < SKETCH_MAX)
+		for (row = 0; row < SKETCH_ROWS; ++row)
+			if (p->sketch[sketch_index(p, h, row)] == min)
+				++p->sketch[sketch_index(p, h, row)];
+	if (++p->samples >= (p->sketchmask + 1) * 10) {
+		for (size_t i = 0; i < SKETCH_ROWS * (p->sketchmask + 1); ++i)
+			p->sketch[i] >>= 1;
+		p->samples /= 2;
+	}
+}
+
+static void wtinylfu_insert(void *arg, struct cache_entry *e)
+{
+	struct wtinylfu *p = arg;
+
+	sketch_record(p, e);
+	elist_push(&p->window, e, Q_WINDOW);
+}
+
+static void wtinylfu_hit(void *arg, struct cache_entry *e)
+{
+	struct wtinylfu *p = arg;
+	struct cache_entry *d;
+
+	sketch_record(p, e);
+	switch (e->queue) {
+	case Q_WINDOW:
+		elist_unlink(&p->window, e);
+		elist_push(&p->window, e, Q_WINDOW);
+		break;
+	case Q_PROBATION:
+		elist_unlink(&p->probation, e);
+		elist_push(&p->protected, e, Q_PROTECTED);
+		while (p->protected.bytes > p->pcap &&
+		    (d = elist_pop(&p->protected)) != NULL)
+			elist_push(&p->probation, d, Q_PROBATION);
+		break;
+	case Q_PROTECTED:
+		elist_unlink(&p->protected, e);
+		elist_push(&p->protected, e, Q_PROTECTED);
+		break;
+	}
+}
+
+static void wtinylfu_remove(void *arg, struct cache_entry *e)
+{
+	struct wtinylfu *p = arg;
+
+	switch (e->queue) {
+	case Q_WINDOW:
+		elist_unlink(&p->window, e);
+		break;
+	case Q_PROBATION:
+		elist_unlink(&p->probation, e);
+		break;
+	case Q_PROTECTED:
+		elist_unlink(&p->protected, e);
+		break;
+	}
+}
+
+static struct cache_entry *wtinylfu_victim(void *arg)
+{
+	struct wtinylfu *p = arg;
+	struct cache_entry *cand, *v;
+
+	/* move the window's overflow into the main cache, if it earns it */
+	while (p->window.bytes > p->wcap &&
+	    (cand = elist_pop(&p->window)) != NULL) {
+		if (p->probation.bytes + p->protected.bytes + cache_charge(cand) <=
+		    p->budget - p->wcap) {
+			elist_push(&p->probation, cand, Q_PROBATION);
+			continue;
+		}
+		if ((v = p->probation.tail) == NULL &&
+		    (v = p->protected.tail) == NULL)
+			return cand;
+		if (sketch_estimate(p, cand) <= sketch_estimate(p, v))
+			return cand;
+		elist_unlink(v->queue == Q_PROBATION ? &p->probation :
+		    &p->protected, v);
+		elist_push(&p->probation, cand, Q_PROBATION);
+		return v;
+	}
+	if ((v = elist_pop(&p->probation)) != NULL ||
+	    (v = elist_pop(&p->protected)) != NULL)
+		return v;
+	return elist_pop(&p->window);
+}
+
+const struct evict_ops evict_wtinylfu = {
+	"wtinylfu", 0, wtinylfu_init, wtinylfu_insert, wtinylfu_hit,
+	wtinylfu_remove, wtinylfu_victim
+};
+
+static const struct evict_ops *policies[] = {
+	&evict_lru,
+	&evict_s3fifo,
+	&evict_wtinylfu,
+};
+
+const struct evict_ops *evict_policy(const char *name)
+{
+	for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i)
+		if (strcmp(policies[i]->name, name) == 0)
+			return policies[i];
+	return NULL;
+}
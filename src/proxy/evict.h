@@ -0,0 +1,35 @@
+#ifndef EVICT_H
+#define EVICT_H
+
+#include <stddef.h>
+
+#include "cache.h"
+
+/*
+ * An eviction policy. The cache calls these with its policy lock held
+ * (except hit, when lockfree_hit is set), charges entries against the
+ * budget itself, and keeps asking for victims while it is over.
+ *
+ * insert	a new entry was added
+ * hit		an entry was looked up; it may already be off our lists
+ * remove	the entry is being dropped, take it off our lists
+ * victim	pick an entry to evict and take it off our lists, or
+ *		return NULL if there is nothing left to evict
+ */
+struct evict_ops {
+	const char *name;
+	int lockfree_hit;
+	void *(*init)(size_t);
+	void (*insert)(void *, struct cache_entry *);
+	void (*hit)(void *, struct cache_entry *);
+	void (*remove)(void *, struct cache_entry *);
+	struct cache_entry *(*victim)(void *);
+};
+
+extern const struct evict_ops evict_lru;
+extern const struct evict_ops evict_s3fifo;
+extern const struct evict_ops evict_wtinylfu;
+
+const struct evict_ops *evict_policy(const char *);
+
+#endif /* EVICT_H */
@@ -0,0 +1,467 @@
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "negcache.h"
+#include "peer.h"
+#include "proto.h"
+#include "proxy.h"
+#include "store.h"
+#include "trace.h"
+
+#define INFLIGHTSIZE	1024	/* buckets of the fetches under way */
+
+/* revalidations, and misses that found a fetch to read from, for the report */
+static unsigned long long ncurrent, nchanged, nstarted, njoined;
+
+/*
+ * every fetch from its start until the upstream is done with it, by
+ * digest, for all workers. It is only looked at on a miss.
+ */
+static pthread_mutex_t inflightlock = PTHREAD_MUTEX_INITIALIZER;
+static struct fetch *inflight[INFLIGHTSIZE];
+
+static struct fetch **inflight_bucket(const uint64_t fhash[2])
+{
+	return &inflight[fhash[0] % INFLIGHTSIZE];
+}
+
+static void inflight_unlink(struct fetch *f)
+{
+	struct fetch **fp;
+
+	pthread_mutex_lock(&inflightlock);
+	for (fp = inflight_bucket(f->fhash); *fp != f; fp = &(*fp)->inext)
+		;
+	*fp = f->inext;
+	pthread_mutex_unlock(&inflightlock);
+}
+
+/*
+ * Wake ev, which belongs to r, from the worker self. Another worker's
+ * objects are only ever touched by that worker.
+ */
+static void fetch_poke(struct reactor *self, struct reactor *r,
+    struct evsrc *ev)
+{
+	if (r == self)
+		reactor_defer(r, ev);
+	else
+		reactor_post(r, ev);
+}
+
+/*
+ * rq reads from a fetch that is already under way for the same file,
+ * if there is one it can still read all of: one that is buffering into
+ * a cache entry, has not heard from the server yet, or passes through
+ * a ring that still has the first byte in it. A fetch whose ring has
+ * moved on, or has no readers left to keep it going, or that failed,
+ * is no use.
+ */
+static struct fetch *fetch_join(struct fetch *f, struct request *rq)
+{
+	for (; f != NULL; f = f->inext) {
+		if (memcmp(f->hash, rq->hash, HASHSIZE) != 0)
+			continue;
+		pthread_mutex_lock(&f->lock);
+		if (f->state != F_FAILED && (f->ring == NULL ||
+		    (f->readers != NULL && f->got <= CHUNKSIZE))) {
+			/* a ring waits for us from the start */
+			if (f->ring != NULL)
+				f->consumed = 0;
+			++f->refs;
+			rq->fnext = f->readers;
+			f->readers = rq;
+			pthread_mutex_unlock(&f->lock);
+			return f;
+		}
+		pthread_mutex_unlock(&f->lock);
+	}
+	return NULL;
+}
+
+/*
+ * A fetch has one reference for each request reading it and one for
+ * the upstream connection; whichever is done last frees it. A miss for
+ * a file that is on its way already only adds a reader. If a peer's
+ * digest says it has the file, the fetch goes there first. If the
+ * request has a cached copy that is due to be checked, the fetch asks
+ * the server whether it is still current instead, and peers stay out
+ * of it.
+ */
+struct fetch *fetch_start(struct reactor *r, struct request *rq)
+{
+	struct fetch **bucket = inflight_bucket(rq->fhash), *f;
+
+	pthread_mutex_lock(&inflightlock);
+	if ((f = fetch_join(*bucket, rq)) != NULL) {
+		pthread_mutex_unlock(&inflightlock);
+		DEBUG("Proxy %i: File %s is on its way already\n", r->port,
+		    rq->name);
+		__atomic_add_fetch(&njoined, 1, __ATOMIC_RELAXED);
+		return f;
+	}
+	if ((f = calloc(1, sizeof(*f))) == NULL ||
+	    (f->name = strdup(rq->name)) == NULL) {
+		pthread_mutex_unlock(&inflightlock);
+		warn("calloc");
+		free(f);
+		return NULL;
+	}
+	pthread_mutex_init(&f->lock, NULL);
+	f->refs = 2;
+	f->r = r;
+	f->started = stats_now();
+	f->tconn = rq->c->serial;
+	f->treq = rq->id;
+	f->state = F_WAITING;
+	memcpy(f->hash, rq->hash, HASHSIZE);
+	f->fhash[0] = rq->fhash[0];
+	f->fhash[1] = rq->fhash[1];
+	f->namelen = rq->namelen;
+	f->chunk = rq->chunk;
+	f->readers = rq;
+	if ((f->stale = rq->entry) != NULL)
+		cache_ref(f->stale);
+	f->inext = *bucket;
+	*bucket = f;
+	pthread_mutex_unlock(&inflightlock);
+	__atomic_add_fetch(&nstarted, 1, __ATOMIC_RELAXED);
+
+	/* peers only know whole files */
+	f->peer = r->peers != NULL && f->stale == NULL && f->chunk < 0 ?
+	    peers_find(r->peers, f->name, f->namelen, f->fhash) : -1;
+	if ((f->up = upstream_start(r, f)) == NULL && f->peer >= 0) {
+		f->peer = -1;
+		f->up = upstream_start(r, f);
+	}
+	/* the readers that found it in the meantime hear of it too */
+	if (f->up == NULL)
+		fetch_end(f, 0);
+	return f;
+}
+
+void fetch_release(struct fetch *f)
+{
+	int refs;
+
+	pthread_mutex_lock(&f->lock);
+	refs = --f->refs;
+	pthread_mutex_unlock(&f->lock);
+	if (refs > 0)
+		return;
+	cache_release(f->entry);
+	cache_release(f->stale);
+	pthread_mutex_destroy(&f->lock);
+	free(f->ring);
+	free(f->name);
+	free(f);
+}
+
+/* the readers have something new; called with the lock held */
+static void fetch_wake(struct fetch *f)
+{
+	struct request *rq;
+
+	for (rq = f->readers; rq != NULL; rq = rq->fnext)
+		fetch_poke(f->r, rq->c->r, &rq->c->ev);
+}
+
+/*
+ * The ring is free up to what the slowest reader has sent; if that
+ * moved, the upstream can go on. With no readers left it stops for
+ * good, and finds out from fetch_space. Called with the lock held, on
+ * rq's worker. The upstream only changes while there is no ring and
+ * nothing is paused, so here it is the one reading the body.
+ */
+static void fetch_advance(struct fetch *f, struct request *rq)
+{
+	struct request *r;
+	uint64_t min = f->got;
+
+	if (f->ring == NULL || f->up == NULL)
+		return;
+	for (r = f->readers; r != NULL; r = r->fnext)
+		if (r->consumed < min)
+			min = r->consumed;
+	if (f->readers != NULL && min == f->consumed)
+		return;
+	f->consumed = min;
+	if (f->paused || f->readers == NULL) {
+		f->paused = 0;
+		fetch_poke(rq->c->r, f->r, &f->up->ev);
+	}
+}
+
+/*
+ * The client of rq went away, or does not need the fetch any more. If
+ * we are filling a cache entry the fetch carries on without it; if the
+ * bytes were only passing through and nobody else reads them there is
+ * no point in reading the rest.
+ */
+void fetch_detach(struct fetch *f, struct request *rq)
+{
+	struct request **rp;
+
+	pthread_mutex_lock(&f->lock);
+	for (rp = &f->readers; *rp != NULL && *rp != rq; rp = &(*rp)->fnext)
+		;
+	/* not there if the ring let it go */
+	if (*rp != NULL)
+		*rp = rq->fnext;
+	rq->fnext = NULL;
+	fetch_advance(f, rq);
+	pthread_mutex_unlock(&f->lock);
+	fetch_release(f);
+}
+
+/*
+ * how far the fetch has got. Once it is past F_WAITING, status, size,
+ * tag and ring are settled and can be read without the lock.
+ */
+enum fetch_state fetch_check(struct fetch *f)
+{
+	enum fetch_state state;
+
+	pthread_mutex_lock(&f->lock);
+	state = f->state;
+	pthread_mutex_unlock(&f->lock);
+	return state;
+}
+
+/*
+ * rq is about to go out of the ring, and from now on the ring waits for
+ * it. -1 if the ring went on without it.
+ */
+int fetch_hold(struct fetch *f, struct request *rq)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&f->lock);
+	if (rq->lapped)
+		ret = -1;
+	else
+		rq->onwire = 1;
+	pthread_mutex_unlock(&f->lock);
+	return ret;
+}
+
+/* client side: the next contiguous bytes from offset off on */
+const char *fetch_avail(struct fetch *f, uint64_t off, size_t *len)
+{
+	const char *p = NULL;
+	size_t pos;
+
+	pthread_mutex_lock(&f->lock);
+	*len = 0;
+	if (f->entry != NULL) {
+		/* a range may start further in than we are */
+		*len = f->got > off ? f->got - off : 0;
+		p = f->entry->body + off;
+	} else if (f->ring != NULL) {
+		pos = off % CHUNKSIZE;
+		*len = f->got - off;
+		if (*len > CHUNKSIZE - pos)
+			*len = CHUNKSIZE - pos;
+		p = f->ring + pos;
+	}
+	pthread_mutex_unlock(&f->lock);
+	return p;
+}
+
+/* rq is done with everything before off; wake a stalled upstream */
+void fetch_consumed(struct fetch *f, struct request *rq, uint64_t off)
+{
+	pthread_mutex_lock(&f->lock);
+	rq->consumed = off;
+	fetch_advance(f, rq);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* fetch_begin, with the lock held */
+static int fetch_answer(struct fetch *f, int status, uint64_t size,
+    uint64_t tag, int encoding)
+{
+	struct reactor *r = f->r;
+
+	f->status = status;
+	f->tag = tag;
+	f->encoding = encoding;
+	if (f->stale != NULL) {
+		if (status == PROTO_NOTMODIFIED) {
+			__atomic_store_n(&f->stale->checked, time(NULL),
+			    __ATOMIC_RELAXED);
+			__atomic_add_fetch(&ncurrent, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		/* a new version or none at all: ours has to go */
+		if (status == PROTO_OK || status == PROTO_NOTFOUND) {
+			DEBUG("Proxy %i: File %s changed on the server\n",
+			    r->port, f->name);
+			cache_remove(r->cache, f->hash);
+			__atomic_add_fetch(&nchanged, 1, __ATOMIC_RELAXED);
+		}
+	}
+	/*
+	 * only the server says this; a peer that lacks it sends us there.
+	 * A piece has a digest of its own, not the name's.
+	 */
+	if (status == PROTO_NOTFOUND && r->negcache != NULL && f->chunk < 0)
+		negcache_add(r->negcache, f->fhash);
+	if (status != PROTO_OK)
+		return 0;
+	f->size = size;
+	/* a piece is small, and its reader may want it from anywhere on */
+	if (cache_fits(r->cache, size) || f->chunk >= 0) {
+		/* straight into the store if there is one and it has room */
+		if (f->r->store != NULL && cache_fits(r->cache, size))
+			f->entry = store_entry_new(f->r->store, f->hash, f->fhash,
+			    size);
+		if (f->entry == NULL &&
+		    (f->entry = cache_entry_new(f->hash, f->fhash, size)) == NULL)
+			return -1;
+		f->entry->tag = tag;
+		f->entry->encoding = encoding;
+		f->entry->checked = time(NULL);
+	} else if (f->readers == NULL)
+		return -1;
+	else if ((f->ring = malloc(CHUNKSIZE)) == NULL) {
+		warn("malloc");
+		return -1;
+	}
+	f->state = F_STREAMING;
+	fetch_wake(f);
+	return 0;
+}
+
+/*
+ * upstream side: the server answered, and if the status is PROTO_OK
+ * the body of size bytes follows, in encoding; tag is the version it
+ * has. Returns -1 if the fetch should be abandoned.
+ */
+int fetch_begin(struct fetch *f, int status, uint64_t size, uint64_t tag,
+    int encoding)
+{
+	int ret;
+
+	pthread_mutex_lock(&f->lock);
+	ret = fetch_answer(f, status, size, tag, encoding);
+	pthread_mutex_unlock(&f->lock);
+	return ret;
+}
+
+/*
+ * The ring is full. A reader that is not on the wire yet is queued
+ * behind another response on its connection, and would hold the ring
+ * for as long as that takes; two such could wait on each other for
+ * ever. The ring goes on without them, and they ask again when their
+ * turn comes. Called with the lock held, on the upstream's worker.
+ */
+static void fetch_lap(struct fetch *f)
+{
+	struct request **rp, *rq;
+	uint64_t min = f->got;
+
+	for (rp = &f->readers; (rq = *rp) != NULL;) {
+		if (rq->onwire) {
+			if (rq->consumed < min)
+				min = rq->consumed;
+			rp = &rq->fnext;
+			continue;
+		}
+		*rp = rq->fnext;
+		rq->fnext = NULL;
+		rq->lapped = 1;
+		fetch_poke(f->r, rq->c->r, &rq->c->ev);
+	}
+	f->consumed = min;
+}
+
+/*
+ * where the next bytes from the server go, and how many fit; none if
+ * the clients have to catch up first. NULL if nobody wants them.
+ */
+char *fetch_space(struct fetch *f, size_t *len)
+{
+	size_t used, pos;
+	char *p;
+
+	if (f->entry != NULL) {
+		*len = f->size - f->got;
+		return f->entry->body + f->got;
+	}
+	pthread_mutex_lock(&f->lock);
+	if (f->readers != NULL && f->got - f->consumed == CHUNKSIZE)
+		fetch_lap(f);
+	if (f->readers == NULL)
+		p = NULL;
+	else if ((used = f->got - f->consumed) == CHUNKSIZE) {
+		f->paused = 1;
+		*len = 0;
+		p = f->ring;
+	} else {
+		pos = f->got % CHUNKSIZE;
+		*len = CHUNKSIZE - (used > pos ? used : pos);
+		if (*len > f->size - f->got)
+			*len = f->size - f->got;
+		p = f->ring + pos;
+	}
+	pthread_mutex_unlock(&f->lock);
+	return p;
+}
+
+void fetch_received(struct fetch *f, size_t n)
+{
+	pthread_mutex_lock(&f->lock);
+	f->got += n;
+	fetch_wake(f);
+	pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * The upstream connection is finished with the fetch. A complete file
+ * we were buffering goes into the cache, and only then does the fetch
+ * stop taking readers, so a miss in between still finds one or the
+ * other.
+ */
+void fetch_end(struct fetch *f, int ok)
+{
+	struct reactor *r = f->r;
+
+	pthread_mutex_lock(&f->lock);
+	f->up = NULL;
+	f->state = ok && f->got == f->size ? F_DONE : F_FAILED;
+	fetch_wake(f);
+	pthread_mutex_unlock(&f->lock);
+	if (f->state == F_DONE) {
+		stats_add(&r->stats.fetches, 1);
+		stats_time(&r->stats.fetch, f->started);
+	}
+	if (f->state == F_DONE && f->status == PROTO_OK && f->entry != NULL) {
+		if (f->chunk >= 0)
+			DEBUG("Proxy %i: Piece %lld of %s exists, adding to filter\n",
+			    r->port, (long long)f->chunk, f->name);
+		else
+			DEBUG("Proxy %i: File %s exists, adding to filter\n",
+			    r->port, f->name);
+		cache_add(r->cache, f->entry);
+	}
+	inflight_unlink(f);
+	fetch_release(f);
+}
+
+void fetch_report(u_short port)
+{
+	printf("Proxy %u: revalidated: %llu current, %llu changed\n", port,
+	    __atomic_load_n(&ncurrent, __ATOMIC_RELAXED),
+	    __atomic_load_n(&nchanged, __ATOMIC_RELAXED));
+	printf("Proxy %u: fetches: %llu started, %llu misses joined one under way\n",
+	    port, __atomic_load_n(&nstarted, __ATOMIC_RELAXED),
+	    __atomic_load_n(&njoined, __ATOMIC_RELAXED));
+}
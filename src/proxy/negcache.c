@@ -0,0 +1,149 @@
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bloom.h"
+#include "negcache.h"
+
+/*
+ * The names live in sets of NEG_WAYS slots, picked by the name's hash;
+ * a name can only be in its own set, so a lookup looks at four slots
+ * at most and nothing ever has to be moved around. Sets share a
+ * smaller number of locks.
+ */
+#define NEG_WAYS	4
+#define NEG_LOCKS	64
+
+struct neg_slot {
+	uint64_t fhash[2];
+	time_t expires;		/* 0 if the slot is empty */
+};
+
+struct negcache {
+	struct neg_slot *slots;
+	size_t nsets;
+	int ttl;
+	struct bloom *filter;
+	pthread_mutex_t locks[NEG_LOCKS];
+	size_t count;
+	unsigned long long hits, expired, evicted;
+};
+
+/* room for about n names, each believed for ttl seconds */
+struct negcache *negcache_new(size_t n, int ttl)
+{
+	struct negcache *nc;
+	int i;
+
+	if ((nc = calloc(1, sizeof(*nc))) == NULL)
+		err(1, "calloc");
+	nc->nsets = (n + NEG_WAYS - 1) / NEG_WAYS;
+	if ((nc->slots = calloc(nc->nsets * NEG_WAYS, sizeof(*nc->slots))) == NULL)
+		err(1, "negative cache allocation failed");
+	nc->ttl = ttl;
+	nc->filter = bloom_new(nc->nsets * NEG_WAYS, 0.01);
+	for (i = 0; i < NEG_LOCKS; ++i)
+		if (pthread_mutex_init(&nc->locks[i], NULL) != 0)
+			errx(1, "negative cache lock initialization failed");
+	return nc;
+}
+
+static size_t neg_set(struct negcache *nc, const uint64_t fhash[2])
+{
+	return fhash[0] % nc->nsets;
+}
+
+/* the slot gives up its name, which leaves the filter with it */
+static void neg_clear(struct negcache *nc, struct neg_slot *s)
+{
+	bloom_remove(nc->filter, s->fhash);
+	s->expires = 0;
+	__atomic_sub_fetch(&nc->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * whether the server said not long ago that it does not have the file.
+ * Most names are not here, and the filter says so without a lock.
+ */
+int negcache_check(struct negcache *nc, const uint64_t fhash[2])
+{
+	size_t set = neg_set(nc, fhash);
+	pthread_mutex_t *lock = &nc->locks[set % NEG_LOCKS];
+	struct neg_slot *s = &nc->slots[set * NEG_WAYS];
+	time_t now;
+	int i, found = 0;
+
+	if (!bloom_check(nc->filter, fhash))
+		return 0;
+	now = time(NULL);
+	pthread_mutex_lock(lock);
+	for (i = 0; i < NEG_WAYS; ++i, ++s) {
+		if (s->expires == 0 || s->fhash[0] != fhash[0] ||
+		    s->fhash[1] != fhash[1])
+			continue;
+		if (now < s->expires) {
+			found = 1;
+			__atomic_add_fetch(&nc->hits, 1, __ATOMIC_RELAXED);
+		} else {
+			neg_clear(nc, s);
+			__atomic_add_fetch(&nc->expired, 1, __ATOMIC_RELAXED);
+		}
+		break;
+	}
+	pthread_mutex_unlock(lock);
+	if (i == NEG_WAYS)
+		bloom_false_positive(nc->filter);
+	return found;
+}
+
+/*
+ * The server does not have the file. A name we had already only gets
+ * a new TTL; otherwise it takes an empty slot in its set, or the one
+ * that would have expired first.
+ */
+void negcache_add(struct negcache *nc, const uint64_t fhash[2])
+{
+	size_t set = neg_set(nc, fhash);
+	pthread_mutex_t *lock = &nc->locks[set % NEG_LOCKS];
+	struct neg_slot *s = &nc->slots[set * NEG_WAYS], *victim = s;
+	time_t expires = time(NULL) + nc->ttl;
+	int i;
+
+	pthread_mutex_lock(lock);
+	for (i = 0; i < NEG_WAYS; ++i, ++s) {
+		if (s->expires != 0 && s->fhash[0] == fhash[0] &&
+		    s->fhash[1] == fhash[1]) {
+			s->expires = expires;
+			pthread_mutex_unlock(lock);
+			return;
+		}
+		if (s->expires < victim->expires)
+			victim = s;
+	}
+	if (victim->expires != 0) {
+		neg_clear(nc, victim);
+		__atomic_add_fetch(&nc->evicted, 1, __ATOMIC_RELAXED);
+	}
+	victim->fhash[0] = fhash[0];
+	victim->fhash[1] = fhash[1];
+	victim->expires = expires;
+	bloom_add(nc->filter, fhash);
+	__atomic_add_fetch(&nc->count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(lock);
+}
+
+void negcache_report(struct negcache *nc, u_short port)
+{
+	printf("Proxy %u: negative cache: %zu of %zu names, %llu answered here, "
+	    "%llu expired, %llu pushed out\n", port,
+	    __atomic_load_n(&nc->count, __ATOMIC_RELAXED), nc->nsets * NEG_WAYS,
+	    __atomic_load_n(&nc->hits, __ATOMIC_RELAXED),
+	    __atomic_load_n(&nc->expired, __ATOMIC_RELAXED),
+	    __atomic_load_n(&nc->evicted, __ATOMIC_RELAXED));
+	fflush(stdout);
+}
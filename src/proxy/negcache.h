@@ -0,0 +1,26 @@
+#ifndef NEGCACHE_H
+#define NEGCACHE_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Names the server said it does not have, so that asking for one again
+ * is answered here instead of costing a trip to the server. It is kept
+ * apart from the file cache, with its own Bloom filter, so that the
+ * misses for nonexistent names never touch the cache's budget or its
+ * filter. Each name is only believed for a TTL, since the file may
+ * turn up on the server later, and there is a fixed number of them:
+ * a new name pushes out the one closest to expiring in its set. Safe
+ * to use from any number of threads.
+ */
+struct negcache;
+
+struct negcache *negcache_new(size_t, int);
+int	negcache_check(struct negcache *, const uint64_t[2]);
+void	negcache_add(struct negcache *, const uint64_t[2]);
+void	negcache_report(struct negcache *, u_short);
+
+#endif /* NEGCACHE_H */
@@ -0,0 +1,295 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tls.h>
+
+#include "addr.h"
+#include "bloom.h"
+#include "hrw.h"
+#include "peer.h"
+#include "proto.h"
+
+/* a digest this many rounds old is no longer believed */
+#define STALE_ROUNDS	3
+
+/* no filter we would make comes near this; a bigger digest is garbage */
+#define MAXDIGEST	(256 << 20)
+
+struct peer {
+	char *name;
+	struct sockaddr_in sa;
+	int failing;		/* the last pull failed, and we said so */
+
+	/* the digest connection, only touched by the peers thread */
+	struct tls *tls;
+	int sd;
+	uint32_t id;
+
+	/* under the lock */
+	unsigned char *digest;
+	size_t digestlen;
+	time_t fetched;
+};
+
+struct peers {
+	struct peer *peers;
+	int npeers;
+	struct hrw *ring;		/* the peers, to rank them by name */
+	struct tls_config *cfg;
+	int interval;			/* seconds between pulls */
+	pthread_rwlock_t lock;
+	pthread_t thread;
+	unsigned long long npulls, nfailed;
+};
+
+/*
+ * Everyone in the membership file but us. We are the one on our own
+ * port at a loopback address.
+ */
+struct peers *peers_new(struct hrw *members, u_short self, const uint8_t *ca,
+    size_t calen, int interval)
+{
+	struct peers *p;
+	struct peer *pe;
+	struct sockaddr_in sa;
+	size_t i;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL ||
+	    (p->peers = calloc(hrw_count(members), sizeof(*p->peers))) == NULL)
+		err(1, "calloc");
+	p->ring = hrw_new();
+	p->interval = interval;
+	for (i = 0; i < hrw_count(members); ++i) {
+		if (addr_parse(hrw_name(members, i), &sa) == -1)
+			errx(1, "%s - not a proxy address", hrw_name(members, i));
+		if (sa.sin_port == htons(self) &&
+		    (ntohl(sa.sin_addr.s_addr) >> 24) == IN_LOOPBACKNET)
+			continue;
+		pe = &p->peers[p->npeers++];
+		if ((pe->name = strdup(hrw_name(members, i))) == NULL)
+			err(1, "strdup");
+		pe->sa = sa;
+		pe->sd = -1;
+		/* the same weights as the client uses to pick proxies */
+		if (hrw_add(p->ring, pe->name, hrw_weight(members, i)) == -1)
+			errx(1, "%s - duplicate peer", pe->name);
+	}
+	if ((errno = pthread_rwlock_init(&p->lock, NULL)) != 0)
+		err(1, "pthread_rwlock_init");
+
+	if ((p->cfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	if (tls_config_set_ca_mem(p->cfg, ca, calen) == -1)
+		errx(1, "unable to set root CA");
+	return p;
+}
+
+int peers_count(struct peers *p)
+{
+	return p->npeers;
+}
+
+const char *peers_name(struct peers *p, int i)
+{
+	return p->peers[i].name;
+}
+
+const struct sockaddr_in *peers_addr(struct peers *p, int i)
+{
+	return &p->peers[i].sa;
+}
+
+/*
+ * The peer that most likely has the file, or -1 if none of them seems
+ * to. Peers are asked in rendezvous order for the name, so the one
+ * that owns it under the current membership is asked first.
+ */
+int peers_find(struct peers *p, const char *name, size_t len,
+    const uint64_t fhash[2])
+{
+	size_t order[p->npeers > 0 ? p->npeers : 1], n, j;
+	struct peer *pe;
+	time_t now;
+	int found = -1;
+
+	if (p->npeers == 0)
+		return -1;
+	n = hrw_rank(p->ring, name, len, order, p->npeers);
+	now = time(NULL);
+	pthread_rwlock_rdlock(&p->lock);
+	for (j = 0; j < n; ++j) {
+		pe = &p->peers[order[j]];
+		if (pe->digest != NULL &&
+		    now - pe->fetched <= STALE_ROUNDS * p->interval &&
+		    bloom_digest_check(pe->digest, pe->digestlen, fhash)) {
+			found = order[j];
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&p->lock);
+	return found;
+}
+
+static void peer_disconnect(struct peer *pe)
+{
+	tls_free(pe->tls);
+	pe->tls = NULL;
+	if (pe->sd != -1)
+		close(pe->sd);
+	pe->sd = -1;
+}
+
+/*
+ * The socket is blocking, with timeouts, so libtls only ever wants to
+ * be called again when a timeout ran out: we take that as a failure.
+ */
+static int peer_io(struct peer *pe, void *buf, size_t len, int writing)
+{
+	ssize_t n;
+	size_t done = 0;
+
+	while (done < len) {
+		if (writing)
+			n = tls_write(pe->tls, (char *)buf + done, len - done);
+		else
+			n = tls_read(pe->tls, (char *)buf + done, len - done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int peer_connect(struct peers *p, struct peer *pe)
+{
+	struct timeval tv = { p->interval, 0 };
+
+	if ((pe->sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (setsockopt(pe->sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(pe->sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1 ||
+	    connect(pe->sd, (struct sockaddr *)&pe->sa, sizeof(pe->sa)) == -1 ||
+	    (pe->tls = tls_client()) == NULL ||
+	    tls_configure(pe->tls, p->cfg) == -1 ||
+	    tls_connect_socket(pe->tls, pe->sd, "localhost") == -1 ||
+	    tls_handshake(pe->tls) != 0) {
+		peer_disconnect(pe);
+		return -1;
+	}
+	return 0;
+}
+
+/* ask pe for its digest, and put it in place of the one we had */
+static int peer_pull(struct peers *p, struct peer *pe)
+{
+	unsigned char req[PROTO_REQLEN], hdr[PROTO_RESPLEN], *digest, *old;
+	struct proto_req rq = { .version = PROTO_VERSION,
+	    .type = PROTO_DIGEST, .id = ++pe->id };
+	struct proto_resp rs;
+
+	if (pe->tls == NULL && peer_connect(p, pe) == -1)
+		return -1;
+	proto_put_req(req, &rq);
+	if (peer_io(pe, req, sizeof(req), 1) == -1 ||
+	    peer_io(pe, hdr, sizeof(hdr), 0) == -1)
+		goto fail;
+	proto_get_resp(hdr, &rs);
+	if (rs.version != PROTO_VERSION || rs.id != rq.id ||
+	    rs.status != PROTO_OK || rs.size < BLOOM_DIGEST_HDR ||
+	    rs.size > MAXDIGEST)
+		goto fail;
+	if ((digest = malloc(rs.size)) == NULL)
+		goto fail;
+	if (peer_io(pe, digest, rs.size, 0) == -1) {
+		free(digest);
+		goto fail;
+	}
+
+	pthread_rwlock_wrlock(&p->lock);
+	old = pe->digest;
+	pe->digest = digest;
+	pe->digestlen = rs.size;
+	pe->fetched = time(NULL);
+	pthread_rwlock_unlock(&p->lock);
+	free(old);
+	return 0;
+fail:
+	peer_disconnect(pe);
+	return -1;
+}
+
+static void *peers_run(void *arg)
+{
+	struct peers *p = arg;
+	struct peer *pe;
+	int i;
+
+	for (;;) {
+		for (i = 0; i < p->npeers; ++i) {
+			pe = &p->peers[i];
+			if (peer_pull(p, pe) == 0) {
+				pe->failing = 0;
+				__atomic_add_fetch(&p->npulls, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			__atomic_add_fetch(&p->nfailed, 1, __ATOMIC_RELAXED);
+			if (!pe->failing)
+				warnx("no cache digest from peer %s", pe->name);
+			pe->failing = 1;
+		}
+		sleep(p->interval);
+	}
+	return NULL;
+}
+
+/*
+ * start pulling digests. The thread leaves the report signals to the
+ * workers, whose epoll_wait they are meant to interrupt.
+ */
+void peers_start(struct peers *p)
+{
+	sigset_t set, oset;
+
+	if (p->npeers == 0)
+		return;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	if ((errno = pthread_create(&p->thread, NULL, peers_run, p)) != 0)
+		err(1, "pthread_create failed");
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+void peers_report(struct peers *p, u_short port)
+{
+	time_t now = time(NULL);
+	int i, current = 0;
+
+	if (p->npeers == 0)
+		return;
+	pthread_rwlock_rdlock(&p->lock);
+	for (i = 0; i < p->npeers; ++i)
+		if (p->peers[i].digest != NULL &&
+		    now - p->peers[i].fetched <= STALE_ROUNDS * p->interval)
+			++current;
+	pthread_rwlock_unlock(&p->lock);
+	printf("Proxy %u: peers: %d, %d with a current digest; %llu digests "
+	    "fetched, %llu failed\n", port, p->npeers, current,
+	    __atomic_load_n(&p->npulls, __ATOMIC_RELAXED),
+	    __atomic_load_n(&p->nfailed, __ATOMIC_RELAXED));
+	fflush(stdout);
+}
@@ -0,0 +1,30 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The other proxies, and what they have cached. A thread of our own
+ * asks each of them for its Bloom filter digest every so often, over a
+ * connection it keeps open. On a miss a worker asks peers_find whether
+ * some peer probably has the file; if one does, the file is PEEKed
+ * from that peer before we bother the server with it. Digests older
+ * than a few rounds are not trusted, so a peer that went away soon
+ * stops being asked.
+ */
+struct peers;
+struct hrw;
+
+struct peers *peers_new(struct hrw *, u_short, const uint8_t *, size_t, int);
+void	peers_start(struct peers *);
+int	peers_count(struct peers *);
+int	peers_find(struct peers *, const char *, size_t, const uint64_t[2]);
+const char *peers_name(struct peers *, int);
+const struct sockaddr_in *peers_addr(struct peers *, int);
+void	peers_report(struct peers *, u_short);
+
+#endif /* PEER_H */
@@ -1,415 +1,766 @@
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <err.h>
 #include <errno.h>
+#include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <tls.h>
-#include <openssl/sha.h>
+
+#include "bloom.h"
+#include "cache.h"
+#include "evict.h"
+#include "hrw.h"
+#include "negcache.h"
+#include "peer.h"
+#include "proxy.h"
+#include "stats.h"
+#include "store.h"
+#include "ticket.h"
+#include "trace.h"
+
+/*
+ * SIGUSR1 prints the cache statistics, SIGINT and SIGTERM print them
+ * and exit. The handler only sets a flag and pokes the first worker's
+ * eventfd, in case the signal did not interrupt anyone's epoll_wait;
+ * whichever worker notices first does the printing.
+ */
+static volatile sig_atomic_t wantreport, wantquit;
+static int sigwakefd = -1;
+
+/* every worker, for the stats port */
+static struct reactor *reactors;
+static int nreactors;
+
+/* the certificates and keys every worker's TLS setup is made from */
+struct tlsfiles {
+	uint8_t *ca, *cert, *key;
+	size_t calen, certlen, keylen;
+};
 
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s -port portnumber -servername serverportnumber\n", __progname);
+	fprintf(stderr, "usage: %s -port portnumber -servername serverportnumber [-threads n]\n"
+	    "\t[-cache-bytes size[k|m|g]] [-cache-policy lru|s3fifo|wtinylfu]\n"
+	    "\t[-filter-items n] [-filter-fp rate] [-pool-size n] [-pool-idle seconds]\n"
+	    "\t[-session-lifetime seconds] [-peers file] [-peer-interval seconds]\n"
+	    "\t[-peer-timeout ms] [-store dir] [-store-bytes size[k|m|g]]\n"
+	    "\t[-cache-ttl seconds] [-neg-items n] [-neg-ttl seconds] [-raw]\n"
+	    "\t[-stats-port [address:]port] [-trace file] [-handshake-threads n]\n",
+	    __progname);
 	exit(1);
 }
 
-static void kidhandler(int signum) {
-	/* signal handler for SIGCHLD */
-	waitpid(WAIT_ANY, NULL, WNOHANG);
+/*
+ * Ask epoll to tell us about "events" on ev. Nothing ever blocks in
+ * the proxy: when libtls says TLS_WANT_POLLIN or TLS_WANT_POLLOUT we
+ * register for exactly that and go back to the loop.
+ */
+int reactor_want(struct reactor *r, struct evsrc *ev, int want)
+{
+	struct epoll_event ee;
+	uint32_t events = want;
+
+	if (want == TLS_WANT_POLLIN)
+		events = EPOLLIN;
+	else if (want == TLS_WANT_POLLOUT)
+		events = EPOLLOUT;
+	if (ev->registered && ev->events == events)
+		return 0;
+	/* an empty mask still leaves us registered, for EPOLLHUP */
+	memset(&ee, 0, sizeof(ee));
+	ee.events = events;
+	ee.data.ptr = ev;
+	if (epoll_ctl(r->epfd, ev->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+	    ev->fd, &ee) == -1) {
+		warn("epoll_ctl");
+		return -1;
+	}
+	ev->registered = 1;
+	ev->events = events;
+	return 0;
 }
 
+/*
+ * Objects are closed as soon as we are done with them, but only freed
+ * once the current batch of events is handled, since a later event in
+ * the same batch may still point at them.
+ */
+void reactor_kill(struct reactor *r, struct evsrc *ev)
+{
+	if (ev->dead)
+		return;
+	if (ev->fd != -1) {
+		close(ev->fd);
+		ev->fd = -1;
+	}
+	ev->dead = 1;
+	ev->nextdead = r->dead;
+	r->dead = ev;
+}
 
-int main(int argc,  char *argv[])
+/*
+ * Run ev's handler once the current batch of events is done, as if
+ * epoll had woken it up. This is how a fetch gets the client or the
+ * upstream connection moving again without calling into it while it
+ * may be half way through a state change of its own.
+ */
+void reactor_defer(struct reactor *r, struct evsrc *ev)
 {
-	struct sockaddr_in sockname, client;
-	char buffer[80], *ep, *sep;
-	struct sigaction sa;
-	int sd, i;
-	socklen_t clientlen;
-	u_short port, serverport;
-	pid_t pid;
-	u_long p, sp;
-	struct tls_config *tls_cfg = NULL; // TLS config
-	struct tls *tls_ctx = NULL; // TLS context
-	struct tls *tls_cctx = NULL; // client's TLS context
-	const int HASHSIZE = 64; //512 bits
-	char bloomFilter[HASHSIZE];
-	int cacheSize = 1;
-	char **filenames = malloc(cacheSize);
-	char **fileCache = malloc(cacheSize);
+	if (ev->queued || ev->dead)
+		return;
+	ev->queued = 1;
+	ev->nextready = NULL;
+	if (r->readytail != NULL)
+		r->readytail->nextready = ev;
+	else
+		r->ready = ev;
+	r->readytail = ev;
+}
 
-	/*
-	 * first, figure out what port we will listen on - it should
-	 * be our first parameter.
-	 */
+/*
+ * reactor_defer for an object that belongs to another worker, r: it
+ * goes on r's inbox, and the eventfd gets r out of epoll_wait to move
+ * it over to its ready list.
+ */
+void reactor_post(struct reactor *r, struct evsrc *ev)
+{
+	uint64_t one = 1;
+	int first;
+
+	pthread_mutex_lock(&r->inboxlock);
+	if ((first = !ev->posted)) {
+		ev->posted = 1;
+		ev->nextposted = r->inbox;
+		r->inbox = ev;
+	}
+	pthread_mutex_unlock(&r->inboxlock);
+	if (first && write(r->waker.fd, &one, sizeof(one)) == -1 &&
+	    errno != EAGAIN)
+		warn("eventfd write");
+}
+
+static void reactor_inbox(struct reactor *r)
+{
+	struct evsrc *ev;
+	uint64_t n;
+
+	if (read(r->waker.fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+		warn("eventfd read");
+	pthread_mutex_lock(&r->inboxlock);
+	while ((ev = r->inbox) != NULL) {
+		r->inbox = ev->nextposted;
+		ev->posted = 0;
+		reactor_defer(r, ev);
+	}
+	pthread_mutex_unlock(&r->inboxlock);
+}
+
+/*
+ * What every worker has done, and the cache as a whole, for the stats
+ * port. Counters go per worker, a hot one stands out that way, and
+ * the handshake workers are numbered after the I/O ones; the
+ * histograms are for the whole proxy.
+ */
+static void stats_snapshot(FILE *fp, void *arg)
+{
+	static const struct {
+		const char *name;
+		size_t off;
+	} counters[] = {
+		{ "proxy_requests_total", offsetof(struct proxy_stats, requests) },
+		{ "proxy_hits_total", offsetof(struct proxy_stats, hits) },
+		{ "proxy_misses_total", offsetof(struct proxy_stats, misses) },
+		{ "proxy_filter_false_positives_total",
+		    offsetof(struct proxy_stats, falsepos) },
+		{ "proxy_negative_hits_total", offsetof(struct proxy_stats, neghits) },
+		{ "proxy_bytes_in_total", offsetof(struct proxy_stats, bytesin) },
+		{ "proxy_bytes_out_total", offsetof(struct proxy_stats, bytesout) },
+		{ "proxy_handshakes_total", offsetof(struct proxy_stats, handshakes) },
+		{ "proxy_fetches_total", offsetof(struct proxy_stats, fetches) },
+	};
+	struct stats_hist hit, miss, handshake, fetch;
+	size_t i;
+	int t;
+
+	(void)arg;
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+		for (t = 0; t < nreactors; ++t)
+			stats_put(fp, counters[i].name, "thread", t,
+			    stats_get((uint64_t *)((char *)&reactors[t].stats +
+			    counters[i].off)));
+	cache_stats(reactors[0].cache, fp);
+
+	memset(&hit, 0, sizeof(hit));
+	memset(&miss, 0, sizeof(miss));
+	memset(&handshake, 0, sizeof(handshake));
+	memset(&fetch, 0, sizeof(fetch));
+	for (t = 0; t < nreactors; ++t) {
+		stats_merge(&hit, &reactors[t].stats.hit);
+		stats_merge(&miss, &reactors[t].stats.miss);
+		stats_merge(&handshake, &reactors[t].stats.handshake);
+		stats_merge(&fetch, &reactors[t].stats.fetch);
+	}
+	stats_put_hist(fp, "proxy_hit_seconds", &hit);
+	stats_put_hist(fp, "proxy_miss_seconds", &miss);
+	stats_put_hist(fp, "proxy_handshake_seconds", &handshake);
+	stats_put_hist(fp, "proxy_fetch_seconds", &fetch);
+}
+
+static void reactor_dispatch(struct reactor *r, struct evsrc *ev,
+    uint32_t events)
+{
+	if (ev->dead)
+		return;
+	switch (ev->kind) {
+	case EV_LISTEN:
+		client_accept(r);
+		break;
+	case EV_CLIENT:
+		client_event((struct client *)ev, events);
+		break;
+	case EV_UPSTREAM:
+		upstream_event((struct upstream *)ev, events);
+		break;
+	case EV_WAKE:
+		reactor_inbox(r);
+		break;
+	case EV_STATS:
+		stats_serve(ev->fd, stats_snapshot, NULL);
+		break;
+	}
+}
+
+static void reactor_reap(struct reactor *r)
+{
+	struct evsrc *ev, **evp;
+
+	while ((ev = r->dead) != NULL) {
+		r->dead = ev->nextdead;
+		/* another worker may have poked it on its way out */
+		pthread_mutex_lock(&r->inboxlock);
+		if (ev->posted) {
+			for (evp = &r->inbox; *evp != ev; evp = &(*evp)->nextposted)
+				;
+			*evp = ev->nextposted;
+		}
+		pthread_mutex_unlock(&r->inboxlock);
+		if (ev->kind == EV_CLIENT)
+			client_free((struct client *)ev);
+		else if (ev->kind == EV_UPSTREAM)
+			upstream_free((struct upstream *)ev);
+	}
+}
+
+static void sighandler(int signum)
+{
+	uint64_t one = 1;
+	int saved = errno;
+
+	if (signum == SIGUSR1)
+		wantreport = 1;
+	else
+		wantquit = 1;
+	if (sigwakefd != -1)
+		(void)write(sigwakefd, &one, sizeof(one));
+	errno = saved;
+}
+
+/*
+ * parse a port number argument, complaining the same way for every
+ * option that takes one.
+ */
+static u_short getport(const char *arg)
+{
+	char *ep;
+	u_long p;
 
-	if (argc != 5) usage();
-	
 	errno = 0;
-    p = strtoul(argv[2], &ep, 10);
-    sp = strtoul(argv[4], &sep, 10);
-    if (*argv[2] == '\0' || *ep != '\0') {
+	p = strtoul(arg, &ep, 10);
+	if (*arg == '\0' || *ep != '\0') {
 		/* parameter wasn't a number, or was empty */
-		fprintf(stderr, "%s - not a number\n", argv[2]);
+		fprintf(stderr, "%s - not a number\n", arg);
 		usage();
 	}
-	
-	else if (*argv[4] == '\0' || *sep != '\0') {
-		fprintf(stderr, "%s - not a number\n", argv[4]);
-		usage();
-	}
-	
-    if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
+	if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
 		/* It's a number, but it either can't fit in an unsigned
 		 * long, or is too big for an unsigned short
 		 */
-		fprintf(stderr, "%s - value out of range\n", argv[2]);
+		fprintf(stderr, "%s - value out of range\n", arg);
 		usage();
 	}
-	
-	else if ((errno == ERANGE && sp == ULONG_MAX) || (sp > USHRT_MAX)) {
-		/* It's a number, but it either can't fit in an unsigned
-		 * long, or is too big for an unsigned short
-		 */
-		fprintf(stderr, "%s - value out of range\n", argv[4]);
+	return p;
+}
+
+/* a byte count, with an optional k, m or g suffix */
+static size_t getbytes(const char *arg)
+{
+	char *ep;
+	unsigned long long n;
+	int shift = 0;
+
+	errno = 0;
+	n = strtoull(arg, &ep, 10);
+	switch (*ep) {
+	case 'k': case 'K':
+		shift = 10;
+		break;
+	case 'm': case 'M':
+		shift = 20;
+		break;
+	case 'g': case 'G':
+		shift = 30;
+		break;
+	}
+	if (shift != 0)
+		++ep;
+	if (*arg == '\0' || *ep != '\0' || errno == ERANGE || n == 0 ||
+	    n > (SIZE_MAX >> shift)) {
+		fprintf(stderr, "%s - not a valid size\n", arg);
+		usage();
+	}
+	return (size_t)n << shift;
+}
+
+static int getcount(const char *arg, int min, int max)
+{
+	char *ep;
+	long n;
+
+	errno = 0;
+	n = strtol(arg, &ep, 10);
+	if (*arg == '\0' || *ep != '\0' || errno == ERANGE || n < min || n > max) {
+		fprintf(stderr, "%s - must be a number from %d to %d\n", arg, min, max);
 		usage();
 	}
-	/* now safe to do this */
-	port = p;
-	serverport = sp;
+	return n;
+}
 
-	/* set up TLS */
-	if ((tls_cfg = tls_config_new()) == NULL)
+/*
+ * Set up one worker: its own listening socket on the shared port if it
+ * takes new connections (the kernel spreads them over the sockets with
+ * SO_REUSEPORT), its own epoll instance and its own TLS contexts and
+ * configs, since
+ * libtls contexts and configs are not safe to share between threads
+ * (a server config even changes as its ticket keys rotate).
+ */
+static void reactor_init(struct reactor *r, u_short port, u_short serverport,
+    const struct tlsfiles *tf, const struct tickets *tickets,
+    struct cache *cache, struct bloom *filter, struct peers *peers,
+    int listens, int reuseport)
+{
+	struct sockaddr_in sockname;
+	FILE *sessfile;
+	int sd, one = 1;
+
+	memset(r, 0, sizeof(*r));
+	r->port = port;
+	r->cache = cache;
+	r->filter = filter;
+	r->tickets = tickets;
+	r->peers = peers;
+
+	if ((r->tlscfg = tls_config_new()) == NULL)
 		errx(1, "unable to allocate TLS config");
-	if (tls_config_set_ca_file(tls_cfg, "../../certificates/root.pem") == -1)
-		errx(1, "unable to set root CA file");
-	if (tls_config_set_cert_file(tls_cfg, "../../certificates/proxy.crt") == -1) 
-		errx(1, "unable to set TLS certificate file, error: (%s)", tls_config_error(tls_cfg));
-	if (tls_config_set_key_file(tls_cfg, "../../certificates/proxy.key") == -1)
-		errx(1, "unable to set TLS key file");
-	if ((tls_ctx = tls_server()) == NULL)
+	if (tls_config_set_ca_mem(r->tlscfg, tf->ca, tf->calen) == -1)
+		errx(1, "unable to set root CA");
+	if (tls_config_set_cert_mem(r->tlscfg, tf->cert, tf->certlen) == -1)
+		errx(1, "unable to set TLS certificate, error: (%s)",
+		    tls_config_error(r->tlscfg));
+	if (tls_config_set_key_mem(r->tlscfg, tf->key, tf->keylen) == -1)
+		errx(1, "unable to set TLS key");
+	if (tickets_configure(tickets, r->tlscfg, &r->keyrev) == -1)
+		errx(1, "unable to set up TLS session tickets (%s)",
+		    tls_config_error(r->tlscfg));
+	if ((r->tls = tls_server()) == NULL)
 		errx(1, "TLS server creation failed");
-	if (tls_configure(tls_ctx, tls_cfg) == -1)
-		errx(1, "TLS configuration failed (%s)", tls_error(tls_ctx));
+	if (tls_configure(r->tls, r->tlscfg) == -1)
+		errx(1, "TLS configuration failed (%s)", tls_error(r->tls));
+
+	/*
+	 * and for talking to the server as a client. The session from the
+	 * last handshake is kept in a private file, so new connections
+	 * resume it; LibreSSL only resumes TLS 1.2 sessions.
+	 */
+	if ((r->upcfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	if (tls_config_set_ca_mem(r->upcfg, tf->ca, tf->calen) == -1)
+		errx(1, "unable to set root CA");
+	if (tickets->lifetime > 0) {
+		if ((sessfile = tmpfile()) == NULL)
+			err(1, "unable to create TLS session file");
+		if (tls_config_set_session_fd(r->upcfg, fileno(sessfile)) == -1 ||
+		    tls_config_set_protocols(r->upcfg, TLS_PROTOCOL_TLSv1_2) == -1)
+			errx(1, "unable to set up TLS sessions (%s)",
+			    tls_config_error(r->upcfg));
+	}
+	/* peers only get PEEKs over pooled connections; no sessions needed */
+	if (peers != NULL) {
+		if ((r->peercfg = tls_config_new()) == NULL)
+			errx(1, "unable to allocate TLS config");
+		if (tls_config_set_ca_mem(r->peercfg, tf->ca, tf->calen) == -1)
+			errx(1, "unable to set root CA");
+	}
+	r->server_sa.sin_family = AF_INET;
+	r->server_sa.sin_port = htons(serverport);
+	r->server_sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(1, "epoll_create1 failed");
+	r->listener.kind = EV_LISTEN;
+	r->listener.fd = -1;
+	if (listens) {
+		memset(&sockname, 0, sizeof(sockname));
+		sockname.sin_family = AF_INET;
+		sockname.sin_port = htons(port);
+		sockname.sin_addr.s_addr = htonl(INADDR_ANY);
+		sd=socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK,0);
+		if ( sd == -1)
+			err(1, "socket failed");
+		if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+			err(1, "setsockopt SO_REUSEADDR failed");
+		if (reuseport &&
+		    setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+			err(1, "setsockopt SO_REUSEPORT failed");
 
-	/* the message we send the client */
-	//strlcpy(buffer,
-	//    "It was the best of times, it was the worst of times... \n",
-	//    sizeof(buffer));
+		if (bind(sd, (struct sockaddr *) &sockname, sizeof(sockname)) == -1)
+			err(1, "bind failed");
 
-	memset(&sockname, 0, sizeof(sockname));
-	sockname.sin_family = AF_INET;
-	sockname.sin_port = htons(port);
-	sockname.sin_addr.s_addr = htonl(INADDR_ANY);
-	sd=socket(AF_INET,SOCK_STREAM,0);
-	if ( sd == -1)
-		err(1, "socket failed");
+		if (listen(sd,SOMAXCONN) == -1)
+			err(1, "listen failed");
 
-	if (bind(sd, (struct sockaddr *) &sockname, sizeof(sockname)) == -1)
-		err(1, "bind failed");
+		r->listener.fd = sd;
+		if (reactor_want(r, &r->listener, EPOLLIN) == -1)
+			errx(1, "unable to watch listening socket");
+	}
 
-	if (listen(sd,3) == -1)
-		err(1, "listen failed");
+	/* for fetches on other workers to wake our clients */
+	if ((errno = pthread_mutex_init(&r->inboxlock, NULL)) != 0)
+		err(1, "pthread_mutex_init failed");
+	r->waker.kind = EV_WAKE;
+	if ((r->waker.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		err(1, "eventfd failed");
+	if (reactor_want(r, &r->waker, EPOLLIN) == -1)
+		errx(1, "unable to watch eventfd");
+}
 
-	/*
-	 * we're now bound, and listening for connections on "sd" -
-	 * each call to "accept" will return us a descriptor talking to
-	 * a connected client
-	 */
+/*
+ * the main loop of a worker. Every client and every connection we make
+ * to the server is a small state machine; we sleep in epoll_wait until
+ * one of them can make progress.
+ */
+static void *reactor_run(void *arg)
+{
+	struct reactor *r = arg;
+	struct epoll_event events[MAXEVENTS];
+	struct evsrc *ev;
+	int n, i;
+
+	for(;;) {
+		/* wake up for pooled connections to expire and peers to give up on */
+		n = epoll_wait(r->epfd, events, MAXEVENTS, upstream_timeout(r));
+		if (n == -1 && errno != EINTR)
+			err(1, "epoll_wait failed");
+		if (wantreport || wantquit) {
+			wantreport = 0;
+			cache_report(r->cache, r->port);
+			bloom_report(r->filter, r->port);
+			client_report(r->port);
+			upstream_report(r->port);
+			fetch_report(r->port);
+			if (r->store != NULL)
+				store_report(r->store, r->port);
+			if (r->negcache != NULL)
+				negcache_report(r->negcache, r->port);
+			if (r->peers != NULL)
+				peers_report(r->peers, r->port);
+			if (wantquit)
+				exit(0);
+		}
+		if (n == -1)
+			continue;
+		for (i = 0; i < n; ++i)
+			reactor_dispatch(r, events[i].data.ptr, events[i].events);
+		while ((ev = r->ready) != NULL) {
+			if ((r->ready = ev->nextready) == NULL)
+				r->readytail = NULL;
+			ev->queued = 0;
+			reactor_dispatch(r, ev, 0);
+		}
+		if (r->idle != NULL || r->waiting != NULL)
+			upstream_expire(r);
+		reactor_reap(r);
+	}
+	return NULL;
+}
 
+int main(int argc,  char *argv[])
+{
+	static struct option longopts[] = {
+		{ "port",	required_argument,	NULL,	'p' },
+		{ "servername",	required_argument,	NULL,	's' },
+		{ "threads",	required_argument,	NULL,	't' },
+		{ "cache-bytes", required_argument,	NULL,	'b' },
+		{ "cache-policy", required_argument,	NULL,	'e' },
+		{ "filter-items", required_argument,	NULL,	'n' },
+		{ "filter-fp",	required_argument,	NULL,	'f' },
+		{ "pool-size",	required_argument,	NULL,	'P' },
+		{ "pool-idle",	required_argument,	NULL,	'I' },
+		{ "session-lifetime", required_argument, NULL,	'L' },
+		{ "peers",	required_argument,	NULL,	'M' },
+		{ "peer-interval", required_argument,	NULL,	'V' },
+		{ "peer-timeout", required_argument,	NULL,	'T' },
+		{ "store",	required_argument,	NULL,	'D' },
+		{ "store-bytes", required_argument,	NULL,	'S' },
+		{ "cache-ttl",	required_argument,	NULL,	'R' },
+		{ "neg-items",	required_argument,	NULL,	'N' },
+		{ "neg-ttl",	required_argument,	NULL,	'X' },
+		{ "raw",	no_argument,		NULL,	'r' },
+		{ "stats-port",	required_argument,	NULL,	'Q' },
+		{ "trace",	required_argument,	NULL,	'G' },
+		{ "handshake-threads", required_argument, NULL,	'H' },
+		{ NULL,		0,			NULL,	0 }
+	};
+	struct cache *cache;
+	struct bloom *filter;
+	struct sigaction sa;
+	const struct evict_ops *policy = &evict_lru;
+	size_t cachebytes = 256 << 20;
+	int filteritems = 1 << 20;
+	double filterfp = 0.01;
+	int poolsize = 64, poolidle = 30, sessionlifetime = 2 * 60 * 60;
+	int peerinterval = 5, peertimeout = 200, cachettl = -1;
+	int negitems = 1 << 16, negttl = 30;
+	int accept = PROTO_ACCEPT_DEFLATE;
+	struct negcache *negcache = NULL;
+	const char *membership = NULL;
+	struct peers *peers = NULL;
+	struct hrw *members;
+	const char *storedir = NULL, *statsaddr = NULL, *tracefile = NULL;
+	size_t storebytes = 0, nrestored;
+	struct store *store = NULL;
+	struct timespec t0, t1;
+	struct tlsfiles tf;
+	struct tickets tickets;
+	char *ep;
+	int ch, i, nthreads = 1, nhandshakers = 0;
+	u_short port = 0, serverport = 0;
 
 	/*
-	 * first, let's make sure we can have children without leaving
-	 * zombies around when they die - we can do this by catching
-	 * SIGCHLD.
+	 * first, figure out what port we will listen on and which port
+	 * the server is on - both are required.
 	 */
-	sa.sa_handler = kidhandler;
-        sigemptyset(&sa.sa_mask);
+	while ((ch = getopt_long_only(argc, argv, "", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'p':
+			port = getport(optarg);
+			break;
+		case 's':
+			serverport = getport(optarg);
+			break;
+		case 't':
+			nthreads = getcount(optarg, 1, 1024);
+			break;
+		case 'b':
+			cachebytes = getbytes(optarg);
+			break;
+		case 'e':
+			if ((policy = evict_policy(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown cache policy\n", optarg);
+				usage();
+			}
+			break;
+		case 'n':
+			filteritems = getcount(optarg, 1, INT_MAX);
+			break;
+		case 'P':
+			poolsize = getcount(optarg, 0, INT_MAX);
+			break;
+		case 'I':
+			poolidle = getcount(optarg, 1, INT_MAX);
+			break;
+		case 'L':
+			sessionlifetime = getcount(optarg, 0, 24 * 60 * 60);
+			break;
+		case 'M':
+			membership = optarg;
+			break;
+		case 'V':
+			peerinterval = getcount(optarg, 1, 3600);
+			break;
+		case 'T':
+			peertimeout = getcount(optarg, 1, 60 * 1000);
+			break;
+		case 'D':
+			storedir = optarg;
+			break;
+		case 'S':
+			storebytes = getbytes(optarg);
+			break;
+		case 'R':
+			cachettl = getcount(optarg, 0, INT_MAX);
+			break;
+		case 'N':
+			negitems = getcount(optarg, 1, INT_MAX);
+			break;
+		case 'X':
+			negttl = getcount(optarg, 0, INT_MAX);
+			break;
+		case 'r':
+			accept = 0;
+			break;
+		case 'Q':
+			statsaddr = optarg;
+			break;
+		case 'G':
+			tracefile = optarg;
+			break;
+		case 'H':
+			nhandshakers = getcount(optarg, 0, 1024);
+			break;
+		case 'f':
+			errno = 0;
+			filterfp = strtod(optarg, &ep);
+			if (*optarg == '\0' || *ep != '\0' || errno == ERANGE ||
+			    !(filterfp > 0 && filterfp < 1)) {
+				fprintf(stderr, "%s - must be between 0 and 1\n", optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || port == 0 || serverport == 0)
+		usage();
+	if (tracefile != NULL)
+		trace_open(tracefile);
+
 	/*
-	 * we want to allow system calls like accept to be restarted if they
-	 * get interrupted by a SIGCHLD
+	 * set up TLS: read the files once, every worker builds its own
+	 * configs from them
 	 */
-        sa.sa_flags = SA_RESTART;
-        if (sigaction(SIGCHLD, &sa, NULL) == -1)
-                err(1, "sigaction failed");
+	if ((tf.ca = tls_load_file("../../certificates/root.pem", &tf.calen, NULL)) == NULL)
+		errx(1, "unable to set root CA file");
+	if ((tf.cert = tls_load_file("../../certificates/proxy.crt", &tf.certlen, NULL)) == NULL)
+		errx(1, "unable to set TLS certificate file");
+	if ((tf.key = tls_load_file("../../certificates/proxy.key", &tf.keylen, NULL)) == NULL)
+		errx(1, "unable to set TLS key file");
+	tickets_init(&tickets, sessionlifetime);
 
 	/*
-	 * finally - the main loop.  accept connections and deal with 'em
+	 * a client that goes away while we write to it must not take the
+	 * whole proxy down with it
 	 */
-	printf("Proxy up and listening for connections on port %u\n", port);
-	for(;;) {
-		int clientsd;
-		clientlen = sizeof(&client);
-		clientsd = accept(sd, (struct sockaddr *)&client, &clientlen);
-		if (clientsd == -1)
-			err(1, "accept failed");
-		/*
-		 * We fork child to deal with each connection, this way more
-		 * than one client can connect to us and get served at any one
-		 * time.
-		 */
+	signal(SIGPIPE, SIG_IGN);
 
-/*
-		pid = fork();
-		if (pid == -1)
-		     err(1, "fork failed");
-
-		if(pid == 0) {
-		*/
-		ssize_t written, w;
-		i = 0;
-		if (tls_accept_socket(tls_ctx, &tls_cctx, clientsd) == -1)
-			errx(1, "tls accept failed (%s)", tls_error(tls_ctx));
-		else {
-			do {
-				if ((i = tls_handshake(tls_cctx)) == -1)
-					errx(1, "tls handshake failed (%s)", tls_error(tls_ctx));
-			} while(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
-		}
-		
-		
-		ssize_t r, rc;
-		size_t maxread;
-
-		strlcpy(buffer,
-		    "                                                                                ",
-		    sizeof(buffer));
-
-
-		//read filename from client
-		r = -1;
-		rc = 0;
-		maxread = sizeof(buffer) - 1; /* leave room for a 0 byte */
-		while ((r != 0) && rc < maxread) {
-			r = tls_read(tls_cctx, buffer + rc, maxread - rc);
-			if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
-				continue;
-			if (r < 0) {
-				err(1, "tls_read failed (%s)", tls_error(tls_cctx));
-			} else
-				rc += r;
-		}
-		/*
-		 * we must make absolutely sure buffer has a terminating 0 byte
-		 * if we are to use it as a C string
-		 */
-		buffer[rc] = '\0';
-		
-		// connect as client to the server
-		
-		struct sockaddr_in server_sa;
-		struct tls_config *tls_cfg_s = NULL;
-		struct tls *tls_ctx_s = NULL;
-		int serversd, j;
-		char localhost[] = "127.0.0.1";
-		
-		if ((tls_cfg_s = tls_config_new()) == NULL)
-			errx(1, "unable to allocate TLS config");
-		if (tls_config_set_ca_file(tls_cfg_s, "../../certificates/root.pem") == -1)
-			errx(1, "unable to set root CA file");
-		
-		memset(&server_sa, 0, sizeof(server_sa));
-		server_sa.sin_family = AF_INET;
-		server_sa.sin_port = htons(serverport);
-		server_sa.sin_addr.s_addr = inet_addr(localhost);
-		if (server_sa.sin_addr.s_addr == INADDR_NONE) {
-			fprintf(stderr, "Invalid IP address %s\n", localhost);
-			usage();
-		}
+	/*
+	 * no SA_RESTART: we want epoll_wait to come back with EINTR so
+	 * the worker notices
+	 */
+	sa.sa_handler = sighandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1 ||
+	    sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGTERM, &sa, NULL) == -1)
+		err(1, "sigaction failed");
+
+	/* a few shards per thread keeps lock collisions rare */
+	filter = bloom_new(filteritems, filterfp);
+	cache = cache_new(nthreads * 16, cachebytes, policy, filter);
 
-		/* ok now get a socket. */
-		if ((serversd=socket(AF_INET,SOCK_STREAM,0)) == -1)
-			err(1, "socket failed");
+	/*
+	 * what we had cached when we last ran. The store holds a few times
+	 * the cache by default, since what is evicted is only reclaimed
+	 * when the store is compacted at startup.
+	 */
+	if (storedir != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		store = store_open(storedir, storebytes != 0 ? storebytes :
+		    4 * cachebytes);
+		nrestored = store_load(store, cache);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("Proxy %u: %zu files restored from %s in %.3f s\n",
+		    port, nrestored, storedir, (t1.tv_sec - t0.tv_sec) +
+		    (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	}
 
-		/* connect the socket to the server described in "server_sa" */
-		if (connect(serversd, (struct sockaddr *)&server_sa, sizeof(server_sa)) == -1)
-			err(1, "connect failed");
-
-		if ((tls_ctx_s = tls_client()) == NULL)
-			errx(1, "tls client creation failed");
-		if (tls_configure(tls_ctx_s, tls_cfg_s) == -1)
-			errx(1, "tls configuration failed (%s)", tls_error(tls_ctx_s));
-		if (tls_connect_socket(tls_ctx_s, serversd, "localhost") == -1)
-			errx(1, "tls connection failed (%s)", tls_error(tls_ctx_s));
-
-
-		do {
-			if ((j = tls_handshake(tls_ctx_s)) == -1)
-				errx(1, "tls handshake failed (%s)", tls_error(tls_ctx_s));
-		} while(j == TLS_WANT_POLLIN || j == TLS_WANT_POLLOUT);
-
-		//Bloom filter
-		char temp, found = 1;
-		char hash[HASHSIZE], match[HASHSIZE]; 
-		SHA512(buffer, sizeof(buffer), hash);
-
-		for (int a = 0; a < HASHSIZE; ++a)
-		{
-			match[a] = 0;
-			temp = hash[a] & bloomFilter[a];
-			if (temp == hash[a])
-			{
-				match[a] = 1;
-			}
-		}
-		
-		for (int b = 0; b < HASHSIZE; ++b)
-		{
-			if (match[b] <= 0)
-			{
-				found = 0;
-				break;
-			}
-		}
-		int size = 0;
-		if (found <= 0)
-		{
-			printf("Proxy %i: File %s not found in filter\n", port, buffer);
-			
-			READFILE:
-			
-			//send filename to server
-			w = 0;
-			written = 0;
-			while (written < strlen(buffer)) {
-				w = tls_write(tls_ctx_s, buffer + written,
-					strlen(buffer) - written);
-				struct sockaddr_in server_sa;
-				if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
-					continue;
-
-				if (w < 0) {
-					errx(1, "TLS write failed (%s)", tls_error(tls_ctx_s));
-				}
-				else
-					written += w;
-			}
-			i = 0;
-			do {
-				i = tls_close(tls_ctx_s);
-			} while(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
-			
-			//get file size from server
-			size = 0;
-			r = tls_read(tls_ctx_s, &size, sizeof(size));
-			printf("Proxy %i: File size is %i\n", port, size);
-			//printf("Proxy: size = %i\n", size);
-			char fileBuffer[size];
-			
-			if (size > 0)
-			{
-				printf("Proxy %i: File %s exists, adding to filter\n", port, buffer);
-				for (int c = 0; c < HASHSIZE; ++c)
-				{
-					bloomFilter[c] = hash[c] | bloomFilter[c];
-				}
-				
-				//read file from server
-				r = -1;
-				rc = 0;
-				maxread = size;
-				while ((r != 0) && rc < maxread) {
-					r = tls_read(tls_ctx_s, fileBuffer + rc, maxread - rc);
-					if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
-						continue;
-					if (r < 0) {
-						err(1, "tls_read failed (%s)", tls_error(tls_ctx_s));
-					} else
-						rc += r;
-				}
-				
-				//add new entry to file cache
-				filenames = realloc(filenames, cacheSize);
-				fileCache = realloc(fileCache, cacheSize);
-				
-				filenames[cacheSize - 1] = malloc(HASHSIZE);
-				fileCache[cacheSize - 1] = malloc(size);
-				
-				memcpy(filenames[cacheSize - 1], hash, HASHSIZE);
-				memcpy(fileCache[cacheSize - 1], fileBuffer, size);
-				
-				++cacheSize;
-				
-				
-				//send file size to client
-				w = tls_write(tls_cctx, &size, sizeof(size));
-				
-				//send file to client
-				w = 0;
-				written = 0;
-				while (written < strlen(fileBuffer)) {
-					w = tls_write(tls_cctx, fileBuffer + written,
-						strlen(fileBuffer) - written);
-					struct sockaddr_in server_sa;
-					if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
-						continue;
-
-					if (w < 0) {
-						errx(1, "TLS write failed (%s)", tls_error(tls_cctx));
-					}
-					else
-						written += w;
-				}
-			}
-		}
-		else
-		{
-			printf("Proxy %i: File %s found in filter\n", port, buffer);
-			
-			found = 0;
-			
-			for (int e = 0; e < cacheSize; ++e)
-			{
-				if (memcmp(hash, filenames[e], HASHSIZE) == 0)
-				{
-					size = strlen(fileCache[e]);
-					char fileBuffer[size];
-					printf("Proxy %i: File %s found in cache\n", port, buffer);
-					memcpy(fileBuffer, fileCache[e], size);
-					
-					//send file size to client
-					w = tls_write(tls_cctx, &size, sizeof(size));
-					
-					//send file to client
-					w = 0;
-					written = 0;
-					while (written < strlen(fileBuffer)) {
-						w = tls_write(tls_cctx, fileBuffer + written,
-							strlen(fileBuffer) - written);
-						struct sockaddr_in server_sa;
-						if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
-							continue;
-
-						if (w < 0) {
-							errx(1, "TLS write failed (%s)", tls_error(tls_cctx));
-						}
-						else
-							written += w;
-					}
-					
-					found = 1;
-					break;
-				}
-			}
-						
-			if (found <= 0)
-			{
-				printf("Proxy %i: Bloom filter false positive, getting %s from server\n", port, buffer);
-				goto READFILE;
-			}
-		}
+	/* names the server does not have, for a while; -neg-ttl 0 asks every time */
+	if (negttl > 0)
+		negcache = negcache_new(negitems, negttl);
 
-		close(clientsd);
+	/* the same membership file as the clients', we are in it too */
+	if (membership != NULL) {
+		if ((members = hrw_load(membership)) == NULL)
+			exit(1);
+		peers = peers_new(members, port, tf.ca, tf.calen, peerinterval);
+		hrw_free(members);
+	}
 
+	/* the handshake workers, if any, come after the I/O workers */
+	if ((reactors = calloc(nthreads + nhandshakers, sizeof(*reactors))) == NULL)
+		err(1, "calloc");
+	nreactors = nthreads + nhandshakers;
+	for (i = 0; i < nthreads; ++i) {
+		reactor_init(&reactors[i], port, serverport, &tf, &tickets,
+		    cache, filter, peers, nhandshakers == 0, nthreads > 1);
+		/* the pool size is for the whole proxy */
+		reactors[i].poolmax = (poolsize + nthreads - 1) / nthreads;
+		reactors[i].idletimeout = poolidle;
+		reactors[i].peertimeout = peertimeout;
+		reactors[i].store = store;
+		reactors[i].cachettl = cachettl;
+		reactors[i].negcache = negcache;
+		/* files come deflated where that pays, and are cached that way */
+		reactors[i].accept = accept;
+	}
+	for (; i < nreactors; ++i) {
+		reactor_init(&reactors[i], port, serverport, &tf, &tickets,
+		    cache, filter, peers, 1, nhandshakers > 1);
+		reactors[i].io = reactors;
+		reactors[i].nio = nthreads;
+		/* so they do not all start with the same one */
+		reactors[i].nextio = i;
+	}
+	sigwakefd = reactors[0].waker.fd;
+
+	/* plain text, for scrapers; the first worker answers it */
+	if (statsaddr != NULL) {
+		reactors[0].statsport.kind = EV_STATS;
+		reactors[0].statsport.fd = stats_listen(statsaddr);
+		if (reactor_want(&reactors[0], &reactors[0].statsport, EPOLLIN) == -1)
+			errx(1, "unable to watch the stats port");
 	}
+	if (peers != NULL)
+		peers_start(peers);
+
+	if (nhandshakers > 0)
+		printf("Proxy up and listening for connections on port %u "
+		    "(%d thread%s, and %d for handshakes)\n", port, nthreads,
+		    nthreads > 1 ? "s" : "", nhandshakers);
+	else
+		printf("Proxy up and listening for connections on port %u (%d thread%s)\n",
+		    port, nthreads, nthreads > 1 ? "s" : "");
+	for (i = 1; i < nreactors; ++i)
+		if ((errno = pthread_create(&reactors[i].thread, NULL,
+		    reactor_run, &reactors[i])) != 0)
+			err(1, "pthread_create failed");
+	reactor_run(&reactors[0]);
 	return (0);
 }
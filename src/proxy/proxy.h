@@ -0,0 +1,319 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <tls.h>
+
+#include "proto.h"
+#include "stats.h"
+
+#define HASHSIZE	64	/* SHA-512 digest, 512 bits */
+#define MAXEVENTS	64
+#define MAXPIPELINE	64	/* requests in progress on one client connection */
+#define RANGECHUNK	(1024 * 1024)	/* ranges are cached in pieces this big */
+
+/*
+ * Everything registered with epoll starts with an evsrc, so the event
+ * loop can tell from the data pointer what kind of object woke up.
+ */
+enum ev_kind {
+	EV_LISTEN,
+	EV_CLIENT,
+	EV_UPSTREAM,
+	EV_WAKE,
+	EV_STATS,
+};
+
+struct evsrc {
+	enum ev_kind kind;
+	int fd;
+	uint32_t events;	/* what we currently ask epoll for */
+	int registered;
+	int dead;		/* closed, freed at the end of the batch */
+	struct evsrc *nextdead;
+	int queued;		/* on the reactor's ready list */
+	struct evsrc *nextready;
+	int posted;		/* on the reactor's inbox */
+	struct evsrc *nextposted;
+};
+
+struct cache;
+struct bloom;
+struct tickets;
+struct peers;
+struct store;
+struct negcache;
+
+/*
+ * What one worker has done, for the stats port. Only the worker itself
+ * writes to it (see stats.h). Hits and misses are answers with a body,
+ * or that the client's copy is current, by whether it came out of the
+ * cache; their time runs from the request to the last byte sent.
+ */
+struct proxy_stats {
+	uint64_t requests;
+	uint64_t hits, misses;
+	uint64_t falsepos;	/* the filter said yes, the cache no */
+	uint64_t neghits;	/* answered from the negative cache */
+	uint64_t bytesin;	/* bodies from the server and peers */
+	uint64_t bytesout;	/* everything written to clients */
+	uint64_t handshakes;
+	uint64_t fetches;	/* that got the whole answer */
+	struct stats_hist hit, miss, handshake, fetch;
+};
+
+/*
+ * One per worker thread. An I/O worker serves its clients' requests;
+ * with -handshake-threads, the listening sockets and the TLS handshakes
+ * are left to handshake workers instead, which hand every client on to
+ * an I/O worker once its handshake is done, so a burst of new
+ * connections only ever takes those threads' cores.
+ */
+struct reactor {
+	pthread_t thread;
+	int epfd;
+	struct evsrc listener;
+	u_short port;
+	struct tls *tls;		/* server context for our clients */
+	struct tls_config *tlscfg;	/* and its config */
+	const struct tickets *tickets;
+	uint32_t keyrev;		/* the ticket key tlscfg has */
+	struct tls_config *upcfg;	/* client config for the server hop */
+	struct sockaddr_in server_sa;
+	struct cache *cache;		/* shared by all workers */
+	struct bloom *filter;
+	struct store *store;		/* the cache on disk, NULL if none */
+	struct negcache *negcache;	/* files that do not exist, or NULL */
+	struct evsrc *dead;		/* objects waiting to be freed */
+	struct evsrc *ready, *readytail; /* woken up by another object */
+	struct evsrc waker;		/* an eventfd other workers poke */
+	pthread_mutex_t inboxlock;
+	struct evsrc *inbox;		/* woken up from another worker */
+	struct upstream *idle;		/* pooled server and peer connections */
+	int nidle;
+	int poolmax;
+	int idletimeout;		/* seconds */
+	int cachettl;			/* seconds a hit is trusted, -1 for ever */
+	int accept;			/* PROTO_ACCEPT_DEFLATE, or 0 with -raw */
+	struct peers *peers;		/* NULL if we have none */
+	struct tls_config *peercfg;	/* client config for peers */
+	int peertimeout;		/* ms a peer has to answer */
+	struct upstream *waiting;	/* peer requests not answered yet */
+	struct evsrc statsport;		/* on the first worker, if we have one */
+	struct proxy_stats stats;
+	struct reactor *io;		/* a handshake worker's I/O workers, */
+	int nio;			/* NULL on an I/O worker */
+	int nextio;			/* the one the next client goes to */
+};
+
+struct client;
+struct request;
+struct upstream;
+struct cache_entry;
+
+/*
+ * A file on its way from the server. The upstream connection writes
+ * into it and the requests stream out of it as the bytes arrive, so
+ * the first byte does not wait for the last. If the file fits in the
+ * cache the whole body is buffered, in a cache entry that goes into
+ * the cache once it is complete; otherwise it passes through a ring
+ * of CHUNKSIZE bytes and the server is only read as fast as the
+ * slowest client sending it takes the data.
+ *
+ * A fetch for one piece of a range asks the server for that RANGE, and
+ * the answer, the size of the file and the piece, is always buffered
+ * and cached like a file of its own, under a digest of its own.
+ *
+ * While it is under way a fetch is listed by digest, and a miss for
+ * the same file on any worker reads from it instead of asking the
+ * server again. The upstream side runs on the worker that started it,
+ * the readers on their own; the lock covers everything they share.
+ */
+enum fetch_state {
+	F_WAITING,	/* for the server's answer */
+	F_STREAMING,
+	F_DONE,
+	F_FAILED,
+};
+
+struct fetch {
+	pthread_mutex_t lock;
+	int refs;
+	struct reactor *r;
+	enum fetch_state state;
+	unsigned char hash[HASHSIZE];
+	uint64_t fhash[2];
+	char *name;
+	size_t namelen;
+	int64_t chunk;		/* the piece of the file we get, -1 for all */
+	int peer;		/* the peer we ask first, or -1 for the server */
+	int status;		/* the server's answer, PROTO_OK or not */
+	uint64_t size;
+	uint64_t tag;
+	int encoding;		/* of the body, as it came */
+	struct cache_entry *stale;	/* the copy we ask the server about */
+	uint64_t got;		/* bytes received so far */
+	uint64_t consumed;	/* bytes the client has sent on */
+	struct cache_entry *entry;	/* the whole body, if we cache it */
+	char *ring;			/* CHUNKSIZE bytes if we do not */
+	struct request *readers;	/* NULL if the clients went away */
+	struct upstream *up;	/* NULL once the server is done */
+	int paused;		/* the upstream waits for ring space */
+	struct fetch *inext;	/* in the list of fetches under way */
+	uint64_t started;	/* stats_now() */
+	uint64_t tconn;		/* the request that started it, */
+	uint32_t treq;		/* for the trace */
+};
+
+/*
+ * One request from a client. Its answer comes from the cache on a hit,
+ * from a fetch on a miss, or is an error status straight away. A
+ * deflated body goes out as it is if the client takes that, and is
+ * inflated on the way otherwise. A range is sent from the whole file
+ * if that is cached, and otherwise from its pieces one after the
+ * other, entry or f holding the one we are on.
+ */
+struct inflater;
+
+struct request {
+	struct request *next;
+	struct client *c;
+	uint32_t id;
+	uint64_t tag;		/* the version the client has, or 0 */
+	int accept;		/* PROTO_ACCEPT_DEFLATE if it takes that */
+	int encoding;		/* of the body we send */
+	struct inflater *z;	/* NULL unless we inflate it */
+	char *name;
+	size_t namelen;
+	unsigned char hash[HASHSIZE];
+	uint64_t fhash[2];
+	struct fetch *f;
+	struct request *fnext;	/* the next request reading f */
+	int onwire;		/* going out of f's ring, which waits for it */
+	int lapped;		/* f's ring went on without it */
+	struct cache_entry *entry;
+	int range;		/* a RANGE request */
+	uint64_t off, len;	/* the bytes it wants */
+	uint64_t total;		/* the size of the file they come from */
+	uint64_t version;	/* and its tag */
+	int64_t chunk;		/* the piece we are on, -1 for the whole file */
+	int chunkok;		/* it is of that version */
+	int status;		/* -1 until we know the answer */
+	uint64_t size;
+	uint64_t sent;		/* body bytes written so far */
+	uint64_t consumed;	/* of those, what f knows about */
+	unsigned char hdr[PROTO_RESPLEN + PROTO_RANGEHDRLEN];
+	size_t hdrlen, hdroff;
+	int cached;		/* the answer came out of the cache */
+	uint64_t started;	/* stats_now() */
+};
+
+/*
+ * A client connection. After the TLS handshake it reads requests and
+ * writes responses at the same time: any number of requests (up to
+ * MAXPIPELINE) can be in progress, and whichever has its answer ready
+ * first is sent first.
+ */
+enum client_state {
+	CL_HANDSHAKE,
+	CL_OPEN,
+	CL_CLOSE,
+};
+
+struct client {
+	struct evsrc ev;
+	struct reactor *r;
+	struct tls *tls;
+	enum client_state state;
+
+	/* the request being read */
+	unsigned char rhdr[PROTO_REQLEN];
+	size_t rhdroff;
+	struct proto_req rframe;
+	struct request *rreq;	/* has its header, reading the name */
+	size_t rnameoff;
+	int eof;		/* the client sent all it is going to */
+	int badversion;		/* answer that, then close */
+
+	struct request *reqs, *reqtail;	/* in the order they came */
+	int nreqs;
+	struct request *cur;	/* the one we are sending */
+	uint64_t started;	/* stats_now(), for the handshake */
+	uint64_t serial;	/* trace_conn() */
+};
+
+/*
+ * A connection to the server, or to a peer. It carries one request at
+ * a time; once it has the answer it goes into the worker's pool, idle,
+ * and the next miss for the same place sends its request over it
+ * without a new connection or handshake. A peer is only PEEKed at,
+ * and has until the deadline to answer before we go to the server.
+ */
+enum upstream_state {
+	UP_CONNECT,
+	UP_HANDSHAKE,
+	UP_SEND_REQUEST,
+	UP_READ_RESPONSE,
+	UP_READ_BODY,
+	UP_IDLE,
+};
+
+struct upstream {
+	struct evsrc ev;
+	struct reactor *r;
+	struct tls *tls;
+	enum upstream_state state;
+	struct fetch *f;
+	uint32_t id;		/* of the request in progress */
+	size_t off;
+	unsigned char *req;	/* the request frame, name and all */
+	size_t reqlen;
+	unsigned char hdr[PROTO_RESPLEN];
+	int reused;		/* came from the pool */
+	int dest;		/* peer index, -1 for the server */
+	time_t idlesince;
+	struct upstream *idlenext, *idleprev;
+	uint64_t deadline;	/* ms, monotonic; 0 when not waiting */
+	struct upstream *waitnext, *waitprev;
+};
+
+/* proxy.c */
+int	reactor_want(struct reactor *, struct evsrc *, int);
+void	reactor_kill(struct reactor *, struct evsrc *);
+void	reactor_defer(struct reactor *, struct evsrc *);
+void	reactor_post(struct reactor *, struct evsrc *);
+
+/* conn.c */
+void	client_accept(struct reactor *);
+void	client_event(struct client *, uint32_t);
+void	client_free(struct client *);
+void	client_report(u_short);
+
+/* fetch.c */
+struct fetch *fetch_start(struct reactor *, struct request *);
+void	fetch_release(struct fetch *);
+void	fetch_detach(struct fetch *, struct request *);
+enum fetch_state fetch_check(struct fetch *);
+int	fetch_hold(struct fetch *, struct request *);
+const char *fetch_avail(struct fetch *, uint64_t, size_t *);
+void	fetch_consumed(struct fetch *, struct request *, uint64_t);
+int	fetch_begin(struct fetch *, int, uint64_t, uint64_t, int);
+char	*fetch_space(struct fetch *, size_t *);
+void	fetch_received(struct fetch *, size_t);
+void	fetch_end(struct fetch *, int);
+void	fetch_report(u_short);
+
+/* upstream.c */
+struct upstream *upstream_start(struct reactor *, struct fetch *);
+void	upstream_event(struct upstream *, uint32_t);
+void	upstream_expire(struct reactor *);
+int	upstream_timeout(struct reactor *);
+void	upstream_free(struct upstream *);
+void	upstream_report(u_short);
+
+#endif /* PROXY_H */
@@ -0,0 +1,586 @@
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "store.h"
+
+#define STORE_MAGIC	"TLSCSTO3"
+#define STORE_ALIGN	64	/* bodies start on a cache line */
+#define STORE_SEED	0x73746f7265ULL
+#define NOHOLE		UINT64_MAX
+
+enum { REC_ADD = 1, REC_DEL };
+
+/*
+ * An index record. They are written as they are in memory: the files
+ * never leave the machine that wrote them.
+ */
+struct store_rec {
+	uint64_t kind;
+	unsigned char hash[HASHSIZE];
+	uint64_t fhash[2];
+	uint64_t off, size;
+	uint64_t tag;		/* the server's, for revalidation */
+	uint64_t encoding;	/* of the body, PROTO_RAW or PROTO_DEFLATE */
+	uint64_t sum;		/* of the body */
+	uint64_t check;		/* of everything above */
+};
+
+/* the index starts with this; the segment is the file segment.<gen> */
+struct store_hdr {
+	char magic[8];
+	uint64_t gen;
+};
+
+/* room in the segment that no body uses any more */
+struct store_hole {
+	uint64_t off, len;
+};
+
+struct store {
+	char *dir;
+	uint64_t gen;
+	int indexfd;
+	char *map;
+	size_t maplen;
+	pthread_mutex_t lock;	/* for end and for writes to the index */
+	uint64_t end;		/* where the next body goes */
+	struct store_hole *holes;	/* before end, by offset */
+	size_t nholes, holecap;
+	uint64_t holebytes;
+	struct store_rec *live;	/* read from the index, until loaded */
+	size_t nlive;
+	unsigned long long nwritten, nforgotten, nfull, nrestored;
+};
+
+static uint64_t rec_check(const struct store_rec *rec)
+{
+	return hash64(rec, offsetof(struct store_rec, check), STORE_SEED);
+}
+
+static uint64_t align(uint64_t n)
+{
+	return (n + STORE_ALIGN - 1) & ~(uint64_t)(STORE_ALIGN - 1);
+}
+
+static void store_path(const struct store *s, char *buf, const char *name,
+    uint64_t gen)
+{
+	if (gen != 0)
+		snprintf(buf, PATH_MAX, "%s/%s.%llu", s->dir, name,
+		    (unsigned long long)gen);
+	else
+		snprintf(buf, PATH_MAX, "%s/%s", s->dir, name);
+}
+
+/*
+ * Give len bytes at off back, with the lock held. Holes next to each
+ * other become one, and one that reaches end moves end back instead.
+ * If the list cannot grow the room is lost until the next start.
+ */
+static void hole_add(struct store *s, uint64_t off, uint64_t len)
+{
+	struct store_hole *h;
+	size_t lo = 0, hi = s->nholes, mid, i;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->holes[mid].off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && s->holes[lo - 1].off + s->holes[lo - 1].len == off) {
+		i = lo - 1;
+		s->holes[i].len += len;
+		if (lo < s->nholes &&
+		    s->holes[i].off + s->holes[i].len == s->holes[lo].off) {
+			s->holes[i].len += s->holes[lo].len;
+			memmove(&s->holes[lo], &s->holes[lo + 1],
+			    (s->nholes - lo - 1) * sizeof(*s->holes));
+			--s->nholes;
+		}
+	} else if (lo < s->nholes && off + len == s->holes[lo].off) {
+		i = lo;
+		s->holes[i].off = off;
+		s->holes[i].len += len;
+	} else {
+		if (s->nholes == s->holecap) {
+			if ((h = reallocarray(s->holes, s->holecap > 0 ?
+			    s->holecap * 2 : 64, sizeof(*h))) == NULL) {
+				warn("reallocarray");
+				return;
+			}
+			s->holes = h;
+			s->holecap = s->holecap > 0 ? s->holecap * 2 : 64;
+		}
+		i = lo;
+		memmove(&s->holes[i + 1], &s->holes[i],
+		    (s->nholes - i) * sizeof(*s->holes));
+		s->holes[i].off = off;
+		s->holes[i].len = len;
+		++s->nholes;
+	}
+	s->holebytes += len;
+	/* the last one, if it reaches end */
+	if (s->holes[i].off + s->holes[i].len == s->end) {
+		s->end = s->holes[i].off;
+		s->holebytes -= s->holes[i].len;
+		--s->nholes;
+	}
+}
+
+/* the first hole len bytes fit in, with the lock held; NOHOLE if none */
+static uint64_t hole_take(struct store *s, uint64_t len)
+{
+	uint64_t off;
+	size_t i;
+
+	for (i = 0; i < s->nholes && s->holes[i].len < len; ++i)
+		;
+	if (i == s->nholes)
+		return NOHOLE;
+	off = s->holes[i].off;
+	s->holes[i].off += len;
+	if ((s->holes[i].len -= len) == 0) {
+		memmove(&s->holes[i], &s->holes[i + 1],
+		    (s->nholes - i - 1) * sizeof(*s->holes));
+		--s->nholes;
+	}
+	s->holebytes -= len;
+	return off;
+}
+
+/* the records of the index, up to the first one that is damaged */
+static struct store_rec *read_index(struct store *s, size_t *nrecs)
+{
+	struct store_hdr hdr;
+	struct store_rec *recs;
+	char path[PATH_MAX];
+	struct stat st;
+	size_t n, i;
+	int fd;
+
+	*nrecs = 0;
+	s->gen = 1;
+	store_path(s, path, "index", 0);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			err(1, "%s", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", path);
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, STORE_MAGIC, sizeof(hdr.magic)) != 0) {
+		warnx("%s is not a cache index, starting empty", path);
+		close(fd);
+		return NULL;
+	}
+	s->gen = hdr.gen;
+	n = (st.st_size - sizeof(hdr)) / sizeof(*recs);
+	if ((recs = calloc(n > 0 ? n : 1, sizeof(*recs))) == NULL)
+		err(1, "calloc");
+	if (read(fd, recs, n * sizeof(*recs)) != (ssize_t)(n * sizeof(*recs)))
+		err(1, "%s", path);
+	close(fd);
+	for (i = 0; i < n; ++i)
+		if (recs[i].check != rec_check(&recs[i]) ||
+		    (recs[i].kind != REC_ADD && recs[i].kind != REC_DEL))
+			break;
+	if (i < n)
+		warnx("%s is damaged after %zu records, ignoring the rest", path, i);
+	*nrecs = i;
+	return recs;
+}
+
+static const struct store_rec *sortrecs;
+
+/* by digest, then in the order they were written */
+static int rec_cmp(const void *a, const void *b)
+{
+	size_t i = *(const size_t *)a, j = *(const size_t *)b;
+	int c;
+
+	if ((c = memcmp(sortrecs[i].hash, sortrecs[j].hash, HASHSIZE)) != 0)
+		return c;
+	return i < j ? -1 : i > j;
+}
+
+/*
+ * Play the records back: the last one for a digest says whether it is
+ * there, and where. What is left is kept in the order it was written,
+ * so loading it goes from the oldest entry to the newest.
+ */
+static void replay(struct store *s, struct store_rec *recs, size_t n,
+    uint64_t seglen)
+{
+	size_t *order, i, nbad = 0;
+	char *keep;
+
+	if ((order = calloc(n > 0 ? n : 1, sizeof(*order))) == NULL ||
+	    (keep = calloc(n > 0 ? n : 1, 1)) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; ++i)
+		order[i] = i;
+	sortrecs = recs;
+	qsort(order, n, sizeof(*order), rec_cmp);
+	for (i = 0; i < n; ++i) {
+		if (i + 1 < n && memcmp(recs[order[i]].hash,
+		    recs[order[i + 1]].hash, HASHSIZE) == 0)
+			continue;
+		if (recs[order[i]].kind != REC_ADD)
+			continue;
+		if (recs[order[i]].off > seglen ||
+		    recs[order[i]].size > seglen - recs[order[i]].off) {
+			++nbad;
+			continue;
+		}
+		keep[order[i]] = 1;
+	}
+	if (nbad > 0)
+		warnx("%s: %zu files are past the end of the segment", s->dir, nbad);
+
+	s->nlive = 0;
+	s->end = 0;
+	for (i = 0; i < n; ++i) {
+		if (!keep[i])
+			continue;
+		recs[s->nlive++] = recs[i];
+		if (align(recs[i].off + recs[i].size) > s->end)
+			s->end = align(recs[i].off + recs[i].size);
+	}
+	s->live = recs;
+	free(keep);
+	free(order);
+}
+
+static char *map_segment(const char *path, int flags, size_t len, int prot)
+{
+	char *map;
+	int fd;
+
+	if ((fd = open(path, flags, 0600)) == -1)
+		err(1, "%s", path);
+	if ((prot & PROT_WRITE) && ftruncate(fd, len) == -1)
+		err(1, "%s", path);
+	if ((map = mmap(NULL, len > 0 ? len : 1, prot, MAP_SHARED | MAP_NORESERVE,
+	    fd, 0)) == MAP_FAILED)
+		err(1, "mmap %s", path);
+	close(fd);
+	return map;
+}
+
+/*
+ * Copy the live bodies to the front of a new segment, checking them on
+ * the way, and drop the old one.
+ */
+static void compact(struct store *s, uint64_t seglen)
+{
+	char oldpath[PATH_MAX], path[PATH_MAX];
+	struct store_rec *rec;
+	char *old;
+	size_t i, n = 0;
+
+	store_path(s, oldpath, "segment", s->gen);
+	store_path(s, path, "segment", s->gen + 1);
+	old = map_segment(oldpath, O_RDONLY, seglen, PROT_READ);
+	s->map = map_segment(path, O_RDWR | O_CREAT | O_TRUNC, s->maplen,
+	    PROT_READ | PROT_WRITE);
+	s->end = 0;
+	for (i = 0; i < s->nlive; ++i) {
+		rec = &s->live[i];
+		if (hash64(old + rec->off, rec->size, STORE_SEED) != rec->sum)
+			continue;
+		memcpy(s->map + s->end, old + rec->off, rec->size);
+		rec->off = s->end;
+		rec->check = rec_check(rec);
+		s->end += align(rec->size > 0 ? rec->size : 1);
+		s->live[n++] = *rec;
+	}
+	if (n < s->nlive)
+		warnx("%s: %zu files failed their checksum", s->dir, s->nlive - n);
+	s->nlive = n;
+	munmap(old, seglen > 0 ? seglen : 1);
+	++s->gen;
+}
+
+static int hole_cmp(const void *a, const void *b)
+{
+	const struct store_hole *x = a, *y = b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/*
+ * The room between the bodies still in the segment, left by the files
+ * that went while we last ran.
+ */
+static void find_holes(struct store *s)
+{
+	struct store_hole *used;
+	uint64_t at = 0;
+	size_t i;
+
+	if ((used = calloc(s->nlive > 0 ? s->nlive : 1, sizeof(*used))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < s->nlive; ++i) {
+		used[i].off = s->live[i].off;
+		used[i].len = align(s->live[i].size > 0 ? s->live[i].size : 1);
+	}
+	qsort(used, s->nlive, sizeof(*used), hole_cmp);
+	for (i = 0; i < s->nlive; ++i) {
+		if (used[i].off > at)
+			hole_add(s, at, used[i].off - at);
+		if (used[i].off + used[i].len > at)
+			at = used[i].off + used[i].len;
+	}
+	if (at > s->end)
+		s->end = at;
+	free(used);
+}
+
+/* a fresh index with just the live records, put in place of the old */
+static void write_index(struct store *s)
+{
+	char tmp[PATH_MAX], path[PATH_MAX];
+	struct store_hdr hdr;
+	size_t len;
+
+	memcpy(hdr.magic, STORE_MAGIC, sizeof(hdr.magic));
+	hdr.gen = s->gen;
+	store_path(s, tmp, "index.new", 0);
+	store_path(s, path, "index", 0);
+	len = s->nlive * sizeof(*s->live);
+	if ((s->indexfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+	    0600)) == -1)
+		err(1, "%s", tmp);
+	if (write(s->indexfd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    (len > 0 && write(s->indexfd, s->live, len) != (ssize_t)len))
+		err(1, "%s", tmp);
+	if (rename(tmp, path) == -1)
+		err(1, "rename %s", tmp);
+}
+
+/*
+ * Open the store in dir, creating it if need be, with room for size
+ * bytes of bodies. Only one proxy can have a store open at a time.
+ */
+struct store *store_open(const char *dir, size_t size)
+{
+	char path[PATH_MAX];
+	struct store_rec *recs;
+	struct store *s;
+	struct stat st;
+	uint64_t seglen = 0, livebytes = 0, oldgen;
+	size_t n, i;
+	int fd;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL || (s->dir = strdup(dir)) == NULL)
+		err(1, "calloc");
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		err(1, "%s", dir);
+	store_path(s, path, "lock", 0);
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+		err(1, "%s", path);
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK)
+			errx(1, "%s is in use by another proxy", dir);
+		err(1, "%s", path);
+	}
+	/* fd stays open, and locked, for as long as we run */
+
+	recs = read_index(s, &n);
+	store_path(s, path, "segment", s->gen);
+	if (stat(path, &st) == 0)
+		seglen = st.st_size;
+	else if (errno != ENOENT)
+		err(1, "%s", path);
+	replay(s, recs, n, seglen);
+	for (i = 0; i < s->nlive; ++i)
+		livebytes += s->live[i].size;
+
+	/* the segment only grows; a mostly dead one is compacted */
+	s->maplen = size > seglen ? size : seglen;
+	oldgen = s->gen;
+	if (s->end > s->maplen / 2 && livebytes < s->end / 2)
+		compact(s, seglen);
+	else {
+		s->map = map_segment(path, O_RDWR | O_CREAT, s->maplen,
+		    PROT_READ | PROT_WRITE);
+		find_holes(s);
+	}
+	write_index(s);
+	if (s->gen != oldgen) {
+		store_path(s, path, "segment", oldgen);
+		unlink(path);
+	}
+	if (pthread_mutex_init(&s->lock, NULL) != 0)
+		errx(1, "store lock initialization failed");
+	return s;
+}
+
+/*
+ * Put what the index had back into the cache, oldest first, so if it
+ * is more than the cache holds now the newest stay. One the cache will
+ * not take is forgotten, and its room becomes a hole. Returns how many
+ * files went in.
+ */
+size_t store_load(struct store *s, struct cache *c)
+{
+	struct cache_entry *e;
+	size_t i, n = 0;
+
+	for (i = 0; i < s->nlive; ++i) {
+		if ((e = calloc(1, sizeof(*e))) == NULL)
+			err(1, "calloc");
+		memcpy(e->hash, s->live[i].hash, HASHSIZE);
+		e->fhash[0] = s->live[i].fhash[0];
+		e->fhash[1] = s->live[i].fhash[1];
+		e->size = s->live[i].size;
+		e->tag = s->live[i].tag;
+		e->encoding = s->live[i].encoding;
+		e->body = s->map + s->live[i].off;
+		e->store = s;
+		e->persisted = 1;
+		e->refs = 1;
+		if (cache_add(c, e))
+			++n;
+		else
+			store_forget(e);
+		cache_release(e);
+	}
+	free(s->live);
+	s->live = NULL;
+	s->nrestored = n;
+	return n;
+}
+
+/*
+ * A new entry with its body in the segment, in the first hole it fits
+ * or else after the rest, or NULL if the segment is full; the caller
+ * can still cache the file in memory then.
+ */
+struct cache_entry *store_entry_new(struct store *s, const unsigned char *hash,
+    const uint64_t fhash[2], uint64_t size)
+{
+	struct cache_entry *e;
+	uint64_t len = align(size > 0 ? size : 1), off;
+
+	pthread_mutex_lock(&s->lock);
+	if ((off = hole_take(s, len)) == NOHOLE) {
+		if (len > s->maplen - s->end) {
+			++s->nfull;
+			pthread_mutex_unlock(&s->lock);
+			return NULL;
+		}
+		off = s->end;
+		s->end += len;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if ((e = calloc(1, sizeof(*e))) == NULL) {
+		warn("cache allocation failed");
+		return NULL;
+	}
+	memcpy(e->hash, hash, HASHSIZE);
+	e->fhash[0] = fhash[0];
+	e->fhash[1] = fhash[1];
+	e->size = size;
+	e->body = s->map + off;
+	e->store = s;
+	e->refs = 1;
+	return e;
+}
+
+static void store_write(struct store *s, struct store_rec *rec)
+{
+	rec->check = rec_check(rec);
+	pthread_mutex_lock(&s->lock);
+	if (write(s->indexfd, rec, sizeof(*rec)) != sizeof(*rec))
+		warn("%s/index", s->dir);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* the entry's body is complete and it is going into the cache */
+void store_commit(struct cache_entry *e)
+{
+	struct store *s = e->store;
+	struct store_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = REC_ADD;
+	memcpy(rec.hash, e->hash, HASHSIZE);
+	rec.fhash[0] = e->fhash[0];
+	rec.fhash[1] = e->fhash[1];
+	rec.off = e->body - s->map;
+	rec.size = e->size;
+	rec.tag = e->tag;
+	rec.encoding = e->encoding;
+	rec.sum = hash64(e->body, e->size, STORE_SEED);
+	store_write(s, &rec);
+	e->persisted = 1;
+	__atomic_add_fetch(&s->nwritten, 1, __ATOMIC_RELAXED);
+}
+
+/* the entry has left the cache; a restart should not bring it back */
+void store_forget(struct cache_entry *e)
+{
+	struct store_rec rec;
+
+	if (e->store == NULL || !e->persisted)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = REC_DEL;
+	memcpy(rec.hash, e->hash, HASHSIZE);
+	store_write(e->store, &rec);
+	e->persisted = 0;
+	__atomic_add_fetch(&e->store->nforgotten, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Nobody has the entry any more, so its body's room can go to another;
+ * not while the index still says the body is there, though, as a
+ * restart would bring back whatever was written over it.
+ */
+void store_free(struct cache_entry *e)
+{
+	struct store *s = e->store;
+
+	if (e->persisted)
+		return;
+	pthread_mutex_lock(&s->lock);
+	hole_add(s, e->body - s->map, align(e->size > 0 ? e->size : 1));
+	pthread_mutex_unlock(&s->lock);
+}
+
+void store_report(struct store *s, u_short port)
+{
+	uint64_t used;
+
+	pthread_mutex_lock(&s->lock);
+	used = s->end - s->holebytes;
+	pthread_mutex_unlock(&s->lock);
+	printf("Proxy %u: store: %llu files restored, %llu written, %llu "
+	    "dropped, %llu left in memory for lack of room; %llu of %zu "
+	    "segment bytes used\n", port, s->nrestored,
+	    __atomic_load_n(&s->nwritten, __ATOMIC_RELAXED),
+	    __atomic_load_n(&s->nforgotten, __ATOMIC_RELAXED),
+	    __atomic_load_n(&s->nfull, __ATOMIC_RELAXED),
+	    (unsigned long long)used, s->maplen);
+	fflush(stdout);
+}
@@ -0,0 +1,40 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The cache on disk, so that a restarted proxy does not start cold.
+ * File bodies live in a segment file that is mapped into memory: a
+ * fetch writes the body straight into the mapping, and hits are sent
+ * from there. An index file next to it gets a record once an entry is
+ * in the cache (its digests, where its body is and a checksum of it)
+ * and another once the entry leaves. When the last reference to an
+ * entry that left goes, its room is a hole a new body can have.
+ *
+ * On startup only the index is read. Entries go back into the cache and
+ * the filter with their bodies in the mapping, so no page of a body is
+ * read until a hit touches it. If most of the segment is dead, the live
+ * bodies are copied into a new one first, and that is the only time
+ * their checksums are checked; otherwise the room between them is
+ * where the holes are. How current the files still are nobody
+ * knows, so with a -cache-ttl each is checked with the server the first
+ * time it is asked for.
+ */
+struct store;
+struct cache;
+struct cache_entry;
+
+struct store *store_open(const char *, size_t);
+size_t	store_load(struct store *, struct cache *);
+struct cache_entry *store_entry_new(struct store *, const unsigned char *,
+    const uint64_t[2], uint64_t);
+void	store_commit(struct cache_entry *);
+void	store_forget(struct cache_entry *);
+void	store_free(struct cache_entry *);
+void	store_report(struct store *, u_short);
+
+#endif /* STORE_H */
@@ -0,0 +1,536 @@
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tls.h>
+
+#include "cache.h"
+#include "peer.h"
+#include "proto.h"
+#include "proxy.h"
+#include "trace.h"
+
+static void upstream_run(struct upstream *);
+
+/* for the report, across all workers */
+static unsigned long long nconnects, nreused, nretries, nresumed;
+static unsigned long long npeerhits, npeermisses, npeerfails, npeertimeouts;
+
+static uint64_t now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* a peer request starts its clock */
+static void wait_link(struct upstream *u)
+{
+	struct reactor *r = u->r;
+
+	u->deadline = now_ms() + r->peertimeout;
+	u->waitprev = NULL;
+	if ((u->waitnext = r->waiting) != NULL)
+		r->waiting->waitprev = u;
+	r->waiting = u;
+}
+
+/* and stops it, once the peer has answered or we gave up on it */
+static void wait_unlink(struct upstream *u)
+{
+	struct reactor *r = u->r;
+
+	if (u->deadline == 0)
+		return;
+	if (u->waitprev != NULL)
+		u->waitprev->waitnext = u->waitnext;
+	else
+		r->waiting = u->waitnext;
+	if (u->waitnext != NULL)
+		u->waitnext->waitprev = u->waitprev;
+	u->waitnext = u->waitprev = NULL;
+	u->deadline = 0;
+}
+
+void upstream_free(struct upstream *u)
+{
+	tls_free(u->tls);
+	free(u->req);
+	free(u);
+}
+
+static void idle_unlink(struct upstream *u)
+{
+	struct reactor *r = u->r;
+
+	if (u->idleprev != NULL)
+		u->idleprev->idlenext = u->idlenext;
+	else
+		r->idle = u->idlenext;
+	if (u->idlenext != NULL)
+		u->idlenext->idleprev = u->idleprev;
+	u->idlenext = u->idleprev = NULL;
+	--r->nidle;
+}
+
+static void upstream_close(struct upstream *u)
+{
+	if (u->state == UP_IDLE) {
+		idle_unlink(u);
+		/* one try at a close_notify, so the server knows we are done */
+		tls_close(u->tls);
+	}
+	reactor_kill(u->r, &u->ev);
+}
+
+/*
+ * The server has answered in full and the connection is ready for
+ * another request. Keep it if the pool has room. While it sits there
+ * we watch it for input: the server never speaks first, so anything
+ * readable means it has hung up on us or is confused, and either way
+ * the connection is no good any more.
+ */
+static void upstream_park(struct upstream *u)
+{
+	struct reactor *r = u->r;
+	struct timespec now;
+
+	if (r->nidle >= r->poolmax ||
+	    reactor_want(r, &u->ev, EPOLLIN) == -1) {
+		reactor_kill(r, &u->ev);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	u->idlesince = now.tv_sec;
+	u->state = UP_IDLE;
+	u->idleprev = NULL;
+	if ((u->idlenext = r->idle) != NULL)
+		r->idle->idleprev = u;
+	r->idle = u;
+	++r->nidle;
+}
+
+/*
+ * We are done with the server, one way or the other; the fetch decides
+ * what becomes of what we read. A connection that got its whole answer
+ * goes back to the pool.
+ */
+static void upstream_done(struct upstream *u, int ok)
+{
+	struct fetch *f = u->f;
+
+	wait_unlink(u);
+	u->f = NULL;
+	if (ok)
+		upstream_park(u);
+	else
+		reactor_kill(u->r, &u->ev);
+	if (f != NULL)
+		fetch_end(f, ok);
+}
+
+/* a new connection to the server, set up from there by upstream_run */
+static struct upstream *upstream_connect(struct reactor *r, struct fetch *f)
+{
+	const struct sockaddr_in *sa;
+	struct upstream *u;
+	int serversd, one = 1;
+
+	if ((serversd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+		warn("socket failed");
+		return NULL;
+	}
+	setsockopt(serversd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ((u = calloc(1, sizeof(*u))) == NULL) {
+		warn("calloc");
+		close(serversd);
+		return NULL;
+	}
+	u->ev.kind = EV_UPSTREAM;
+	u->ev.fd = serversd;
+	u->r = r;
+	u->f = f;
+	u->dest = f->peer;
+	u->state = UP_CONNECT;
+	sa = u->dest >= 0 ? peers_addr(r->peers, u->dest) : &r->server_sa;
+
+	if (connect(serversd, (struct sockaddr *)sa, sizeof(*sa)) == -1 &&
+	    errno != EINPROGRESS) {
+		warn("connect failed");
+		goto fail;
+	}
+	if (reactor_want(r, &u->ev, EPOLLOUT) == -1)
+		goto fail;
+	if (u->dest >= 0)
+		wait_link(u);
+	__atomic_add_fetch(&nconnects, 1, __ATOMIC_RELAXED);
+	return u;
+fail:
+	close(serversd);
+	free(u);
+	return NULL;
+}
+
+/*
+ * start fetching a file from the server or the fetch's peer, over an
+ * idle connection to it from the pool if there is one. A pooled
+ * connection is run from the ready list rather than from here, so the
+ * fetch is all set up before anything can happen to it.
+ */
+struct upstream *upstream_start(struct reactor *r, struct fetch *f)
+{
+	struct upstream *u;
+
+	for (u = r->idle; u != NULL && u->dest != f->peer; u = u->idlenext)
+		;
+	if (u == NULL)
+		return upstream_connect(r, f);
+	idle_unlink(u);
+	u->f = f;
+	u->reused = 1;
+	u->off = 0;
+	u->state = UP_SEND_REQUEST;
+	if (u->dest >= 0)
+		wait_link(u);
+	reactor_defer(r, &u->ev);
+	__atomic_add_fetch(&nreused, 1, __ATOMIC_RELAXED);
+	return u;
+}
+
+/*
+ * The peer did not have the file after all, or did not answer in time:
+ * get it from the server instead. Nothing has reached the fetch yet,
+ * so it never knows the difference.
+ */
+static void upstream_fallback(struct upstream *u, int ok)
+{
+	struct reactor *r = u->r;
+	struct fetch *f = u->f;
+
+	wait_unlink(u);
+	u->f = NULL;
+	if (ok)
+		upstream_park(u);
+	else
+		reactor_kill(r, &u->ev);
+	f->peer = -1;
+	if ((f->up = upstream_start(r, f)) == NULL)
+		fetch_end(f, 0);
+}
+
+/*
+ * A pooled connection failed before the server said anything: most
+ * likely the server closed it while it sat idle. That is not the
+ * fetch's fault, so give it a fresh connection instead. A peer that
+ * fails us before it answers gets no second chance; the server does.
+ */
+static void upstream_failed(struct upstream *u)
+{
+	struct fetch *f = u->f;
+
+	if (f != NULL && u->dest >= 0 && u->state <= UP_READ_RESPONSE) {
+		__atomic_add_fetch(&npeerfails, 1, __ATOMIC_RELAXED);
+		upstream_fallback(u, 0);
+		return;
+	}
+	if (!u->reused || f == NULL || u->state > UP_READ_RESPONSE ||
+	    (u->state == UP_READ_RESPONSE && u->off != 0)) {
+		upstream_done(u, 0);
+		return;
+	}
+	u->f = NULL;
+	reactor_kill(u->r, &u->ev);
+	__atomic_add_fetch(&nretries, 1, __ATOMIC_RELAXED);
+	if ((f->up = upstream_connect(f->r, f)) == NULL)
+		fetch_end(f, 0);
+}
+
+/*
+ * close pooled connections that have been idle for too long, and give
+ * up on peers that are too slow to answer
+ */
+void upstream_expire(struct reactor *r)
+{
+	struct upstream *u, *next;
+	struct timespec now;
+	uint64_t ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (u = r->idle; u != NULL; u = next) {
+		next = u->idlenext;
+		if (now.tv_sec - u->idlesince >= r->idletimeout)
+			upstream_close(u);
+	}
+	ms = now_ms();
+	for (u = r->waiting; u != NULL; u = next) {
+		next = u->waitnext;
+		if (ms < u->deadline)
+			continue;
+		DEBUG("Proxy %i: peer %s is too slow, getting %s from server\n",
+		    r->port, peers_name(r->peers, u->dest), u->f->name);
+		__atomic_add_fetch(&npeertimeouts, 1, __ATOMIC_RELAXED);
+		upstream_fallback(u, 0);
+	}
+}
+
+/*
+ * how long the worker may sleep in epoll_wait: until the next peer
+ * deadline, or a second while there are pooled connections to expire
+ */
+int upstream_timeout(struct reactor *r)
+{
+	struct upstream *u;
+	uint64_t first = UINT64_MAX, now;
+
+	if (r->waiting == NULL)
+		return r->idle != NULL ? 1000 : -1;
+	for (u = r->waiting; u != NULL; u = u->waitnext)
+		if (u->deadline < first)
+			first = u->deadline;
+	now = now_ms();
+	if (first <= now)
+		return 0;
+	return first - now < 1000 ? first - now : 1000;
+}
+
+void upstream_event(struct upstream *u, uint32_t events)
+{
+	if (u->state == UP_IDLE) {
+		if (events != 0)
+			upstream_close(u);
+		return;
+	}
+	/* paused, waiting for the client, and the server went away */
+	if (u->ev.events == 0 && (events & (EPOLLHUP | EPOLLERR))) {
+		upstream_done(u, 0);
+		return;
+	}
+	upstream_run(u);
+}
+
+void upstream_report(u_short port)
+{
+	printf("Proxy %u: upstream: %llu connections made (%llu resumed), "
+	    "%llu requests on pooled connections, %llu retried\n", port,
+	    __atomic_load_n(&nconnects, __ATOMIC_RELAXED),
+	    __atomic_load_n(&nresumed, __ATOMIC_RELAXED),
+	    __atomic_load_n(&nreused, __ATOMIC_RELAXED),
+	    __atomic_load_n(&nretries, __ATOMIC_RELAXED));
+	printf("Proxy %u: peers: %llu files from peers, %llu not there after "
+	    "all, %llu failed, %llu too slow\n", port,
+	    __atomic_load_n(&npeerhits, __ATOMIC_RELAXED),
+	    __atomic_load_n(&npeermisses, __ATOMIC_RELAXED),
+	    __atomic_load_n(&npeerfails, __ATOMIC_RELAXED),
+	    __atomic_load_n(&npeertimeouts, __ATOMIC_RELAXED));
+	fflush(stdout);
+}
+
+static void upstream_run(struct upstream *u)
+{
+	struct reactor *r = u->r;
+	struct fetch *f = u->f;
+	struct proto_req rq;
+	struct proto_resp rs;
+	socklen_t len;
+	size_t n;
+	ssize_t ret;
+	char *p;
+	int i, e;
+
+	for (;;) {
+		switch (u->state) {
+		case UP_CONNECT:
+			len = sizeof(e);
+			if (getsockopt(u->ev.fd, SOL_SOCKET, SO_ERROR, &e, &len) == -1 ||
+			    e != 0) {
+				warnx("connect failed (%s)", strerror(e));
+				upstream_failed(u);
+				return;
+			}
+			TRACE(f->tconn, f->treq, T_UPCONNECT, u->dest);
+			if ((u->tls = tls_client()) == NULL) {
+				warnx("tls client creation failed");
+				upstream_failed(u);
+				return;
+			}
+			if (tls_configure(u->tls, u->dest >= 0 ? r->peercfg :
+			    r->upcfg) == -1 ||
+			    tls_connect_socket(u->tls, u->ev.fd, "localhost") == -1) {
+				warnx("tls connection failed (%s)", tls_error(u->tls));
+				upstream_failed(u);
+				return;
+			}
+			u->state = UP_HANDSHAKE;
+			break;
+
+		case UP_HANDSHAKE:
+			if ((i = tls_handshake(u->tls)) == TLS_WANT_POLLIN ||
+			    i == TLS_WANT_POLLOUT)
+				goto wait;
+			if (i == -1) {
+				warnx("tls handshake failed (%s)", tls_error(u->tls));
+				upstream_failed(u);
+				return;
+			}
+			if (tls_conn_session_resumed(u->tls))
+				__atomic_add_fetch(&nresumed, 1, __ATOMIC_RELAXED);
+			TRACE(f->tconn, f->treq, T_UPHANDSHAKE,
+			    tls_conn_session_resumed(u->tls));
+			u->off = 0;
+			u->state = UP_SEND_REQUEST;
+			break;
+
+		case UP_SEND_REQUEST:
+			/* the frame and the name, and a piece's range, in one write */
+			if (u->off == 0) {
+				free(u->req);
+				u->reqlen = PROTO_REQLEN + f->namelen;
+				if (f->chunk >= 0)
+					u->reqlen += PROTO_RANGELEN;
+				if ((u->req = malloc(u->reqlen)) == NULL) {
+					warn("malloc");
+					upstream_done(u, 0);
+					return;
+				}
+				rq.version = PROTO_VERSION;
+				rq.type = (u->dest >= 0 ? PROTO_PEEK : PROTO_GET) |
+				    r->accept;
+				if (f->chunk >= 0)
+					rq.type = PROTO_RANGE;
+				rq.namelen = f->namelen;
+				rq.id = ++u->id;
+				/* only the server is asked about our old copy */
+				rq.tag = f->stale != NULL ? f->stale->tag : 0;
+				proto_put_req(u->req, &rq);
+				memcpy(u->req + PROTO_REQLEN, f->name, f->namelen);
+				if (f->chunk >= 0) {
+					p = (char *)u->req + PROTO_REQLEN + f->namelen;
+					proto_put64((unsigned char *)p,
+					    f->chunk * RANGECHUNK);
+					proto_put64((unsigned char *)p + 8, RANGECHUNK);
+				}
+			}
+			if (u->off == u->reqlen) {
+				u->off = 0;
+				u->state = UP_READ_RESPONSE;
+				break;
+			}
+			ret = tls_write(u->tls, u->req + u->off, u->reqlen - u->off);
+			if ((i = ret) == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT)
+				goto wait;
+			if (ret < 0) {
+				warnx("TLS write failed (%s)", tls_error(u->tls));
+				upstream_failed(u);
+				return;
+			}
+			u->off += ret;
+			break;
+
+		case UP_READ_RESPONSE:
+			ret = tls_read(u->tls, u->hdr + u->off, sizeof(u->hdr) - u->off);
+			if ((i = ret) == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT)
+				goto wait;
+			if (ret <= 0) {
+				if (ret < 0)
+					warnx("tls_read failed (%s)", tls_error(u->tls));
+				upstream_failed(u);
+				return;
+			}
+			u->off += ret;
+			if (u->off < sizeof(u->hdr))
+				break;
+			proto_get_resp(u->hdr, &rs);
+			/* a piece is never deflated, nor bigger than we asked */
+			if (rs.version != PROTO_VERSION || rs.id != u->id ||
+			    (rs.encoding != PROTO_RAW &&
+			    (rs.encoding != PROTO_DEFLATE || r->accept == 0 ||
+			    f->chunk >= 0)) ||
+			    (f->chunk >= 0 && rs.status == PROTO_OK &&
+			    (rs.size < PROTO_RANGEHDRLEN ||
+			    rs.size > PROTO_RANGEHDRLEN + RANGECHUNK))) {
+				warnx("bad response from %s", u->dest >= 0 ?
+				    peers_name(r->peers, u->dest) : "server");
+				upstream_failed(u);
+				return;
+			}
+			wait_unlink(u);
+			TRACE(f->tconn, f->treq, T_UPANSWER, rs.status);
+			if (u->dest >= 0 && rs.status != PROTO_OK) {
+				DEBUG("Proxy %i: peer %s does not have %s, getting it from server\n",
+				    r->port, peers_name(r->peers, u->dest), f->name);
+				__atomic_add_fetch(&npeermisses, 1, __ATOMIC_RELAXED);
+				upstream_fallback(u, 1);
+				return;
+			}
+			if (u->dest >= 0) {
+				DEBUG("Proxy %i: File %s comes from peer %s\n",
+				    r->port, f->name, peers_name(r->peers, u->dest));
+				__atomic_add_fetch(&npeerhits, 1, __ATOMIC_RELAXED);
+			}
+			if (rs.status == PROTO_OK)
+				DEBUG("Proxy %i: File size is %llu%s\n", r->port,
+				    (unsigned long long)rs.size,
+				    rs.encoding == PROTO_DEFLATE ? ", deflated" : "");
+			else
+				DEBUG("Proxy %i: Server says %s for %s\n", r->port,
+				    proto_strstatus(rs.status), f->name);
+			if (fetch_begin(f, rs.status, rs.size, rs.tag,
+			    rs.encoding) == -1) {
+				upstream_done(u, 0);
+				return;
+			}
+			if (rs.status != PROTO_OK || rs.size == 0) {
+				upstream_done(u, 1);
+				return;
+			}
+			u->state = UP_READ_BODY;
+			break;
+
+		case UP_READ_BODY:
+			/* nobody wants the rest of the file */
+			if ((p = fetch_space(f, &n)) == NULL) {
+				upstream_done(u, 0);
+				return;
+			}
+			if (n == 0) {
+				/* the clients have to catch up; they will wake us */
+				i = 0;
+				goto wait;
+			}
+			ret = tls_read(u->tls, p, n);
+			if ((i = ret) == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT)
+				goto wait;
+			if (ret <= 0) {
+				if (ret < 0)
+					warnx("tls_read failed (%s)", tls_error(u->tls));
+				upstream_done(u, 0);
+				return;
+			}
+			fetch_received(f, ret);
+			stats_add(&r->stats.bytesin, ret);
+			if (f->got == f->size) {
+				upstream_done(u, 1);
+				return;
+			}
+			break;
+
+		case UP_IDLE:
+			return;
+		}
+	}
+
+wait:
+	if (reactor_want(r, &u->ev, i) == -1)
+		upstream_done(u, 0);
+}
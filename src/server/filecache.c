@@ -0,0 +1,243 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "filecache.h"
+#include "hash.h"
+#include "proto.h"
+
+#define BUCKETS		512
+#define MAXMAPPED	256	/* open descriptors we are willing to hold */
+#define ZMINSIZE	256	/* smaller files are sent as they are, */
+#define ZMAXSIZE	(16 * 1024 * 1024)	/* and so are bigger ones */
+#define ZHOT		2	/* requests that take it before we bother */
+#define ZSAMPLE		(64 * 1024)
+
+static struct mapped *table[BUCKETS];
+static struct mapped *oldest, *newest;
+static int nmapped;
+
+static struct mapped **bucket(const char *path)
+{
+	uint64_t h[2];
+
+	hash128(path, strlen(path), 0, h);
+	return &table[h[0] % BUCKETS];
+}
+
+static void lru_unlink(struct mapped *m)
+{
+	if (m->older != NULL)
+		m->older->newer = m->newer;
+	else
+		oldest = m->newer;
+	if (m->newer != NULL)
+		m->newer->older = m->older;
+	else
+		newest = m->older;
+	m->older = m->newer = NULL;
+}
+
+static void lru_push(struct mapped *m)
+{
+	m->older = newest;
+	m->newer = NULL;
+	if (newest != NULL)
+		newest->newer = m;
+	else
+		oldest = m;
+	newest = m;
+}
+
+static void mapped_free(struct mapped *m)
+{
+	if (m->base != NULL)
+		munmap(m->base, m->size);
+	free(m->z);
+	close(m->fd);
+	free(m->path);
+	free(m);
+}
+
+void filecache_put(struct mapped *m)
+{
+	if (--m->refs == 0)
+		mapped_free(m);
+}
+
+/* take m out of the table; whoever is still sending from it keeps it */
+static void filecache_drop(struct mapped *m)
+{
+	struct mapped **mp;
+
+	for (mp = bucket(m->path); *mp != m; mp = &(*mp)->next)
+		;
+	*mp = m->next;
+	lru_unlink(m);
+	--nmapped;
+	filecache_put(m);
+}
+
+static int same_file(const struct mapped *m, const struct stat *st)
+{
+	return m->dev == st->st_dev && m->ino == st->st_ino &&
+	    m->size == (uint64_t)st->st_size &&
+	    m->mtime.tv_sec == st->st_mtim.tv_sec &&
+	    m->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * A new inode, size or modification time is a new version. Hashing
+ * them is far cheaper than hashing what is in the file, and as good as
+ * same_file at telling versions apart.
+ */
+static uint64_t file_tag(const struct stat *st)
+{
+	uint64_t v[5] = { st->st_dev, st->st_ino, st->st_size,
+	    st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+	uint64_t tag = hash64(v, sizeof(v), 0);
+
+	return tag != 0 ? tag : 1;
+}
+
+static struct mapped *mapped_new(const char *path)
+{
+	struct mapped *m;
+	struct stat st;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		return NULL;
+	if ((m->path = strdup(path)) == NULL)
+		goto fail;
+	if ((m->fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		goto fail;
+	if (fstat(m->fd, &st) == -1)
+		goto fail_close;
+	if (!S_ISREG(st.st_mode)) {
+		errno = ENOENT;
+		goto fail_close;
+	}
+	m->dev = st.st_dev;
+	m->ino = st.st_ino;
+	m->mtime = st.st_mtim;
+	m->size = st.st_size;
+	m->tag = file_tag(&st);
+	if (m->size > 0) {
+		m->base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->fd, 0);
+		if (m->base == MAP_FAILED) {
+			m->base = NULL;
+			goto fail_close;
+		}
+		/* we always read front to back, and usually all of it */
+		madvise(m->base, m->size, MADV_SEQUENTIAL);
+	}
+	return m;
+fail_close:
+	close(m->fd);
+fail:
+	free(m->path);
+	free(m);
+	return NULL;
+}
+
+/*
+ * The mapping for path, with a reference the caller gives back with
+ * filecache_put, or NULL (and errno) if there is no such regular file.
+ * The file must not shrink while it is mapped, or reading past its new
+ * end gets us a SIGBUS; files are only ever replaced here, which gives
+ * them a new inode.
+ */
+struct mapped *filecache_get(const char *path)
+{
+	struct mapped *m, **b;
+	struct stat st;
+
+	if (stat(path, &st) == -1)
+		return NULL;
+	b = bucket(path);
+	for (m = *b; m != NULL; m = m->next)
+		if (strcmp(m->path, path) == 0)
+			break;
+	if (m != NULL) {
+		if (same_file(m, &st)) {
+			lru_unlink(m);
+			lru_push(m);
+			++m->refs;
+			return m;
+		}
+		filecache_drop(m);	/* changed on disk */
+	}
+
+	if ((m = mapped_new(path)) == NULL)
+		return NULL;
+	while (nmapped >= MAXMAPPED)
+		filecache_drop(oldest);
+	m->refs = 2;		/* the table's and the caller's */
+	m->next = *b;
+	*b = m;
+	lru_push(m);
+	++nmapped;
+	return m;
+}
+
+/*
+ * deflate len bytes at p into a new buffer, after room for the header,
+ * if that gets them at least an eighth smaller
+ */
+static char *deflate_some(const char *p, uLong len, int level, uLongf *zlen)
+{
+	char *z;
+
+	*zlen = compressBound(len);
+	if ((z = malloc(PROTO_ZHDRLEN + *zlen)) == NULL)
+		return NULL;
+	if (compress2((Bytef *)z + PROTO_ZHDRLEN, zlen, (const Bytef *)p, len,
+	    level) != Z_OK || *zlen > len - len / 8) {
+		free(z);
+		return NULL;
+	}
+	return z;
+}
+
+/*
+ * Make m's deflated copy if it does not have one yet and it is worth
+ * having. 1 if it has one now. The worker serves nobody else while it
+ * compresses, so only a file asked for again is deflated, and only if
+ * that takes a moment rather than seconds.
+ */
+int filecache_deflate(struct mapped *m)
+{
+	char *z;
+	uLongf zlen;
+
+	if (m->ztried)
+		return m->z != NULL;
+	if (m->size < ZMINSIZE || m->size > ZMAXSIZE) {
+		m->ztried = 1;
+		return 0;
+	}
+	if (++m->zasked < ZHOT)
+		return 0;
+	m->ztried = 1;
+	/* a quick look first, so incompressible files cost us little */
+	if (m->size > 4 * ZSAMPLE) {
+		if ((z = deflate_some(m->base, ZSAMPLE, Z_BEST_SPEED, &zlen)) == NULL)
+			return 0;
+		free(z);
+	}
+	if ((z = deflate_some(m->base, m->size, Z_DEFAULT_COMPRESSION, &zlen)) == NULL)
+		return 0;
+	proto_put64((unsigned char *)z, m->size);
+	m->z = z;
+	m->zsize = PROTO_ZHDRLEN + zlen;
+	return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+
+/*
+ * Open files and their mappings, kept around by path so a file asked
+ * for again costs a stat and a table lookup instead of an open, an
+ * fstat and an mmap. An entry is thrown away as soon as stat says the
+ * file on disk is not the one we mapped (another inode, size or mtime).
+ *
+ * The files that keep getting asked for have a deflated copy too, made
+ * the second time someone takes one, for as long as the mapping stays:
+ * a file that does not get at least an eighth smaller is not worth it,
+ * and a sample from its start is enough to tell most of those apart.
+ */
+struct mapped {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	uint64_t size;
+	uint64_t tag;		/* names this version of the file, never 0 */
+	int fd;
+	char *base;		/* NULL for an empty file */
+	char *z;		/* the deflated body, NULL if none */
+	uint64_t zsize;
+	int zasked;		/* requests that would have taken it */
+	int ztried;		/* whether to bother making it */
+	int refs;		/* the table's, and one per send in progress */
+	struct mapped *next;	/* hash chain */
+	struct mapped *older, *newer;	/* for dropping the least recent */
+};
+
+struct mapped *filecache_get(const char *);
+void	filecache_put(struct mapped *);
+int	filecache_deflate(struct mapped *);
+
+#endif /* FILECACHE_H */
@@ -1,69 +1,666 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <tls.h>
 #include <sys/stat.h>
 
+#include "filecache.h"
+#include "proto.h"
+#include "stats.h"
+#include "ticket.h"
+#include "trace.h"
+
+/* how long a TLS session ticket from us stays good, in seconds */
+#define SESSION_LIFETIME	(2 * 60 * 60)
+
+/*
+ * how much of a mapped file we hand tls_write at a time; a multiple of
+ * the page size, so every slice of a whole file but the last starts
+ * and ends on a page
+ */
+#define SLICESIZE	(1024 * 1024)
+
+#define DEFAULT_BACKLOG	128
+#define MAXWORKERS	1024
+#define MAXCONNS	256	/* connections one worker keeps open */
+#define IOTIMEOUT	30	/* seconds a client may keep a request waiting */
+
+/*
+ * a client connection, and the socket under it. Nothing on it waits
+ * for the client: its handshake, the request coming in and the answer
+ * going out each get as far as the socket lets them, and carry on the
+ * next time poll says they can. The request under way is read into in,
+ * the header first and then its name and range, up to inlen. The
+ * response under way is its header, then the body from from to end,
+ * out of file's mapping or deflated copy, off being how far it has
+ * got; hdrlen is 0 when there is none.
+ */
+struct conn {
+	struct tls *tls;
+	int fd;
+	uint64_t serial;	/* trace_conn() */
+	int handshaking;	/* the TLS handshake is not done yet */
+	uint64_t opened;	/* stats_now() when it was accepted */
+	unsigned char in[PROTO_REQLEN + PROTO_MAXNAME + PROTO_RANGELEN];
+	size_t inlen, inoff;
+	struct proto_req rq;	/* once its header is in */
+	unsigned char hdr[PROTO_RESPLEN + PROTO_RANGEHDRLEN];
+	size_t hdrlen, hdroff;
+	struct mapped *file;	/* NULL for a header on its own */
+	const char *body;
+	uint64_t from, off, end;
+	uint64_t ahead;		/* read ahead up to here */
+	uint32_t id;
+	uint64_t started;	/* stats_now(), 0 if the request is not timed */
+	int want;		/* what it waits for, TLS_WANT_POLLIN or OUT */
+	time_t since;		/* it last got anywhere */
+};
+
+/*
+ * What one worker has done, for the stats port. Every worker has a
+ * slot in memory they all share, so whichever one takes a scraper's
+ * connection answers for all of them; one that replaces a worker that
+ * died goes on counting in its slot. Only the worker writes to it (see
+ * stats.h). A request's time runs from its header to the last byte of
+ * the answer.
+ */
+struct server_stats {
+	uint64_t requests;
+	uint64_t notfound, notmodified;
+	uint64_t bytesout;
+	uint64_t handshakes, resumed;
+	struct stats_hist handshake, request;
+};
+
+static struct server_stats *stats;	/* nstats slots, one per worker */
+static struct server_stats *mystats;	/* our own, in a worker */
+static int nstats;
+static int statsfd = -1;
+static const char *tracefile;
+
+static volatile sig_atomic_t wantquit;
+
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-workers n] [-backlog n] "
+	    "[-stats-port [address:]port] [-trace file]\n"
+	    "\tportnumber\n", __progname);
 	exit(1);
 }
 
-static void kidhandler(int signum) {
-	/* signal handler for SIGCHLD */
-	waitpid(WAIT_ANY, NULL, WNOHANG);
+static int getcount(const char *arg, int min, int max)
+{
+	char *ep;
+	long n;
+
+	errno = 0;
+	n = strtol(arg, &ep, 10);
+	if (*arg == '\0' || *ep != '\0' || errno == ERANGE || n < min || n > max) {
+		fprintf(stderr, "%s - must be a number from %d to %d\n", arg, min, max);
+		usage();
+	}
+	return n;
+}
+
+/* whether c is in the middle of something, that IOTIMEOUT applies to */
+static int conn_busy(const struct conn *c)
+{
+	return c->handshaking || c->inoff > 0 || c->hdrlen > 0;
+}
+
+/*
+ * Send what is left of the response under way, as far as the socket
+ * takes it without waiting: 1 once it is all out, 0 if the rest waits
+ * for c->want, -1 if the connection failed. The file is read ahead a
+ * slice beyond the one going out.
+ */
+static int conn_flush(struct conn *c)
+{
+	const char *p;
+	size_t len;
+	ssize_t w;
+
+	c->want = 0;
+	for (;;) {
+		if (c->hdroff < c->hdrlen) {
+			p = (const char *)c->hdr + c->hdroff;
+			len = c->hdrlen - c->hdroff;
+		} else if (c->off < c->end) {
+			if (c->body == c->file->base && c->ahead < c->end &&
+			    c->ahead - c->off <= SLICESIZE) {
+				len = c->end - c->ahead < SLICESIZE ?
+				    c->end - c->ahead : SLICESIZE;
+				madvise(c->file->base + c->ahead, len,
+				    MADV_WILLNEED);
+				c->ahead += len;
+			}
+			p = c->body + c->off;
+			len = c->end - c->off < SLICESIZE ?
+			    c->end - c->off : SLICESIZE;
+		} else
+			break;
+		w = tls_write(c->tls, p, len);
+		if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT) {
+			c->want = w;
+			return 0;
+		}
+		if (w < 0) {
+			warnx("TLS write failed (%s)", tls_error(c->tls));
+			return -1;
+		}
+		stats_add(&mystats->bytesout, w);
+		c->since = time(NULL);
+		if (c->hdroff < c->hdrlen) {
+			if ((c->hdroff += w) == c->hdrlen && c->file != NULL)
+				TRACE(c->serial, c->id, T_FIRSTBYTE, 0);
+		} else
+			c->off += w;
+	}
+	if (c->hdrlen > 0 && c->started != 0) {
+		TRACE(c->serial, c->id, T_LASTBYTE,
+		    c->end - c->from);
+		stats_time(&mystats->request, c->started);
+	}
+	if (c->file != NULL)
+		filecache_put(c->file);
+	c->file = NULL;
+	c->hdrlen = c->hdroff = 0;
+	c->from = c->off = c->end = 0;
+	return 1;
+}
+
+/* the response is a header with no body behind it */
+static void send_status(struct conn *c, uint32_t id, int status)
+{
+	struct proto_resp rs = { .version = PROTO_VERSION, .status = status,
+	    .id = id };
+
+	proto_put_resp(c->hdr, &rs);
+	c->hdrlen = PROTO_RESPLEN;
+}
+
+/*
+ * Answer one request, with the header and then the file straight out
+ * of the mapping, or its deflated copy if the request takes that; it
+ * goes out with conn_flush. A range (offset and length, NULL for the
+ * whole file) gets the size of the file after the header, and then
+ * only its own bytes. If the request has the file's current tag, the
+ * header is all it gets.
+ */
+static void serve_file(struct conn *c, uint32_t id, const char *name,
+    uint64_t tag, int deflate, const uint64_t *range)
+{
+	struct proto_resp rs = { .version = PROTO_VERSION, .status = PROTO_OK,
+	    .id = id };
+	struct mapped *file;
+	uint64_t size = 0, start = 0;
+	char filePath[sizeof("serverfiles/") + PROTO_MAXNAME];
+
+	DEBUG("Server received:  %s\n", name);
+	snprintf(filePath, sizeof(filePath), "serverfiles/%s", name);
+	file = filecache_get(filePath);
+	TRACE(c->serial, id, T_LOOKUP, file != NULL);
+	if (file == NULL) {
+		DEBUG("Server: file %s does not exist\n", name);
+		stats_add(&mystats->notfound, 1);
+		send_status(c, id, PROTO_NOTFOUND);
+		return;
+	}
+	rs.tag = file->tag;
+	c->hdrlen = PROTO_RESPLEN;
+	if (tag == file->tag) {
+		DEBUG("Server: file %s not modified\n", name);
+		stats_add(&mystats->notmodified, 1);
+		rs.status = PROTO_NOTMODIFIED;
+		proto_put_resp(c->hdr, &rs);
+		filecache_put(file);
+		return;
+	}
+	DEBUG("Server: file %s exists, sending now\n", name);
+	size = file->size;
+	c->body = file->base;
+	DEBUG("Server: File size is %llu bytes\n", (unsigned long long)size);
+	if (range != NULL) {
+		start = range[0] < size ? range[0] : size;
+		if (size - start > range[1])
+			size = start + range[1];
+		proto_put64(c->hdr + PROTO_RESPLEN, file->size);
+		c->hdrlen += PROTO_RANGEHDRLEN;
+		DEBUG("Server: sending bytes %llu to %llu\n",
+		    (unsigned long long)start, (unsigned long long)size);
+	} else if (deflate && filecache_deflate(file)) {
+		size = file->zsize;
+		c->body = file->z;
+		rs.encoding = PROTO_DEFLATE;
+		DEBUG("Server: deflated to %llu bytes\n", (unsigned long long)size);
+	}
+
+	//the header, with the body size in it, then the body
+	rs.size = c->hdrlen - PROTO_RESPLEN + size - start;
+	proto_put_resp(c->hdr, &rs);
+	c->file = file;
+	c->from = c->off = start;
+	c->end = size;
+	c->ahead = size - start < SLICESIZE ? size : start + SLICESIZE;
+}
+
+/*
+ * Read on at the next request, as far as the client has sent it: 1
+ * once it is all in, 0 if the rest waits for c->want, -1 if the client
+ * closed the connection or it is no good. How long the rest is, the
+ * header says.
+ */
+static int recv_request(struct conn *c)
+{
+	ssize_t r;
+
+	while (c->inoff < c->inlen) {
+		r = tls_read(c->tls, c->in + c->inoff, c->inlen - c->inoff);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT) {
+			c->want = r;
+			return 0;
+		}
+		if (r < 0) {
+			warnx("tls_read failed (%s)", tls_error(c->tls));
+			return -1;
+		}
+		if (r == 0) {
+			if (c->inoff > 0)
+				warnx("short request");
+			return -1;
+		}
+		c->inoff += r;
+		c->since = time(NULL);
+		if (c->inoff < PROTO_REQLEN || c->inlen > PROTO_REQLEN)
+			continue;
+		c->started = stats_now();
+		proto_get_req(c->in, &c->rq);
+		/* serve_conn turns those away */
+		if (c->rq.version != PROTO_VERSION ||
+		    c->rq.namelen > PROTO_MAXNAME)
+			break;
+		c->inlen += c->rq.namelen;
+		if ((c->rq.type & PROTO_TYPEMASK) == PROTO_RANGE)
+			c->inlen += PROTO_RANGELEN;
+	}
+	return 1;
+}
+
+/* the TLS handshake, as far as it goes: like recv_request */
+static int conn_handshake(struct conn *c)
+{
+	int i;
+
+	if ((i = tls_handshake(c->tls)) == TLS_WANT_POLLIN ||
+	    i == TLS_WANT_POLLOUT) {
+		c->want = i;
+		return 0;
+	}
+	if (i == -1) {
+		warnx("tls handshake failed (%s)", tls_error(c->tls));
+		return -1;
+	}
+	c->handshaking = 0;
+	c->since = time(NULL);
+	DEBUG("Server: %s TLS handshake\n",
+	    tls_conn_session_resumed(c->tls) ? "resumed" : "full");
+	TRACE(c->serial, 0, T_HANDSHAKE, tls_conn_session_resumed(c->tls));
+	stats_add(&mystats->handshakes, 1);
+	if (tls_conn_session_resumed(c->tls))
+		stats_add(&mystats->resumed, 1);
+	stats_time(&mystats->handshake, c->opened);
+	return 1;
+}
+
+/*
+ * The proxy keeps the connection open and sends one request after the
+ * other, until it closes its side. Answer what it has sent, in the
+ * order it came, until there is nothing more for now or the socket
+ * has no room for more; 0 then, or -1 once the connection is done
+ * with. The next request is only read once the last answer is out.
+ */
+static int serve_conn(struct conn *c)
+{
+	char name[PROTO_MAXNAME + 1];
+	struct proto_req rq;
+	uint64_t range[2], start;
+	int type, ret;
+
+	if (c->handshaking && (ret = conn_handshake(c)) != 1)
+		return ret;
+	for (;;) {
+		if ((ret = conn_flush(c)) != 1)
+			return ret;
+		if ((ret = recv_request(c)) != 1)
+			return ret;
+		rq = c->rq;
+		start = c->started;
+		c->started = 0;
+		c->inoff = 0;
+		c->inlen = PROTO_REQLEN;
+		stats_add(&mystats->requests, 1);
+		c->id = rq.id;
+		if (rq.version != PROTO_VERSION) {
+			warnx("protocol version %u not supported", rq.version);
+			send_status(c, 0, PROTO_BADVERSION);
+			conn_flush(c);
+			return -1;
+		}
+		if (rq.namelen > PROTO_MAXNAME) {
+			/* we cannot skip past the name, so give up */
+			send_status(c, rq.id, PROTO_BADREQ);
+			conn_flush(c);
+			return -1;
+		}
+		memcpy(name, c->in + PROTO_REQLEN, rq.namelen);
+		type = rq.type & PROTO_TYPEMASK;
+		if (type == PROTO_RANGE) {
+			range[0] = proto_get64(c->in + PROTO_REQLEN + rq.namelen);
+			range[1] = proto_get64(c->in + PROTO_REQLEN + rq.namelen + 8);
+		}
+		/*
+		 * we must make absolutely sure name has a terminating 0 byte
+		 * if we are to use it as a C string
+		 */
+		name[rq.namelen] = '\0';
+		TRACE(c->serial, rq.id, T_NAME, 0);
+		if ((type != PROTO_GET && type != PROTO_RANGE) ||
+		    rq.namelen == 0 ||
+		    strlen(name) != rq.namelen) {
+			send_status(c, rq.id, PROTO_BADREQ);
+			continue;
+		}
+		c->started = start;
+		serve_file(c, rq.id, name, rq.tag,
+		    rq.type & PROTO_ACCEPT_DEFLATE,
+		    type == PROTO_RANGE ? range : NULL);
+	}
+}
+
+/*
+ * a new connection; its TLS handshake is the first thing serve_conn
+ * does with it. -1 if it did not work out.
+ */
+static int conn_open(struct conn *c, struct tls *tls_ctx, int fd)
+{
+	int one = 1;
+
+	/* a response header is not to wait on the ACK for the last body */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	c->serial = trace_conn();
+	c->opened = stats_now();
+	c->since = time(NULL);
+	c->handshaking = 1;
+	c->inlen = PROTO_REQLEN;
+	TRACE(c->serial, 0, T_ACCEPT, 0);
+	if (tls_accept_socket(tls_ctx, &c->tls, fd) == -1) {
+		warnx("tls accept failed (%s)", tls_error(tls_ctx));
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * a close_notify if the socket has room for it; a client that cannot
+ * take even that is not waited for
+ */
+static void conn_close(struct conn *c)
+{
+	if (c->file != NULL)
+		filecache_put(c->file);
+	tls_close(c->tls);
+	tls_free(c->tls);
+	close(c->fd);
+}
+
+/* every worker's counters, and the histograms for all of them */
+static void stats_snapshot(FILE *fp, void *arg)
+{
+	static const struct {
+		const char *name;
+		size_t off;
+	} counters[] = {
+		{ "server_requests_total", offsetof(struct server_stats, requests) },
+		{ "server_not_found_total", offsetof(struct server_stats, notfound) },
+		{ "server_not_modified_total",
+		    offsetof(struct server_stats, notmodified) },
+		{ "server_bytes_out_total", offsetof(struct server_stats, bytesout) },
+		{ "server_handshakes_total", offsetof(struct server_stats, handshakes) },
+		{ "server_resumed_total", offsetof(struct server_stats, resumed) },
+	};
+	struct stats_hist handshake, request;
+	size_t i;
+	int w;
+
+	(void)arg;
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+		for (w = 0; w < nstats; ++w)
+			stats_put(fp, counters[i].name, "worker", w,
+			    stats_get((uint64_t *)((char *)&stats[w] +
+			    counters[i].off)));
+	memset(&handshake, 0, sizeof(handshake));
+	memset(&request, 0, sizeof(request));
+	for (w = 0; w < nstats; ++w) {
+		stats_merge(&handshake, &stats[w].handshake);
+		stats_merge(&request, &stats[w].request);
+	}
+	stats_put_hist(fp, "server_handshake_seconds", &handshake);
+	stats_put_hist(fp, "server_request_seconds", &request);
+}
+
+/*
+ * One worker. It takes its share of the new connections off the
+ * listening socket, which all workers wait on, and serves whichever of
+ * its connections has a request for it, or room for more of an answer.
+ * Handshakes, requests and answers go as far as the socket lets them
+ * and the rest waits for the next time round, so a slow client holds
+ * up nobody else; one that gets nowhere for IOTIMEOUT in the middle of
+ * any of them is dropped. An idle connection,
+ * like the ones a proxy keeps in its pool, only costs it a slot. The
+ * file cache is the worker's own, and lasts as long as it does.
+ */
+static void worker(int sd, struct tls *tls_ctx, struct tls_config *tls_cfg,
+    const struct tickets *tickets, uint32_t keyrev)
+{
+	struct pollfd pfd[MAXCONNS + 2];
+	struct conn conns[MAXCONNS];
+	int nconns = 0, clientsd, i, timeout;
+	time_t now;
+
+	for (;;) {
+		/* with no room left, the other workers take the new ones */
+		pfd[0].fd = nconns < MAXCONNS ? sd : -1;
+		pfd[0].events = POLLIN;
+		timeout = -1;
+		for (i = 0; i < nconns; ++i) {
+			pfd[i + 1].fd = conns[i].fd;
+			pfd[i + 1].events = conns[i].want == TLS_WANT_POLLOUT ?
+			    POLLOUT : POLLIN;
+			/* look in on the ones under way once a second */
+			if (conn_busy(&conns[i]))
+				timeout = 1000;
+		}
+		/* and last, the stats port, which is -1 if we have none */
+		pfd[nconns + 1].fd = statsfd;
+		pfd[nconns + 1].events = POLLIN;
+		if (poll(pfd, nconns + 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll failed");
+		}
+		if (pfd[nconns + 1].revents & POLLIN)
+			stats_serve(statsfd, stats_snapshot, NULL);
+		/* from the end, so the last one can take the place of one that goes */
+		now = time(NULL);
+		for (i = nconns - 1; i >= 0; --i) {
+			if (pfd[i + 1].revents != 0) {
+				if (serve_conn(&conns[i]) == 0)
+					continue;
+			} else if (!conn_busy(&conns[i]) ||
+			    now - conns[i].since <= IOTIMEOUT)
+				continue;
+			else
+				warnx("client too slow, dropping it");
+			conn_close(&conns[i]);
+			conns[i] = conns[--nconns];
+		}
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		/* keep our ticket keys current; every worker agrees on them */
+		if (tickets_rotate(tickets, tls_cfg, &keyrev) == -1)
+			warnx("TLS ticket key rotation failed (%s)", tls_config_error(tls_cfg));
+		/*
+		 * one at a time: every worker woke up for it, and the next
+		 * handshake is better done by one that is not busy with this
+		 */
+		if ((clientsd = accept4(sd, NULL, NULL, SOCK_NONBLOCK)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED)
+				warn("accept failed");
+			continue;
+		}
+		if (conn_open(&conns[nconns], tls_ctx, clientsd) == -1)
+			continue;
+		/* the client has most likely said hello already */
+		if (serve_conn(&conns[nconns]) == -1)
+			conn_close(&conns[nconns]);
+		else
+			++nconns;
+	}
+}
+
+static pid_t worker_start(int slot, int sd, struct tls *tls_ctx,
+    struct tls_config *tls_cfg, const struct tickets *tickets, uint32_t keyrev)
+{
+	pid_t pid, parent = getpid();
+
+	fflush(stdout);
+	if ((pid = fork()) == -1)
+		warn("fork failed");
+	if (pid != 0)
+		return pid;
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	/* no worker outlives the server */
+	if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != parent)
+		exit(1);
+	mystats = &stats[slot];
+	if (tracefile != NULL)
+		trace_open(tracefile);
+	worker(sd, tls_ctx, tls_cfg, tickets, keyrev);
+	exit(0);
+}
+
+static void quithandler(int signum)
+{
+	(void)signum;
+	wantquit = 1;
 }
 
 
 int main(int argc,  char *argv[])
 {
-	struct sockaddr_in sockname, client;
+	static struct option longopts[] = {
+		{ "workers",	required_argument,	NULL,	'w' },
+		{ "backlog",	required_argument,	NULL,	'b' },
+		{ "stats-port",	required_argument,	NULL,	'Q' },
+		{ "trace",	required_argument,	NULL,	'G' },
+		{ NULL,		0,			NULL,	0 }
+	};
+	const char *statsaddr = NULL;
+	struct sockaddr_in sockname;
 	char buffer[80], *ep;
 	struct sigaction sa;
-	int sd, i;
-	socklen_t clientlen;
+	int sd, i, ch, nworkers, backlog = DEFAULT_BACKLOG;
 	u_short port;
-	pid_t pid;
+	pid_t pid, *workers;
+	time_t *started;
 	u_long p;
 	struct tls_config *tls_cfg = NULL; // TLS config
 	struct tls *tls_ctx = NULL; // TLS context
-	struct tls *tls_cctx = NULL; // client's TLS context
+	struct tickets tickets;
+	uint32_t keyrev;
+
+	/* a worker per core, unless we are told otherwise */
+	if ((nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nworkers = 1;
+	if (nworkers > MAXWORKERS)
+		nworkers = MAXWORKERS;
+	while ((ch = getopt_long_only(argc, argv, "", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'w':
+			nworkers = getcount(optarg, 1, MAXWORKERS);
+			break;
+		case 'b':
+			backlog = getcount(optarg, 1, INT_MAX);
+			break;
+		case 'Q':
+			statsaddr = optarg;
+			break;
+		case 'G':
+			tracefile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
 	/*
 	 * first, figure out what port we will listen on - it should
 	 * be our first parameter.
 	 */
 
-	if (argc != 2)
+	if (argc != 1)
 		usage();
 		errno = 0;
-        p = strtoul(argv[1], &ep, 10);
-        if (*argv[1] == '\0' || *ep != '\0') {
+        p = strtoul(argv[0], &ep, 10);
+        if (*argv[0] == '\0' || *ep != '\0') {
 		/* parameter wasn't a number, or was empty */
-		fprintf(stderr, "%s - not a number\n", argv[1]);
+		fprintf(stderr, "%s - not a number\n", argv[0]);
 		usage();
 	}
         if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
 		/* It's a number, but it either can't fit in an unsigned
 		 * long, or is too big for an unsigned short
 		 */
-		fprintf(stderr, "%s - value out of range\n", argv[1]);
+		fprintf(stderr, "%s - value out of range\n", argv[0]);
 		usage();
 	}
 	/* now safe to do this */
 	port = p;
+	/* the workers open it for themselves; find out now if they can't */
+	if (tracefile != NULL &&
+	    ((i = open(tracefile, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1 ||
+	    close(i) == -1))
+		err(1, "%s", tracefile);
 
 	/* set up TLS */
 	if ((tls_cfg = tls_config_new()) == NULL)
@@ -74,6 +671,9 @@ int main(int argc,  char *argv[])
 		errx(1, "unable to set TLS certificate file, error: (%s)", tls_config_error(tls_cfg));
 	if (tls_config_set_key_file(tls_cfg, "../../certificates/server.key") == -1)
 		errx(1, "unable to set TLS key file");
+	tickets_init(&tickets, SESSION_LIFETIME);
+	if (tickets_configure(&tickets, tls_cfg, &keyrev) == -1)
+		errx(1, "unable to set up TLS session tickets (%s)", tls_config_error(tls_cfg));
 	if ((tls_ctx = tls_server()) == NULL)
 		errx(1, "TLS server creation failed");
 	if (tls_configure(tls_ctx, tls_cfg) == -1)
@@ -91,153 +691,83 @@ int main(int argc,  char *argv[])
 	sd=socket(AF_INET,SOCK_STREAM,0);
 	if ( sd == -1)
 		err(1, "socket failed");
+	/* we close connections first now, so restart despite TIME_WAIT */
+	i = 1;
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) == -1)
+		err(1, "setsockopt SO_REUSEADDR failed");
 
 	if (bind(sd, (struct sockaddr *) &sockname, sizeof(sockname)) == -1)
 		err(1, "bind failed");
 
-	if (listen(sd,3) == -1)
+	if (listen(sd, backlog) == -1)
 		err(1, "listen failed");
 
 	/*
 	 * we're now bound, and listening for connections on "sd" -
 	 * each call to "accept" will return us a descriptor talking to
-	 * a connected client
+	 * a connected client. The workers all wait on it, and whichever
+	 * gets there first takes the connection; the others must not
+	 * block when there is nothing left for them.
 	 */
+	if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) == -1)
+		err(1, "fcntl failed");
 
+	/* SIGINT and SIGTERM take the workers down with us */
+	sa.sa_handler = quithandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	if (sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGTERM, &sa, NULL) == -1)
+		err(1, "sigaction failed");
 
-	/*
-	 * first, let's make sure we can have children without leaving
-	 * zombies around when they die - we can do this by catching
-	 * SIGCHLD.
-	 */
-	sa.sa_handler = kidhandler;
-        sigemptyset(&sa.sa_mask);
-	/*
-	 * we want to allow system calls like accept to be restarted if they
-	 * get interrupted by a SIGCHLD
-	 */
-        sa.sa_flags = SA_RESTART;
-        if (sigaction(SIGCHLD, &sa, NULL) == -1)
-                err(1, "sigaction failed");
+	/* the proxy may drop a pooled connection without waiting for us */
+	signal(SIGPIPE, SIG_IGN);
 
 	/*
-	 * finally - the main loop.  accept connections and deal with 'em
+	 * finally - the main loop. A fixed set of workers deals with the
+	 * connections; all we do is start a new one whenever one dies,
+	 * though not more than once a second for the same slot, in case
+	 * they keep dying.
 	 */
-	printf("Server up and listening for connections on port %u\n", port);
-	for(;;) {
-		int clientsd;
-		clientlen = sizeof(&client);
-		clientsd = accept(sd, (struct sockaddr *)&client, &clientlen);
-		if (clientsd == -1)
-			err(1, "accept failed");
-		/*
-		 * We fork child to deal with each connection, this way more
-		 * than one client can connect to us and get served at any one
-		 * time.
-		 */
-
-		pid = fork();
-		if (pid == -1)
-		     err(1, "fork failed");
-
-		if(pid == 0) {
-			ssize_t written, w;
-			i = 0;
-			if (tls_accept_socket(tls_ctx, &tls_cctx, clientsd) == -1)
-				errx(1, "tls accept failed (%s)", tls_error(tls_ctx));
-			else {
-				do {
-					if ((i = tls_handshake(tls_cctx)) == -1)
-						errx(1, "tls handshake failed (%s)", tls_error(tls_ctx));
-				} while(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
-			}
-
-			ssize_t r, rc;
-			size_t maxread;
-
-			strlcpy(buffer,
-			    "                                                                                ",
-			    sizeof(buffer));
-
-			r = -1;
-			rc = 0;
-			maxread = sizeof(buffer) - 1; /* leave room for a 0 byte */
-			while ((r != 0) && rc < maxread) {
-				r = tls_read(tls_cctx, buffer + rc, maxread - rc);
-				if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
-					continue;
-				if (r < 0) {
-					err(1, "tls_read failed (%s)", tls_error(tls_cctx));
-				} else
-					rc += r;
-			}
-			/*
-			 * we must make absolutely sure buffer has a terminating 0 byte
-			 * if we are to use it as a C string
-			 */
-			buffer[rc] = '\0';
-
-			printf("Server received:  %s\n",buffer);
-			FILE *file;
-			int size = 0;
-			char fileChar = 0;
-			int pos = 0;
-			char filePath[160];
-			strcpy(filePath, "serverfiles/");
-			strcat(filePath, buffer);
-			
-			
-			if (access(filePath, R_OK) != -1)
-			{
-				printf("Server: file %s exists, sending now\n", buffer);
-				file = fopen(filePath, "r");
-				fseek(file, 0L, SEEK_END);
-				size = ftell(file);
-				printf("Server: File size is %i bytes\n", size);
-				rewind(file);
-				
-				char fileBuffer[size];
-				while (pos < size)
-				{
-					fileChar = fgetc(file);
-					fileBuffer[pos] = fileChar;
-					++pos;
-				}
-				
-				//send file size to proxy
-				w = tls_write(tls_cctx, &size, 4);
-				
-				//send file to proxy
-				w = 0;
-				written = 0;
-				while (written < strlen(fileBuffer)) {
-					w = tls_write(tls_cctx, fileBuffer + written,
-						strlen(fileBuffer) - written);
-
-					if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
-						continue;
-
-					if (w < 0) {
-						errx(1, "TLS write failed (%s)", tls_error(tls_cctx));
-					}
-					else
-						written += w;
-				}
-				i = 0;
-				do {
-					i = tls_close(tls_cctx);
-				} while(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
-
-				close(clientsd);
-				fclose(file);
-			}
-			else
-			{
-				printf("Server: file %s does not exist\n", buffer);
-				w = tls_write(tls_cctx, &size, sizeof(size));
-			}
-
+	printf("Server up and listening for connections on port %u, "
+	    "%d workers\n", port, nworkers);
+	if ((workers = calloc(nworkers, sizeof(*workers))) == NULL ||
+	    (started = calloc(nworkers, sizeof(*started))) == NULL)
+		err(1, "calloc");
+	/* a stats slot for every worker, shared with all of them */
+	if ((stats = mmap(NULL, nworkers * sizeof(*stats), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		err(1, "mmap");
+	nstats = nworkers;
+	if (statsaddr != NULL)
+		statsfd = stats_listen(statsaddr);
+	for (i = 0; i < nworkers; ++i) {
+		workers[i] = worker_start(i, sd, tls_ctx, tls_cfg, &tickets, keyrev);
+		started[i] = time(NULL);
+	}
+	while (!wantquit) {
+		if ((pid = wait(NULL)) == -1) {
+			if (errno != EINTR)
+				err(1, "wait failed");
+			continue;
 		}
-		close(clientsd);
+		for (i = 0; i < nworkers && workers[i] != pid; ++i)
+			;
+		if (i == nworkers || wantquit)
+			continue;
+		warnx("worker %ld died, starting another", (long)pid);
+		if (time(NULL) - started[i] < 1)
+			sleep(1);
+		/* the ticket keys it starts with; it rotates them from there */
+		if (tickets_rotate(&tickets, tls_cfg, &keyrev) == -1)
+			warnx("TLS ticket key rotation failed (%s)", tls_config_error(tls_cfg));
+		workers[i] = worker_start(i, sd, tls_ctx, tls_cfg, &tickets, keyrev);
+		started[i] = time(NULL);
 	}
+	for (i = 0; i < nworkers; ++i)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	while (wait(NULL) != -1 || errno == EINTR)
+		;
+	return 0;
 }